@@ -0,0 +1,291 @@
+// Keystroke replay benchmark.
+//
+// Usage: bench [megabytes] [rows] [columns] [trace file]
+// Runs the editor core against a virtual terminal of a fixed size (80x24 by
+// default): loads a generated log file of the given size, then replays a
+// script of keystrokes that types, moves the cursor, pages, pastes and saves.
+// Every step of the script is one frame, its keys handled and the screen
+// drawn, as the main loop would. For each kind of step it prints the frame
+// times (p50/p99), the bytes sent to the terminal and the allocations made.
+// With a trace file, the run is also recorded as a Chrome trace.
+
+#include "editor.cpp"
+
+// Takes the keys of the script and counts what the editor writes. Reads never
+// wait, the script is queued before each frame.
+struct Virtual_Terminal {
+    size_t Rows, Columns;
+    XBuffer Pending;
+    size_t ReadAt;
+    u64 BytesWritten;
+};
+
+static ssize_t
+VirtualRead(void* context, u8* data, size_t size, int) {
+    Virtual_Terminal* terminal = (Virtual_Terminal*)context;
+    size_t available = terminal->Pending.Used - terminal->ReadAt;
+    if(size > available) size = available;
+    memcpy(data, terminal->Pending.Data + terminal->ReadAt, size);
+    terminal->ReadAt += size;
+    if(terminal->ReadAt == terminal->Pending.Used) {
+        terminal->Pending.Used = 0;
+        terminal->ReadAt = 0;
+    }
+    return size;
+}
+
+static void
+VirtualWrite(void* context, char*, size_t size) {
+    Virtual_Terminal* terminal = (Virtual_Terminal*)context;
+    terminal->BytesWritten += size;
+}
+
+static b32
+VirtualGetSize(void* context, size_t* rows, size_t* columns) {
+    Virtual_Terminal* terminal = (Virtual_Terminal*)context;
+    *rows = terminal->Rows;
+    *columns = terminal->Columns;
+    return true;
+}
+
+enum Bench_Kind {
+    BenchKind_Type,
+    BenchKind_Move,
+    BenchKind_Page,
+    BenchKind_Paste,
+    BenchKind_Save,
+
+    BenchKind_Count
+};
+
+global char* BenchKindNames[BenchKind_Count] = {"type", "move", "page", "paste", "save"};
+
+// The keys of one frame, in the script buffer
+struct Bench_Step {
+    u32 Kind;
+    size_t Start;
+    size_t Length;
+};
+
+struct Bench_Script {
+    XBuffer Keys;
+    Bench_Step* Steps;
+    size_t Count;
+    size_t Capacity;
+};
+
+struct Bench_Stats {
+    f64* Times;
+    size_t Count;
+    u64 Bytes;
+    u64 Allocations;
+    u64 LineAllocations;
+};
+
+inline u32
+NextRandom(u32* seed) {
+    *seed ^= *seed << 13; *seed ^= *seed >> 17; *seed ^= *seed << 5;
+    return *seed;
+}
+
+static void
+AddStep(Bench_Script* script, u32 kind, char* keys, size_t length) {
+    if(script->Count == script->Capacity) {
+        script->Capacity = script->Capacity ? script->Capacity * 2 : 256;
+        script->Steps = (Bench_Step*)realloc(script->Steps, script->Capacity * sizeof(Bench_Step));
+        Assert(script->Steps);
+    }
+    Bench_Step* step = script->Steps + script->Count++;
+    step->Kind = kind;
+    step->Start = script->Keys.Used;
+    step->Length = length;
+    AppendToBuffer(&script->Keys, keys, length);
+}
+
+// Log lines like "2024-05-17 10:42:07 INFO worker 3: request 81723 done in 42 ms"
+static size_t
+GenerateLogLine(char* line, size_t size, u32* seed) {
+    persist char* levels[] = {"INFO", "INFO", "INFO", "DEBUG", "WARN", "ERROR"};
+    persist char* events[] = {"done in", "queued behind", "retried after", "timed out after"};
+    u32 pick = NextRandom(seed);
+    int length = snprintf(line, size, "2024-05-17 %02u:%02u:%02u %s worker %u: request %u %s %u ms",
+                          pick % 24, (pick >> 5) % 60, (pick >> 11) % 60, levels[(pick >> 17) % 6],
+                          (pick >> 20) % 16, NextRandom(seed) % 1000000, events[(pick >> 24) % 4], (pick >> 26) % 500);
+    return (size_t)length < size ? (size_t)length : size - 1;
+}
+
+// A log file of about `size` bytes, in a temporary file whose name ends up in `path`
+static b32
+GenerateFile(char* path, size_t size) {
+    int fileHandle = mkstemps(path, 4);
+    if(fileHandle == -1) return false;
+
+    u32 seed = 0x1234567;
+    char* data = (char*)malloc(size + 256);
+    Assert(data);
+    size_t used = 0;
+    while(used < size) {
+        used += GenerateLogLine(data + used, 256, &seed);
+        data[used++] = '\n';
+    }
+
+    b32 written = write(fileHandle, data, used) == (ssize_t)used;
+    free(data);
+    close(fileHandle);
+    return written;
+}
+
+// Rounds of typing in the middle of the file, moving about, paging both ways
+// and pasting, with a save every few rounds
+static void
+BuildScript(Bench_Script* script, u32 rounds) {
+    u32 seed = 0x7654321;
+    char line[256];
+    for(u32 round = 0; round < rounds; round++) {
+        for(int page = 0; page < 4; page++) AddStep(script, BenchKind_Page, "\x1b[6~", 4);
+
+        for(int key = 0; key < 100; key++) {
+            u32 pick = NextRandom(&seed);
+            char character = (char)('a' + pick % 26);
+            if(pick % 7 == 0) character = ' ';
+            if(pick % 41 == 0) character = '\r';
+            if(pick % 53 == 0) character = KeyType_Backspace;
+            AddStep(script, BenchKind_Type, &character, 1);
+        }
+
+        for(int move = 0; move < 40; move++) {
+            persist char* keys[] = {"\x1b[A", "\x1b[B", "\x1b[C", "\x1b[D", "\x1b[H", "\x1b[F"};
+            char* key = keys[NextRandom(&seed) % 6];
+            AddStep(script, BenchKind_Move, key, strlen(key));
+        }
+
+        // The terminal sends the lines of a paste with \r
+        XBuffer paste = {};
+        AppendToBuffer(&paste, "\x1b[200~", 6);
+        for(int lineIndex = 0; lineIndex < 100; lineIndex++) {
+            size_t length = GenerateLogLine(line, sizeof(line), &seed);
+            line[length++] = '\r';
+            AppendToBuffer(&paste, line, length);
+        }
+        AppendToBuffer(&paste, "\x1b[201~", 6);
+        AddStep(script, BenchKind_Paste, paste.Data, paste.Used);
+        FreeBuffer(&paste);
+
+        for(int page = 0; page < 2; page++) AddStep(script, BenchKind_Page, "\x1b[5~", 4);
+
+        if(round % 5 == 4) {
+            char key = CTRL_KEY('s');
+            AddStep(script, BenchKind_Save, &key, 1);
+        }
+    }
+}
+
+static int
+CompareTimes(const void* a, const void* b) {
+    f64 first = *(f64*)a;
+    f64 second = *(f64*)b;
+    return (first > second) - (first < second);
+}
+
+inline f64
+Percentile(f64* sorted, size_t count, u32 percent) {
+    return count ? sorted[(count - 1) * percent / 100] : 0;
+}
+
+int main(int argCount, char** args) {
+    size_t size = (size_t)(argCount >= 2 ? atol(args[1]) : 64) * 1024 * 1024;
+    Virtual_Terminal terminal = {};
+    terminal.Rows = argCount >= 3 ? atol(args[2]) : 24;
+    terminal.Columns = argCount >= 4 ? atol(args[3]) : 80;
+
+    InitScanKernels();
+    InitCharWidths();
+    if(argCount >= 5) {
+        int error = StartTrace(args[4]);
+        if(error) {
+            fprintf(stderr, "ERROR: Can't write the trace to %s: %s\n", args[4], strerror(error));
+            return -1;
+        }
+    }
+
+    char path[] = "/tmp/bench-XXXXXX.log";
+    if(!GenerateFile(path, size)) {
+        fprintf(stderr, "ERROR: Can't write a %lu byte file to /tmp\n", size);
+        return -1;
+    }
+
+    Bench_Script script = {};
+    BuildScript(&script, 50);
+
+    Editor_Backend backend = {&terminal, VirtualRead, VirtualWrite, VirtualGetSize};
+    Term_Editor editor = {};
+    if(!InitEditor(&editor, &backend, 0)) {
+        fprintf(stderr, "ERROR: A %lux%lu terminal is too small\n", terminal.Rows, terminal.Columns);
+        return -1;
+    }
+
+    // Load and index all of it, and let the highlighter catch up, as an idle editor would
+    f64 start = GetSeconds();
+    LoadFile(&editor, path);
+    IndexFile(&editor, (size_t)-1, 0);
+    do {
+        UpdateScreen(&editor);
+    } while(IsHighlightPending(&editor.Highlight));
+    f64 loadSeconds = GetSeconds() - start;
+
+    Bench_Stats stats[BenchKind_Count] = {};
+    for(u32 kind = 0; kind < BenchKind_Count; kind++) {
+        stats[kind].Times = (f64*)malloc(script.Count * sizeof(f64));
+        Assert(stats[kind].Times);
+    }
+
+    for(size_t index = 0; index < script.Count; index++) {
+        Bench_Step* step = script.Steps + index;
+        AppendToBuffer(&terminal.Pending, script.Keys.Data + step->Start, step->Length);
+
+        u64 bytes = terminal.BytesWritten;
+        u64 allocations = HeapAllocations();
+        u64 lineAllocations = editor.Text.Arena.Allocations;
+        start = GetSeconds();
+
+        FillInput(&editor.Input, 0);
+        HandleInput(&editor);
+        UpdateSave(&editor);
+        UpdateFollow(&editor);
+        UpdateRecovery(&editor);
+        UpdateScreen(&editor);
+
+        Bench_Stats* stat = stats + step->Kind;
+        stat->Times[stat->Count++] = GetSeconds() - start;
+        stat->Bytes += terminal.BytesWritten - bytes;
+        stat->Allocations += HeapAllocations() - allocations;
+        stat->LineAllocations += editor.Text.Arena.Allocations - lineAllocations;
+
+        // A save runs in the background, wait for it outside of the frame
+        if(editor.Save.Running) {
+            while(!IsSaveDone(&editor.Save)) usleep(1000);
+            UpdateSave(&editor);
+        }
+    }
+
+    printf("%.1f MB, %lu lines, loaded in %.1f ms, %lux%lu terminal\n", size / (1024.0*1024.0),
+           editor.Text.LineCount, loadSeconds * 1000.0, terminal.Columns, terminal.Rows);
+    printf("%-6s %7s %9s %9s %12s %13s %18s\n", "step", "frames", "p50 ms", "p99 ms", "bytes/frame", "allocs/frame", "line allocs/frame");
+    for(u32 kind = 0; kind < BenchKind_Count; kind++) {
+        Bench_Stats* stat = stats + kind;
+        if(!stat->Count) continue;
+        qsort(stat->Times, stat->Count, sizeof(f64), CompareTimes);
+        printf("%-6s %7lu %9.3f %9.3f %12.1f %13.1f %18.1f\n", BenchKindNames[kind], stat->Count,
+               Percentile(stat->Times, stat->Count, 50) * 1000.0, Percentile(stat->Times, stat->Count, 99) * 1000.0,
+               (f64)stat->Bytes / stat->Count, (f64)stat->Allocations / stat->Count, (f64)stat->LineAllocations / stat->Count);
+    }
+
+    CloseEditor(&editor);
+    StopTrace();
+    unlink(path);
+    if(editor.Save.Error) {
+        fprintf(stderr, "ERROR: Can't save %s: %s\n", path, strerror(editor.Save.Error));
+        return -1;
+    }
+    return 0;
+}
@@ -3,5 +3,7 @@
 mkdir -p ../build
 
 # -pedantic
-Flags="-Wall -Wextra -std=c++11 -Wno-write-strings -fno-rtti -fno-exceptions"
+Flags="-Wall -Wextra -std=c++11 -Wno-write-strings -fno-rtti -fno-exceptions -pthread"
 g++ -g main.cpp -o ../build/editor $Flags
+g++ -O2 scan_bench.cpp -o ../build/scan_bench $Flags
+g++ -O2 bench.cpp -o ../build/bench $Flags
@@ -0,0 +1,1608 @@
+// The editor core.
+//
+// Everything but the terminal itself: the text, editing, drawing frames and
+// the main loop. Terminal I/O goes through an Editor_Backend, so the same core
+// runs on a real terminal (main.cpp) and headless in the benchmark
+// (bench.cpp).
+
+#include "main.h"
+
+#define _BSD_SOURCE
+
+#include <stdio.h>
+#include <errno.h>
+#include <string.h>
+#include <stdlib.h>
+#include <ctype.h>     // for isspace(), isprint(), isdigit()
+#include <time.h>
+#include <unistd.h>    // for read(), close(), write(), ftruncate()
+#include <stdarg.h>
+#include <fcntl.h>
+#include <sys/mman.h>  // for mmap()
+#include <sys/stat.h>  // for fstat()
+
+
+#define Assert(expression) if(!(expression)) { __builtin_trap(); }
+#define TERMINAL_VERSION "0.0.1"
+#define TAB_WIDTH 8
+#define STATUS_MESSAGE_SECONDS 5
+#define INDEX_STEP_BYTES (16*1024*1024) // How much of a mapped file gets indexed per idle tick
+#define SAVE_PROGRESS_MS 100 // How often the status bar shows how far a save got
+#define LARGE_FILE_BYTES (1024ull*1024*1024) // Files this big are indexed as spans
+#define LARGE_FILE_BUDGET (256*1024*1024)    // What the line store may hold of a large file, by default
+
+global b32 GlobalRunning = true;
+
+#define CTRL_KEY(key) ((key) & 0x1f)
+
+enum Key_Type {
+    KeyType_Backspace = 127,
+    KeyType_Up = 1000, // Past any byte
+    KeyType_Down,
+    KeyType_Left,
+    KeyType_Right,
+    KeyType_PageUp,
+    KeyType_PageDown,
+    KeyType_Home,
+    KeyType_End, // Up to here the keys only move the cursor
+    KeyType_Del,
+    KeyType_Paste, // Start of a bracketed paste, the text follows
+};
+
+union v2u {
+    size_t E[2];
+    struct {
+        size_t x, y;
+    };
+};
+
+struct XBuffer {
+    char* Data;
+    size_t Used;
+    size_t Size;
+};
+
+static void
+AppendToBuffer(XBuffer* buffer, char* data, size_t length) {
+    if(!buffer->Data || (buffer->Used+length >= buffer->Size)) {
+        buffer->Size = (buffer->Used+length) * 2;
+        buffer->Data = (char*)realloc(buffer->Data, buffer->Size);
+    }
+    
+    Assert(buffer->Data);
+    memcpy(buffer->Data + buffer->Used, data, length);
+    buffer->Used += length;
+}
+
+inline void
+FreeBuffer(XBuffer* buffer) {
+    free(buffer->Data);
+    *buffer = {};
+}
+
+inline void
+ZeroBuffer(XBuffer* buffer) {
+    size_t size = buffer->Used;
+    char* byte = buffer->Data;
+    while(size--) {
+        *byte++ = 0;
+    }
+    buffer->Used = 0;
+}
+
+// Monotonic clock, for timing things
+inline double
+GetSeconds() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+// Where the editor reads its input and sends its frames: the terminal
+// (main.cpp) or a virtual one (bench.cpp).
+typedef ssize_t Backend_Read(void* context, u8* data, size_t size, int timeoutMs); // Bytes read, 0 on a timeout, -1 once the input is closed
+typedef void Backend_Write(void* context, char* data, size_t size);
+typedef b32 Backend_Get_Size(void* context, size_t* rows, size_t* columns);
+
+struct Editor_Backend {
+    void* Context;
+    Backend_Read* Read;
+    Backend_Write* Write;
+    Backend_Get_Size* GetSize;
+};
+
+#include "perf.cpp"
+#include "scan_kernels.cpp"
+#include "lz_codec.cpp"
+#include "line_arena.cpp"
+#include "line_store.cpp"
+#include "utf8.cpp"
+#include "line_index.cpp"
+#include "screen_frame.cpp"
+#include "highlight.cpp"
+#include "render_cache.cpp"
+#include "input.cpp"
+#include "file_save.cpp"
+#include "search.cpp"
+#include "follow.cpp"
+#include "journal.cpp"
+#include "recovery.cpp"
+
+// A file opened read-only with mmap(). Lines are split off the mapping lazily,
+// Indexed is how far the newline scan got. A large file is only indexed as
+// spans, and the store is packed back into spans when it outgrows the memory
+// budget.
+struct File_Map {
+    char* Base;
+    size_t Size;
+    size_t Indexed;
+    b32 Large;
+    size_t PackedMemory; // What the store held right after the last PackSpans
+};
+
+struct Term_Editor {
+    char* Filename;
+    char StatusMessage[80];
+    time_t StatusMessageTime;
+    b32 Dirty;
+    
+    size_t RowCount, ColumnCount;
+    v2u CursorPos;
+    size_t RenderCursorX; // We use this because TABs fault
+    size_t CursorRow;     // Screen row of the cursor, worked out by ScrollToCursor
+    
+    v2u Offset; // For scrolling
+    size_t OffsetRow; // With soft wrap, the row of line Offset.y at the top of the view
+    b32 SoftWrap;     // Long lines go on in more rows instead of scrolling sideways
+    Line_Store Text;
+    File_Map Map;
+    XBuffer Buffer;
+    Screen_State Screen;
+    Render_Cache RenderCache;
+    Line_Index_Cache LineIndexes; // Of the long lines
+    Highlighter Highlight;
+    Input_Buffer Input;
+    size_t DrawnTopRow; // Row of the document at the top of the frame on the terminal
+    Save_Job Save;
+    Undo_Journal Journal;
+    Recovery_Journal Recovery; // The unsaved edits, on disk for after a crash
+    Search_Results Search;
+    Editor_Backend* Backend;
+    Perf_Hud Hud;
+    b32 FollowMode; // Keep reading what gets appended to the file
+    File_Follow Follow;
+    size_t MemoryBudget; // 0 for LARGE_FILE_BUDGET, and only files of LARGE_FILE_BYTES are large
+};
+
+inline b32
+IsFileIndexed(Term_Editor* editor) {
+    return editor->Map.Indexed == editor->Map.Size;
+}
+
+// Splits more of the mapped file into lines, until the line `lineTarget` exists
+// and at least `byteBudget` bytes were scanned (or the file ends). Lines are
+// views into the mapping, nothing is copied.
+static void
+IndexFile(Term_Editor* editor, size_t lineTarget, size_t byteBudget) {
+    File_Map* map = &editor->Map;
+    if(IsFileIndexed(editor)) return;
+    TRACE_SCOPE("index");
+    
+    size_t byteStop = (map->Size - map->Indexed > byteBudget) ? map->Indexed + byteBudget : map->Size;
+    
+    if(map->Large) {
+        // Only count the lines, SPAN_LINES at a time
+        while(map->Indexed < map->Size && (editor->Text.LineCount <= lineTarget || map->Indexed < byteStop)) {
+            char* start = map->Base + map->Indexed;
+            size_t remaining = map->Size - map->Indexed;
+            size_t size = 0;
+            size_t lineCount = 0;
+            size_t bytes = 0; // As the lines will be, without CRs
+            while(size < remaining && lineCount < SPAN_LINES) {
+                char* line = start + size;
+                size_t length = FindByte(line, remaining - size, '\n');
+                size += (length < remaining - size) ? length + 1 : length;
+                while(length > 0 && line[length - 1] == '\r') length--;
+                bytes += length + 1;
+                lineCount++;
+            }
+            map->Indexed += size;
+            StoreAppendSpan(&editor->Text, start, size, lineCount, bytes);
+        }
+        return;
+    }
+    
+    Line_Data lines[LINE_BLOCK_CAPACITY];
+    size_t count = 0;
+    while(map->Indexed < map->Size && (editor->Text.LineCount + count <= lineTarget || map->Indexed < byteStop)) {
+        char* start = map->Base + map->Indexed;
+        size_t remaining = map->Size - map->Indexed;
+        size_t length = FindByte(start, remaining, '\n');
+        map->Indexed += (length < remaining) ? length + 1 : length;
+        while(length > 0 && start[length - 1] == '\r') length--;
+        
+        Line_Data* line = lines + count++;
+        *line = {};
+        line->Size = length;
+        line->Data = start;
+        line->Flags = LineFlag_Borrowed;
+        
+        if(count == LINE_BLOCK_CAPACITY) {
+            StoreAppendLines(&editor->Text, lines, count);
+            count = 0;
+        }
+    }
+    if(count) StoreAppendLines(&editor->Text, lines, count);
+}
+
+inline void
+EnsureLineIndexed(Term_Editor* editor, size_t lineIndex) {
+    if(lineIndex >= editor->Text.LineCount) IndexFile(editor, lineIndex, 0);
+}
+
+// Keeps the store of a large file within the memory budget: once it has grown
+// past it, everything untouched away from the view goes back into spans, and
+// if that's not enough the rest away from the view is compressed. It only
+// packs again after growing by another eighth of the budget, so edits that
+// alone take more than the budget don't pack every frame.
+static void
+TrimMemory(Term_Editor* editor) {
+    File_Map* map = &editor->Map;
+    if(!map->Large && !editor->MemoryBudget) return;
+    
+    size_t budget = editor->MemoryBudget ? editor->MemoryBudget : LARGE_FILE_BUDGET;
+    size_t memory = StoreMemory(&editor->Text);
+    if(memory <= budget || memory < map->PackedMemory + budget / 8) return;
+    
+    size_t keepFrom = editor->Offset.y > editor->RowCount ? editor->Offset.y - editor->RowCount : 0;
+    if(editor->CursorPos.y < keepFrom) keepFrom = editor->CursorPos.y;
+    size_t keepTo = editor->Offset.y + 2*editor->RowCount;
+    if(editor->CursorPos.y >= keepTo) keepTo = editor->CursorPos.y + 1;
+    PackSpans(&editor->Text, keepFrom, keepTo, map->Base + map->Size);
+    if(StoreMemory(&editor->Text) > budget) PackBlocks(&editor->Text, keepFrom, keepTo);
+    map->PackedMemory = StoreMemory(&editor->Text);
+}
+
+// Line `lineIndex` rendered, and split into rows the width of the screen
+static Render_Entry*
+GetWrappedLine(Term_Editor* editor, size_t lineIndex) {
+    Line_Data* line = GetLine(&editor->Text, lineIndex);
+    Render_Entry* render = GetRenderedLine(&editor->RenderCache, line, editor->Highlight.Language, LineStartState(&editor->Text, lineIndex));
+    WrapRenderedLine(render, editor->ColumnCount);
+    return render;
+}
+
+// The row of the document at the top of the view: with soft wrap it counts
+// screen rows, without it lines
+inline size_t
+ViewTopRow(Term_Editor* editor) {
+    if(!editor->SoftWrap) return editor->Offset.y;
+    return StoreLineRow(&editor->Text, editor->Offset.y) + editor->OffsetRow;
+}
+
+static void
+SetViewTopRow(Term_Editor* editor, size_t row) {
+    if(!editor->SoftWrap) {
+        editor->Offset.y = row;
+        return;
+    }
+    editor->Offset.y = StoreLineAtRow(&editor->Text, row, &editor->OffsetRow);
+}
+
+// With soft wrap: the screen row of the document the cursor is on, and in
+// `column` where it is in that row
+static size_t
+CursorWrapRow(Term_Editor* editor, size_t* column) {
+    *column = 0;
+    Line_Data* line = GetLine(&editor->Text, editor->CursorPos.y);
+    if(!line) return StoreRowCount(&editor->Text);
+    
+    Render_Entry* render = GetWrappedLine(editor, editor->CursorPos.y);
+    size_t rx = LineCxToRx(line, editor->CursorPos.x);
+    size_t row = WrapRowOf(render, rx);
+    *column = rx - render->Breaks[row];
+    return StoreLineRow(&editor->Text, editor->CursorPos.y) + row;
+}
+
+// With soft wrap: puts the cursor on screen row `row` of the document, as
+// close to `column` as the row goes
+static void
+MoveCursorToRow(Term_Editor* editor, size_t row, size_t column) {
+    size_t rowInLine;
+    size_t lineIndex = StoreLineAtRow(&editor->Text, row, &rowInLine);
+    Line_Data* line = GetLine(&editor->Text, lineIndex);
+    if(!line) return;
+    
+    Render_Entry* render = GetWrappedLine(editor, lineIndex);
+    if(rowInLine >= render->BreakCount) rowInLine = render->BreakCount - 1;
+    size_t start, end;
+    WrapRowCells(render, rowInLine, &start, &end);
+    if(rowInLine + 1 < render->BreakCount) end--; // The end of a row that goes on is the start of the next
+    size_t rx = start + column < end ? start + column : end;
+    
+    size_t cx = LineRxToCx(line, rx);
+    // A TAB cut by the edge starts on the row above
+    if(LineCxToRx(line, cx) < start) cx = NextCharBoundary(line->Data, line->Size, cx);
+    editor->CursorPos.y = lineIndex;
+    editor->CursorPos.x = cx;
+}
+
+// Moves the view so the cursor is on screen
+static void
+ScrollToCursor(Term_Editor* editor) {
+    if(editor->SoftWrap) {
+        size_t column;
+        size_t cursorRow = CursorWrapRow(editor, &column);
+        size_t topRow = ViewTopRow(editor);
+        if(cursorRow < topRow) topRow = cursorRow;
+        if(cursorRow >= topRow + editor->RowCount) topRow = cursorRow - editor->RowCount + 1;
+        SetViewTopRow(editor, topRow);
+        
+        editor->Offset.x = 0;
+        editor->RenderCursorX = column;
+        editor->CursorRow = cursorRow - topRow;
+        return;
+    }
+    
+    Line_Data* line = GetLine(&editor->Text, editor->CursorPos.y);
+    editor->RenderCursorX = line ? IndexedCxToRx(&editor->LineIndexes, line, editor->CursorPos.x) : 0;
+    
+    // Up
+    if(editor->CursorPos.y < editor->Offset.y) {
+        editor->Offset.y = editor->CursorPos.y;
+    }
+    // Down
+    if(editor->CursorPos.y >= (editor->Offset.y + editor->RowCount)) {
+        editor->Offset.y = editor->CursorPos.y - editor->RowCount + 2;
+    }
+    // Left
+    if(editor->RenderCursorX < editor->Offset.x) {
+        editor->Offset.x = editor->RenderCursorX;
+    }
+    // Right
+    if(editor->RenderCursorX >= editor->Offset.x + editor->ColumnCount) {
+        editor->Offset.x = editor->RenderCursorX - editor->ColumnCount + 1;
+    }
+    editor->CursorRow = editor->CursorPos.y - editor->Offset.y;
+}
+
+// Turns soft wrap on or off. The rows of every line are counted for the
+// width of the screen, and again whenever it changes.
+static void
+SetSoftWrap(Term_Editor* editor, b32 softWrap) {
+    editor->SoftWrap = softWrap;
+    editor->Offset.x = 0;
+    editor->OffsetRow = 0;
+    SetWrapWidth(&editor->Text, softWrap ? editor->ColumnCount : 0);
+}
+
+static void
+UpdateScreen(Term_Editor* editor) {
+    TRACE_SCOPE("render");
+    f64 frameStart = GetSeconds();
+    XBuffer* buffer = &editor->Buffer;
+    
+    ScrollToCursor(editor);
+    EnsureLineIndexed(editor, editor->Offset.y + editor->RowCount);
+    
+    Screen_State* screen = &editor->Screen;
+    Screen_Frame* frame = &screen->Current;
+    
+    // The text rows on the terminal are shifted along with the view, a
+    // jump of a whole page or more is drawn from scratch
+    size_t topRow = ViewTopRow(editor);
+    if(topRow != editor->DrawnTopRow) {
+        ScrollScreen(screen, 0, editor->RowCount, (ssize_t)(topRow - editor->DrawnTopRow));
+    }
+    editor->DrawnTopRow = topRow;
+    
+    ClearFrame(frame);
+    
+    // Lexer states up to the bottom of the screen, then each row starts where the one above ended
+    Highlighter* highlight = &editor->Highlight;
+    // Lexing a large file from the top would unpack every span on the way,
+    // its states start over at the view instead
+    if(editor->Map.Large && highlight->Frontier < editor->Offset.y) highlight->Frontier = editor->Offset.y;
+    UpdateHighlight(highlight, &editor->Text, editor->Offset.y + editor->RowCount);
+    u8 lexState = LineStartState(&editor->Text, editor->Offset.y);
+    
+    { // Draw characters / Intro message / empty line
+        // With soft wrap a line takes as many screen rows as it has wrapped rows
+        size_t lineIndex = editor->Offset.y;
+        size_t wrapRow = editor->OffsetRow;
+        for(size_t y = 0; y < editor->RowCount; y++) {
+            if(lineIndex < editor->Text.LineCount) {
+                Line_Data* line = GetLine(&editor->Text, lineIndex);
+                Render_Entry* render = editor->SoftWrap ?
+                    GetRenderedLine(&editor->RenderCache, line, highlight->Language, lexState) :
+                    GetRenderedColumns(&editor->RenderCache, &editor->LineIndexes, line, highlight->Language, lexState,
+                                       editor->Offset.x, editor->ColumnCount);
+                size_t start = editor->Offset.x - render->FirstColumn;
+                size_t end = render->Size;
+                if(editor->SoftWrap) {
+                    WrapRenderedLine(render, editor->ColumnCount);
+                    if(wrapRow >= render->BreakCount) wrapRow = render->BreakCount - 1;
+                    WrapRowCells(render, wrapRow, &start, &end);
+                }
+                if(end > start) {
+                    DrawCells(frame, y, 0, render->Cells + start, end - start);
+                }
+                if(!editor->SoftWrap || ++wrapRow == render->BreakCount) {
+                    lexState = render->LexEnd;
+                    lineIndex++;
+                    wrapRow = 0;
+                }
+            } else if(editor->Text.LineCount == 0 && y == (editor->RowCount / 3)) { // Intro message
+                char msg[64] = {};
+                int len = snprintf(msg, sizeof(msg), "Terminal Editor - Version: %s", TERMINAL_VERSION);
+                if((size_t)len > editor->ColumnCount) len = editor->ColumnCount;
+                
+                size_t padding = (editor->ColumnCount - len) / 2;
+                if(padding) DrawText(frame, y, 0, "~", 1, CellStyle_Normal);
+                
+                // Add the msg
+                DrawText(frame, y, padding, msg, len, CellStyle_Normal);
+            } else { // Draw the empty line indicator
+                DrawText(frame, y, 0, "~", 1, CellStyle_Normal);
+            }
+        }
+    }
+    
+    { // Draw StatusBar
+        size_t row = editor->RowCount;
+        FillRow(frame, row, ' ', CellStyle_Inverted);
+        
+        // A file still being indexed has more lines than it shows, and no known size
+        char leftStatus[80] = {}, rightStatus[80] = {};
+        b32 indexed = IsFileIndexed(editor);
+        size_t leftLen = snprintf(leftStatus, sizeof(leftStatus), " %.20s - %lu%s Lines %s", 
+                                  editor->Filename ? editor->Filename : "[No Name]", editor->Text.LineCount, 
+                                  indexed ? "" : "+", editor->Dirty ? "(modified)" : "");
+        size_t rightLen;
+        size_t bytes = StoreByteCount(&editor->Text);
+        if(indexed && bytes) {
+            size_t offset = StoreLineOffset(&editor->Text, editor->CursorPos.y);
+            rightLen = snprintf(rightStatus, sizeof(rightStatus), "%lu/%lu %3d%% ", editor->CursorPos.y + 1, editor->Text.LineCount,
+                                (int)((f64)offset * 100.0 / bytes));
+        } else {
+            rightLen = snprintf(rightStatus, sizeof(rightStatus), "%lu/%lu ", editor->CursorPos.y + 1, editor->Text.LineCount);
+        }
+        if(leftLen > editor->ColumnCount) leftLen = editor->ColumnCount; 
+        DrawText(frame, row, 0, leftStatus, leftLen, CellStyle_Inverted);
+        if(leftLen + rightLen <= editor->ColumnCount) {
+            DrawText(frame, row, editor->ColumnCount - rightLen, rightStatus, rightLen, CellStyle_Inverted);
+        }
+    }
+    
+    { // Draw MessageBar
+        size_t msgLen = strlen(editor->StatusMessage);
+        if(msgLen > editor->ColumnCount) msgLen = editor->ColumnCount;
+        if(msgLen && time(0) - editor->StatusMessageTime < STATUS_MESSAGE_SECONDS) {
+            DrawText(frame, editor->RowCount + 1, 0, editor->StatusMessage, msgLen, CellStyle_Normal);
+        }
+    }
+    
+    if(editor->Hud.Visible) { // Performance HUD, over the top right of the text
+        char hud[160];
+        editor->Hud.PackedBytes = editor->Text.PackedBytes;
+        editor->Hud.PackedTextBytes = editor->Text.PackedTextBytes;
+        size_t len = FormatHud(&editor->Hud, hud, sizeof(hud));
+        if(len > editor->ColumnCount) len = editor->ColumnCount;
+        DrawText(frame, 0, editor->ColumnCount - len, hud, len, CellStyle_Inverted);
+    }
+    
+    FlushFrame(screen, buffer, 
+               editor->CursorRow, 
+               editor->RenderCursorX - editor->Offset.x);
+    f64 buildSeconds = GetSeconds() - frameStart;
+    
+    if(buffer->Used) editor->Backend->Write(editor->Backend->Context, buffer->Data, buffer->Used);
+    ZeroBuffer(buffer);
+    FinishFrame(&editor->Hud, buildSeconds, screen->BytesWritten, HeapAllocations() + editor->Text.Arena.Allocations);
+    
+    TrimMemory(editor);
+}
+
+static void
+SetStatusMessage(Term_Editor* editor, char* fmt, ...) {
+    va_list ap;
+    va_start(ap, fmt);
+    vsnprintf(editor->StatusMessage, sizeof(editor->StatusMessage), fmt, ap);
+    va_end(ap);
+    editor->StatusMessageTime = time(0);
+}
+
+// Called after every key the prompt reads, with what was typed so far
+typedef void Prompt_Callback(Term_Editor* editor, char* input, u32 key);
+
+// Enter only takes an empty answer when `allowEmpty` is set
+static char*
+PromptMessage(Term_Editor* editor, char* message, Prompt_Callback* callback, b32 allowEmpty) {
+    size_t bufferSize = 128;
+    char* buffer = (char*)malloc(bufferSize);
+    buffer[0] = 0;
+    
+    size_t len = 0;
+    for(;;) {
+        SetStatusMessage(editor, message, buffer);
+        if(!InputAvailable(&editor->Input)) UpdateScreen(editor);
+        
+        u32 character = 0;
+        if(!ReadKey(&editor->Input, &character)) break;
+        
+        if(character == KeyType_Del || character == CTRL_KEY('h') || character == KeyType_Backspace) {
+            if(len != 0) {
+                len = PrevCharBoundary(buffer, len, len);
+                buffer[len] = 0;
+            }
+        } else if(character == '\x1b') {
+            SetStatusMessage(editor, "");
+            if(callback) callback(editor, buffer, character);
+            free(buffer);
+            break;
+        } else if(character == '\r') {
+            if(len != 0 || allowEmpty) {
+                SetStatusMessage(editor, "");
+                if(callback) callback(editor, buffer, character);
+                return buffer;
+            }
+        } else if(character == KeyType_Paste) {
+            XBuffer paste = {};
+            ReadPaste(&editor->Input, &paste);
+            for(size_t index = 0; index < paste.Used; index++) {
+                u8 pasted = paste.Data[index];
+                if(iscntrl(pasted)) continue;
+                if(len == bufferSize - 1) {
+                    bufferSize *= 2;
+                    buffer = (char*)realloc(buffer, bufferSize);
+                }
+                buffer[len++] = pasted;
+                buffer[len] = 0;
+            }
+            FreeBuffer(&paste);
+        } else if(!iscntrl(character) && character < 256) { // UTF-8 comes a byte at a time
+            if(len == bufferSize - 1) {
+                bufferSize *= 2;
+                buffer = (char*)realloc(buffer, bufferSize);
+            }
+            buffer[len++] = character;
+            buffer[len] = 0;
+        }
+        
+        if(callback) callback(editor, buffer, character);
+    }
+    
+    return 0;
+}
+
+// Starts following the file from byte `offset`, whatever was followed before
+static void
+FollowFile(Term_Editor* editor, u64 offset, b32 partial) {
+    StopFollow(&editor->Follow);
+    int error = StartFollow(&editor->Follow, editor->Filename, offset, partial);
+    if(error) SetStatusMessage(editor, "Can't follow %s! %s", editor->Filename, strerror(error));
+}
+
+static void
+SaveFile(Term_Editor* editor) {
+    if(!editor->Filename) {
+        editor->Filename = PromptMessage(editor, "Save as: %s", 0, false);
+        if(!editor->Filename) {
+            SetStatusMessage(editor, "Save aborted");
+            return;
+        }
+        SetLanguage(&editor->Highlight, DetectLanguage(editor->Filename));
+    }
+    
+    if(editor->Save.Running) {
+        SetStatusMessage(editor, "Still saving, try again when it's done");
+        return;
+    }
+    
+    TRACE_SCOPE("save");
+    IndexFile(editor, (size_t)-1, 0);
+    
+    // Untouched lines still point into the mapping of the old file. That is
+    // fine, the rename leaves the old inode alive for as long as it is mapped.
+    int error = StartSave(&editor->Save, &editor->Text, editor->Filename);
+    if(error) {
+        SetStatusMessage(editor, "Can't save! %s", strerror(error));
+        return;
+    }
+    
+    // The snapshot is what ends up on disk, edits from now on make the buffer dirty again
+    editor->Dirty = false;
+    if(!editor->FollowMode) BeginRecoverySave(&editor->Recovery);
+    SetStatusMessage(editor, "Saving...");
+}
+
+// After a save was collected: the recovery journal starts over from the saved
+// file, or goes on as it was when the save failed
+static void
+SettleRecovery(Term_Editor* editor) {
+    Recovery_Journal* recovery = &editor->Recovery;
+    if(!recovery->Saving) return;
+    if(editor->Save.Error) {
+        CancelRecoverySave(recovery);
+        return;
+    }
+    int error = RestartRecovery(recovery, editor->Filename);
+    if(error) SetStatusMessage(editor, "Can't keep a recovery journal! %s", strerror(error));
+}
+
+// Collects a finished background save, or just reports how far it got
+static void
+UpdateSave(Term_Editor* editor) {
+    Save_Job* save = &editor->Save;
+    if(!save->Running) return;
+    
+    if(!IsSaveDone(save)) {
+        SetStatusMessage(editor, "Saving... %d%%", SaveProgress(save));
+        return;
+    }
+    
+    FinishSave(save, &editor->Text);
+    if(save->Error) {
+        editor->Dirty = true;
+        SetStatusMessage(editor, "Can't save! I/O error: %s", strerror(save->Error));
+    } else {
+        SetStatusMessage(editor, "%llu bytes written to disk", (unsigned long long)save->BytesWritten);
+        // The save is a new file under the name, follow that one
+        if(editor->Follow.Active) FollowFile(editor, save->BytesWritten, false);
+    }
+    SettleRecovery(editor);
+}
+
+// Writes the edits recorded for recovery out, when they are due
+static void
+UpdateRecovery(Term_Editor* editor) {
+    if(!IsRecoveryDue(&editor->Recovery)) return;
+    int error = FlushRecovery(&editor->Recovery);
+    if(error) SetStatusMessage(editor, "Can't write the recovery journal! %s", strerror(error));
+}
+
+
+// `line` comes from EditLine
+static void
+InsertCharacterInLine(Line_Store* store, Line_Data* line, size_t at, u8 character) {
+    if(at > line->Size) at = line->Size;
+    ReserveLine(store, line, line->Size + 1);
+    memmove(line->Data + at+1, line->Data + at, line->Size - at+1);
+    line->Size++;
+    line->Data[at] = character;
+}
+
+static void
+InsertLine(Term_Editor* editor, size_t at, char* data, size_t length) {
+    Line_Data* line = StoreInsertLine(&editor->Text, at);
+    if(!line) return;
+    
+    line->Size = length;
+    line->Data = AllocLineData(&editor->Text, length);
+    memcpy(line->Data, data, length);
+    line->Data[length] = 0;
+    
+    editor->Dirty = true;
+}
+
+// Length of the text up to the first \n or \r
+inline size_t
+FindLineBreak(char* text, size_t length) {
+    return FindEitherByte(text, length, '\n', '\r');
+}
+
+static void
+InsertCharacter(Term_Editor* editor, u8 character) {
+    LogEdit(&editor->Recovery, RecoveryKind_Character, editor->CursorPos.y, editor->CursorPos.x, (char*)&character, 1);
+    u32 flags = 0;
+    if(editor->CursorPos.y == editor->Text.LineCount) {
+        InsertLine(editor, editor->Text.LineCount, "", 0);
+        flags = JournalFlag_AppendedLine;
+    }
+    Line_Data* line = EditLine(&editor->Text, editor->CursorPos.y);
+    if(editor->CursorPos.x > line->Size) editor->CursorPos.x = line->Size;
+    InsertCharacterInLine(&editor->Text, line, editor->CursorPos.x, character);
+    NoteLineEdit(&editor->LineIndexes, line, editor->CursorPos.x, 0, 1);
+    RecordEdit(&editor->Journal, JournalKind_Insert, flags, editor->CursorPos.y, editor->CursorPos.x,
+               editor->CursorPos.y, editor->CursorPos.x + 1, (char*)&character, 1);
+    editor->Dirty = true;
+    editor->CursorPos.x++;
+}
+
+// Inserts text at the cursor as a single edit. Newlines (\n, \r\n or \r)
+// split the text into lines, which are built in one pass and spliced into
+// the store together.
+static void
+InsertText(Term_Editor* editor, char* text, size_t length) {
+    if(!length) return;
+    LogEdit(&editor->Recovery, RecoveryKind_Text, editor->CursorPos.y, editor->CursorPos.x, text, length);
+    u32 flags = 0;
+    if(editor->CursorPos.y == editor->Text.LineCount) {
+        InsertLine(editor, editor->Text.LineCount, "", 0);
+        flags = JournalFlag_AppendedLine;
+    }
+    
+    Line_Data* line = GetLine(&editor->Text, editor->CursorPos.y);
+    size_t at = editor->CursorPos.x < line->Size ? editor->CursorPos.x : line->Size;
+    size_t startY = editor->CursorPos.y;
+    size_t firstLength = FindLineBreak(text, length);
+    
+    if(firstLength == length) {
+        // Doesn't span lines, just widen the current one
+        line = EditLine(&editor->Text, editor->CursorPos.y);
+        ReserveLine(&editor->Text, line, line->Size + length);
+        memmove(line->Data + at + length, line->Data + at, line->Size - at + 1);
+        memcpy(line->Data + at, text, length);
+        line->Size += length;
+        NoteLineEdit(&editor->LineIndexes, line, at, 0, length);
+        editor->CursorPos.x = at + length;
+        editor->Dirty = true;
+        RecordEdit(&editor->Journal, JournalKind_Insert, flags, startY, at, startY, editor->CursorPos.x, text, length);
+        return;
+    }
+    
+    // Split the text into lines, the last one takes the rest of the current line
+    size_t newCount = 0;
+    for(size_t index = firstLength; index < length;) {
+        index += (text[index] == '\r' && index + 1 < length && text[index + 1] == '\n') ? 2 : 1;
+        index += FindLineBreak(text + index, length - index);
+        newCount++;
+    }
+    
+    Line_Data* newLines = (Line_Data*)calloc(newCount, sizeof(Line_Data));
+    Assert(newLines);
+    char* rest = line->Data + at;
+    size_t restSize = line->Size - at;
+    size_t lastSize = 0;
+    size_t cursor = firstLength;
+    for(size_t lineIndex = 0; lineIndex < newCount; lineIndex++) {
+        cursor += (text[cursor] == '\r' && cursor + 1 < length && text[cursor + 1] == '\n') ? 2 : 1;
+        size_t size = FindLineBreak(text + cursor, length - cursor);
+        b32 last = (lineIndex == newCount - 1);
+        
+        Line_Data* newLine = newLines + lineIndex;
+        newLine->Size = size + (last ? restSize : 0);
+        newLine->Data = AllocLineData(&editor->Text, newLine->Size);
+        memcpy(newLine->Data, text + cursor, size);
+        if(last) {
+            memcpy(newLine->Data + size, rest, restSize);
+            lastSize = size;
+        }
+        newLine->Data[newLine->Size] = 0;
+        cursor += size;
+    }
+    
+    // The current line keeps what was before the cursor plus the first piece
+    line = EditLine(&editor->Text, editor->CursorPos.y);
+    ReserveLine(&editor->Text, line, at + firstLength);
+    memcpy(line->Data + at, text, firstLength);
+    line->Size = at + firstLength;
+    line->Data[line->Size] = 0;
+    
+    StoreInsertLines(&editor->Text, editor->CursorPos.y + 1, newLines, newCount);
+    free(newLines);
+    
+    editor->CursorPos.y += newCount;
+    editor->CursorPos.x = lastSize;
+    editor->Dirty = true;
+    RecordEdit(&editor->Journal, JournalKind_Insert, flags, startY, at, editor->CursorPos.y, editor->CursorPos.x, text, length);
+}
+
+// Removes the text from (x0, y0) up to (x1, y1), joining the lines at the ends
+static void
+DeleteText(Term_Editor* editor, size_t y0, size_t x0, size_t y1, size_t x1) {
+    Line_Data* first = EditLine(&editor->Text, y0);
+    if(!first) return;
+    LogDelete(&editor->Recovery, y0, x0, y1, x1);
+    
+    if(y0 == y1) {
+        memmove(first->Data + x0, first->Data + x1, first->Size - x1 + 1);
+        first->Size -= x1 - x0;
+        NoteLineEdit(&editor->LineIndexes, first, x0, x1 - x0, 0);
+    } else {
+        Line_Data* last = GetLine(&editor->Text, y1);
+        size_t tail = last->Size - x1;
+        ReserveLine(&editor->Text, first, x0 + tail);
+        memcpy(first->Data + x0, last->Data + x1, tail);
+        first->Size = x0 + tail;
+        first->Data[first->Size] = 0;
+        StoreDeleteLines(&editor->Text, y0 + 1, y1 - y0);
+    }
+    editor->Dirty = true;
+}
+
+// Removes `count` bytes at `at`, `line` comes from EditLine
+static void
+DeleteCharacterInLine(Line_Data* line, size_t at, size_t count) {
+    if(at >= line->Size) return;
+    if(count > line->Size - at) count = line->Size - at;
+    memmove(line->Data + at, line->Data + at + count, line->Size - at - count + 1);
+    line->Size -= count;
+}
+
+static void
+DeleteLine(Term_Editor* editor, size_t at) {
+    if(at >= editor->Text.LineCount) return;
+    
+    StoreDeleteLine(&editor->Text, at);
+    editor->Dirty = true;
+}
+
+static void
+DeleteCharacter(Term_Editor* editor) {
+    if(editor->CursorPos.y >= editor->Text.LineCount) return;
+    if(editor->CursorPos.x == 0 && editor->CursorPos.y == 0) return; 
+    LogEdit(&editor->Recovery, RecoveryKind_DeleteCharacter, editor->CursorPos.y, editor->CursorPos.x, 0, 0);
+    
+    if(editor->CursorPos.x > 0) {
+        Line_Data* line = GetLine(&editor->Text, editor->CursorPos.y);
+        if(editor->CursorPos.x > line->Size) return;
+        // The whole character before the cursor, all of its UTF-8 bytes
+        size_t at = PrevCharBoundary(line->Data, line->Size, editor->CursorPos.x);
+        size_t count = editor->CursorPos.x - at;
+        
+        line = EditLine(&editor->Text, editor->CursorPos.y);
+        RecordEdit(&editor->Journal, JournalKind_Delete, 0, editor->CursorPos.y, at, editor->CursorPos.y, editor->CursorPos.x, line->Data + at, count);
+        DeleteCharacterInLine(line, at, count);
+        NoteLineEdit(&editor->LineIndexes, line, at, count, 0);
+        editor->CursorPos.x = at;
+        editor->Dirty = true;
+    } else {
+        Line_Data* lineAbove = EditLine(&editor->Text, editor->CursorPos.y - 1);
+        Line_Data* line = GetLine(&editor->Text, editor->CursorPos.y);
+        RecordEdit(&editor->Journal, JournalKind_Delete, 0, editor->CursorPos.y - 1, lineAbove->Size, editor->CursorPos.y, 0, "\n", 1);
+        editor->CursorPos.x = lineAbove->Size;
+        {
+            ReserveLine(&editor->Text, lineAbove, lineAbove->Size + line->Size);
+            memcpy(lineAbove->Data + lineAbove->Size, line->Data, line->Size);
+            lineAbove->Size += line->Size;
+            lineAbove->Data[lineAbove->Size] = 0;
+            editor->Dirty = true;
+        }
+        DeleteLine(editor, editor->CursorPos.y);
+        editor->CursorPos.y--;
+    }
+}
+
+// Enter: splits the line at the cursor, or adds an empty one past the end
+static void
+InsertNewline(Term_Editor* editor) {
+    LogEdit(&editor->Recovery, RecoveryKind_Newline, editor->CursorPos.y, editor->CursorPos.x, 0, 0);
+    if(editor->CursorPos.y == editor->Text.LineCount) {
+        InsertLine(editor, editor->CursorPos.y, "", 0);
+        RecordEdit(&editor->Journal, JournalKind_Insert, JournalFlag_AppendedLine, editor->CursorPos.y, 0, editor->CursorPos.y, 0, "", 0);
+    } else if(editor->CursorPos.x == 0) {
+        InsertLine(editor, editor->CursorPos.y, "", 0);
+        RecordEdit(&editor->Journal, JournalKind_Insert, 0, editor->CursorPos.y, 0, editor->CursorPos.y + 1, 0, "\n", 1);
+    } else {
+        RecordEdit(&editor->Journal, JournalKind_Insert, 0, editor->CursorPos.y, editor->CursorPos.x, editor->CursorPos.y + 1, 0, "\n", 1);
+        Line_Data* line = GetLine(&editor->Text, editor->CursorPos.y);
+        InsertLine(editor, editor->CursorPos.y + 1, line->Data + editor->CursorPos.x, line->Size - editor->CursorPos.x);
+        line = EditLine(&editor->Text, editor->CursorPos.y);
+        line->Size = editor->CursorPos.x;
+        line->Data[line->Size] = 0;
+    }
+    editor->CursorPos.y++;
+    editor->CursorPos.x = 0;
+}
+
+// Puts `to` in place of the `from` at every match. The matches are sorted,
+// don't overlap and are positions in the text before the replace. With `undo`
+// set the replace is taken back: `to` goes back to being `from`.
+//
+// Every changed line is built once, into an allocation of its final size,
+// walking the matches and the blocks that hold them in order.
+static void
+ApplyReplace(Term_Editor* editor, Search_Match* matches, size_t count, char* from, size_t fromLength, char* to, size_t toLength, b32 undo) {
+    TRACE_SCOPE("replace");
+    LogReplace(&editor->Recovery, from, fromLength, to, toLength, matches, count, undo);
+    if(undo) {
+        char* text = from; from = to; to = text;
+        size_t length = fromLength; fromLength = toLength; toLength = length;
+    }
+    
+    size_t index = 0;
+    while(index < count) {
+        size_t firstLine;
+        Line_Block* block = EditBlock(&editor->Text, matches[index].Line, &firstLine);
+        Assert(block);
+        
+        while(index < count && matches[index].Line < firstLine + block->Count) {
+            size_t lineIndex = matches[index].Line;
+            size_t end = index;
+            while(end < count && matches[end].Line == lineIndex) end++;
+            
+            Line_Data* line = block->Lines + (lineIndex - firstLine);
+            size_t lineCount = end - index;
+            size_t size = line->Size - lineCount * fromLength + lineCount * toLength;
+            char* data = AllocLineData(&editor->Text, size);
+            
+            size_t copied = 0;
+            size_t written = 0;
+            for(size_t match = 0; match < lineCount; match++) {
+                // Undoing, the earlier matches on the line already have their `from` length
+                size_t column = matches[index + match].Column;
+                if(undo) column = column - match * toLength + match * fromLength;
+                
+                memcpy(data + written, line->Data + copied, column - copied);
+                written += column - copied;
+                memcpy(data + written, to, toLength);
+                written += toLength;
+                copied = column + fromLength;
+            }
+            memcpy(data + written, line->Data + copied, line->Size - copied);
+            data[size] = 0;
+            SetLineData(&editor->Text, line, data, size);
+            
+            index = end;
+        }
+    }
+    
+    editor->Dirty = true;
+    InvalidateSearch(&editor->Search);
+}
+
+static void
+UndoEdit(Term_Editor* editor) {
+    TRACE_SCOPE("undo");
+    Undo_Journal* journal = &editor->Journal;
+    Journal_Entry* entry = JournalUndo(journal);
+    if(!entry) {
+        SetStatusMessage(editor, "Nothing to undo");
+        return;
+    }
+    
+    journal->Replaying = true;
+    if(entry->Kind == JournalKind_Replace) {
+        Journal_Replace* replace = (Journal_Replace*)EntryText(entry);
+        ApplyReplace(editor, ReplaceMatches(replace), replace->Count, ReplaceFrom(replace), replace->FromLength, ReplaceTo(replace), replace->ToLength, true);
+        editor->CursorPos.y = entry->Y;
+        editor->CursorPos.x = entry->X;
+    } else if(entry->Kind == JournalKind_Insert) {
+        DeleteText(editor, entry->Y, entry->X, entry->EndY, entry->EndX);
+        if(entry->Flags & JournalFlag_AppendedLine) {
+            LogEdit(&editor->Recovery, RecoveryKind_DeleteLine, entry->Y, 0, 0, 0);
+            DeleteLine(editor, entry->Y);
+        }
+        editor->CursorPos.y = entry->Y;
+        editor->CursorPos.x = entry->X;
+    } else {
+        editor->CursorPos.y = entry->Y;
+        editor->CursorPos.x = entry->X;
+        InsertText(editor, EntryText(entry), entry->Size);
+    }
+    journal->Replaying = false;
+    editor->Dirty = true;
+}
+
+static void
+RedoEdit(Term_Editor* editor) {
+    TRACE_SCOPE("redo");
+    Undo_Journal* journal = &editor->Journal;
+    Journal_Entry* entry = JournalRedo(journal);
+    if(!entry) {
+        SetStatusMessage(editor, "Nothing to redo");
+        return;
+    }
+    
+    journal->Replaying = true;
+    editor->CursorPos.y = entry->Y;
+    editor->CursorPos.x = entry->X;
+    if(entry->Kind == JournalKind_Replace) {
+        Journal_Replace* replace = (Journal_Replace*)EntryText(entry);
+        ApplyReplace(editor, ReplaceMatches(replace), replace->Count, ReplaceFrom(replace), replace->FromLength, ReplaceTo(replace), replace->ToLength, false);
+    } else if(entry->Kind == JournalKind_Insert) {
+        if(entry->Flags & JournalFlag_AppendedLine) {
+            LogEdit(&editor->Recovery, RecoveryKind_AddLine, entry->Y, 0, 0, 0);
+            InsertLine(editor, entry->Y, "", 0);
+        }
+        InsertText(editor, EntryText(entry), entry->Size);
+    } else {
+        DeleteText(editor, entry->Y, entry->X, entry->EndY, entry->EndX);
+    }
+    journal->Replaying = false;
+    editor->Dirty = true;
+}
+
+// Moves the cursor to a match of what is typed so far: the closest one from
+// the cursor on, or the next/previous one with the arrows.
+static void
+FindCallback(Term_Editor* editor, char* query, u32 key) {
+    if(key == '\r' || key == '\x1b') return;
+    
+    Search_Results* search = &editor->Search;
+    UpdateSearch(&editor->Text, search, query, strlen(query));
+    if(!search->Count) return;
+    
+    size_t index;
+    if(key == KeyType_Right || key == KeyType_Down) {
+        index = FindMatchIndex(search, editor->CursorPos.y, editor->CursorPos.x + 1);
+        if(index == search->Count) index = 0; // Wrap around
+    } else if(key == KeyType_Left || key == KeyType_Up) {
+        index = FindMatchIndex(search, editor->CursorPos.y, editor->CursorPos.x);
+        index = (index ? index : search->Count) - 1;
+    } else {
+        index = FindMatchIndex(search, editor->CursorPos.y, editor->CursorPos.x);
+        if(index == search->Count) index = 0;
+    }
+    
+    editor->CursorPos.y = search->Matches[index].Line;
+    editor->CursorPos.x = search->Matches[index].Column;
+}
+
+static void
+FindText(Term_Editor* editor) {
+    v2u savedCursor = editor->CursorPos;
+    v2u savedOffset = editor->Offset;
+    size_t savedOffsetRow = editor->OffsetRow;
+    
+    IndexFile(editor, (size_t)-1, 0); // Matches are searched in the whole file
+    InvalidateSearch(&editor->Search);
+    
+    char* query = PromptMessage(editor, "Search: %s (ESC to cancel, Arrows for next/previous)", FindCallback, false);
+    if(query) {
+        free(query);
+    } else {
+        editor->CursorPos = savedCursor;
+        editor->Offset = savedOffset;
+        editor->OffsetRow = savedOffsetRow;
+    }
+}
+
+// Moves the cursor to a line number, a percentage of the file ("50%") or a
+// byte offset ("1234b", counting a newline after every line) and centers it
+// in the view
+static void
+GoToPosition(Term_Editor* editor) {
+    char* input = PromptMessage(editor, "Go to: %s (line, N%% or byte offset Nb, ESC to cancel)", 0, false);
+    if(!input) return;
+    
+    char* end;
+    size_t value = strtoul(input, &end, 10);
+    b32 percent = strcmp(end, "%") == 0;
+    b32 byteOffset = strcmp(end, "b") == 0;
+    if(end == input || (*end && !percent && !byteOffset)) {
+        SetStatusMessage(editor, "Not a line, percentage or byte offset: %s", input);
+        free(input);
+        return;
+    }
+    free(input);
+    
+    size_t lineIndex;
+    if(percent || byteOffset) {
+        IndexFile(editor, (size_t)-1, 0); // Both are about the whole file
+        size_t bytes = StoreByteCount(&editor->Text);
+        size_t offset = value;
+        if(percent) offset = (value >= 100) ? bytes : (size_t)((f64)bytes * value / 100.0);
+        lineIndex = StoreLineAtOffset(&editor->Text, offset);
+    } else {
+        lineIndex = value ? value - 1 : 0;
+        EnsureLineIndexed(editor, lineIndex);
+    }
+    if(lineIndex >= editor->Text.LineCount) lineIndex = editor->Text.LineCount ? editor->Text.LineCount - 1 : 0;
+    
+    editor->CursorPos.y = lineIndex;
+    editor->CursorPos.x = 0;
+    size_t row = editor->SoftWrap ? StoreLineRow(&editor->Text, lineIndex) : lineIndex;
+    SetViewTopRow(editor, row > editor->RowCount / 2 ? row - editor->RowCount / 2 : 0);
+}
+
+// Replaces every match of a query in the whole file. The matches are found by
+// the (threaded) search, then all the changed lines are rebuilt in one pass.
+static void
+ReplaceAll(Term_Editor* editor) {
+    char* query = PromptMessage(editor, "Replace: %s (ESC to cancel)", 0, false);
+    if(!query) return;
+    char* replacement = PromptMessage(editor, "Replace with: %s (ESC to cancel)", 0, true);
+    if(!replacement) {
+        free(query);
+        return;
+    }
+    
+    double startTime = GetSeconds();
+    IndexFile(editor, (size_t)-1, 0);
+    
+    Search_Results* search = &editor->Search;
+    size_t queryLength = strlen(query);
+    size_t replacementLength = strlen(replacement);
+    InvalidateSearch(search);
+    UpdateSearch(&editor->Text, search, query, queryLength);
+    
+    if(search->Truncated) {
+        SetStatusMessage(editor, "Too many matches to replace");
+    } else {
+        // The search reports overlapping matches ("aa" twice in "aaa"), only
+        // the first of each run is replaced
+        size_t kept = 0;
+        for(size_t index = 0; index < search->Count; index++) {
+            Search_Match match = search->Matches[index];
+            if(kept) {
+                Search_Match last = search->Matches[kept - 1];
+                if(match.Line == last.Line && match.Column < last.Column + queryLength) continue;
+            }
+            search->Matches[kept++] = match;
+        }
+        search->Count = kept;
+        
+        if(kept) {
+            RecordReplace(&editor->Journal, query, queryLength, replacement, replacementLength, search->Matches, kept);
+            ApplyReplace(editor, search->Matches, kept, query, queryLength, replacement, replacementLength, false);
+        }
+        SetStatusMessage(editor, "Replaced %zu matches in %.1f ms", kept, (GetSeconds() - startTime) * 1000.0);
+    }
+    
+    free(query);
+    free(replacement);
+}
+
+static void
+ProcessKeyInput(Term_Editor* editor, u32 character) {
+#define KEY_ENTER 0xd
+#define KEY_ESC 0x1b // '\x1b'
+#define QUIT_TIMES 1
+    Line_Data* line = GetLine(&editor->Text, editor->CursorPos.y);
+    size_t lineSize = line ? line->Size : 0;
+    persist int quitTimes = QUIT_TIMES;
+    
+    // Moving the cursor ends the run of typing that undo takes back in one step
+    if(character >= KeyType_Up && character <= KeyType_End) SealJournal(&editor->Journal);
+    
+    switch(character) {
+        case CTRL_KEY('q'): {
+            if(editor->Dirty && quitTimes > 0) {
+                SetStatusMessage(editor, "WARNING!! File has unsaved changes. Press Ctrl-Q %d more time to quit.", quitTimes);
+                quitTimes--;
+                return;
+            }
+            GlobalRunning = false;
+        } break;
+        case KeyType_Up:
+        case KeyType_Down: {
+            if(editor->SoftWrap) {
+                // A screen row at a time, through the rows of a wrapped line
+                size_t column;
+                size_t cursorRow = CursorWrapRow(editor, &column);
+                if(character == KeyType_Up) {
+                    if(cursorRow > 0) MoveCursorToRow(editor, cursorRow - 1, column);
+                } else {
+                    EnsureLineIndexed(editor, editor->CursorPos.y + 1);
+                    if(cursorRow + 1 < StoreRowCount(&editor->Text)) MoveCursorToRow(editor, cursorRow + 1, column);
+                }
+                break;
+            }
+            
+            // Stay in the same screen column
+            size_t rx = line ? IndexedCxToRx(&editor->LineIndexes, line, editor->CursorPos.x) : 0;
+            if(character == KeyType_Up) {
+                if(editor->CursorPos.y > 0) editor->CursorPos.y--;
+            } else {
+                EnsureLineIndexed(editor, editor->CursorPos.y + 1);
+                if(editor->CursorPos.y + 1 < editor->Text.LineCount) editor->CursorPos.y++;
+            }
+            Line_Data* target = GetLine(&editor->Text, editor->CursorPos.y);
+            if(target) editor->CursorPos.x = IndexedRxToCx(&editor->LineIndexes, target, rx);
+        } break;
+        case KeyType_Left: {
+            if(editor->CursorPos.x > 0) {
+                editor->CursorPos.x = (editor->CursorPos.x > lineSize) ? lineSize : PrevCharBoundary(line->Data, lineSize, editor->CursorPos.x);
+            } else if(editor->CursorPos.y > 0) {
+                editor->CursorPos.y--;
+                editor->CursorPos.x = GetLine(&editor->Text, editor->CursorPos.y)->Size;
+            }
+        } break;
+        case KeyType_Right: {
+            EnsureLineIndexed(editor, editor->CursorPos.y + 1);
+            if(editor->CursorPos.x < lineSize) {
+                editor->CursorPos.x = NextCharBoundary(line->Data, lineSize, editor->CursorPos.x);
+            } else if(editor->CursorPos.y + 1 < editor->Text.LineCount) {
+                editor->CursorPos.y++;
+                editor->CursorPos.x = 0;
+            }
+        } break;
+        case KeyType_PageDown:
+        case KeyType_PageUp: {
+            // The view and the cursor both move a screen, the cursor stays on the same row
+            if(editor->SoftWrap) {
+                size_t column;
+                size_t cursorRow = CursorWrapRow(editor, &column);
+                size_t topRow = ViewTopRow(editor);
+                if(character == KeyType_PageUp) {
+                    topRow = topRow > editor->RowCount ? topRow - editor->RowCount : 0;
+                    cursorRow = cursorRow > editor->RowCount ? cursorRow - editor->RowCount : 0;
+                } else {
+                    EnsureLineIndexed(editor, editor->Offset.y + 2*editor->RowCount);
+                    size_t rowCount = StoreRowCount(&editor->Text);
+                    size_t lastRow = rowCount ? rowCount - 1 : 0;
+                    topRow = (topRow + editor->RowCount < lastRow) ? topRow + editor->RowCount : lastRow;
+                    cursorRow = (cursorRow + editor->RowCount < lastRow) ? cursorRow + editor->RowCount : lastRow;
+                }
+                SetViewTopRow(editor, topRow);
+                MoveCursorToRow(editor, cursorRow, column);
+                break;
+            }
+            
+            size_t rx = line ? IndexedCxToRx(&editor->LineIndexes, line, editor->CursorPos.x) : 0;
+            if(character == KeyType_PageUp) {
+                editor->Offset.y = editor->Offset.y > editor->RowCount ? editor->Offset.y - editor->RowCount : 0;
+                editor->CursorPos.y = editor->CursorPos.y > editor->RowCount ? editor->CursorPos.y - editor->RowCount : 0;
+            } else {
+                EnsureLineIndexed(editor, editor->Offset.y + 2*editor->RowCount);
+                size_t lastLine = editor->Text.LineCount ? editor->Text.LineCount - 1 : 0;
+                editor->Offset.y = (editor->Offset.y + editor->RowCount < lastLine) ? editor->Offset.y + editor->RowCount : lastLine;
+                editor->CursorPos.y = (editor->CursorPos.y + editor->RowCount < lastLine) ? editor->CursorPos.y + editor->RowCount : lastLine;
+            }
+            Line_Data* target = GetLine(&editor->Text, editor->CursorPos.y);
+            if(target) editor->CursorPos.x = IndexedRxToCx(&editor->LineIndexes, target, rx);
+        } break;
+        case CTRL_KEY('j'): // A newline byte would end up inside the line
+        case KEY_ENTER: InsertNewline(editor); break;
+        case KEY_ESC: break;
+        case CTRL_KEY('h'): break;
+        case CTRL_KEY('l'): break;
+        case CTRL_KEY('s'): SaveFile(editor); break;
+        case CTRL_KEY('f'): FindText(editor); break;
+        case CTRL_KEY('g'): GoToPosition(editor); break;
+        case CTRL_KEY('r'): ReplaceAll(editor); break;
+        case CTRL_KEY('z'): UndoEdit(editor); break;
+        case CTRL_KEY('y'): RedoEdit(editor); break;
+        case CTRL_KEY('p'): editor->Hud.Visible = !editor->Hud.Visible; break;
+        case CTRL_KEY('w'): SetSoftWrap(editor, !editor->SoftWrap); break;
+        case KeyType_Paste: {
+            XBuffer paste = {};
+            ReadPaste(&editor->Input, &paste);
+            InsertText(editor, paste.Data, paste.Used);
+            FreeBuffer(&paste);
+        } break;
+        case KeyType_Del:
+        case KeyType_Backspace: { 
+            if(character == KeyType_Del) { // Move cursor to the right
+                editor->CursorPos.x = (editor->CursorPos.x < lineSize) ? NextCharBoundary(line->Data, lineSize, editor->CursorPos.x) : editor->CursorPos.x + 1;
+            }
+            
+            DeleteCharacter(editor);
+        } break;
+        case KeyType_Home: {
+            editor->CursorPos.x = 0;
+        } break;
+        case KeyType_End: {
+            editor->CursorPos.x = lineSize;
+        } break;
+        default: {
+            if(character < 256) InsertCharacter(editor, (u8)character);
+        } break;
+    }
+    
+    // Update the current line in case the cursor position Y changed
+    line = GetLine(&editor->Text, editor->CursorPos.y);
+    lineSize = line ? line->Size : 0;
+    // Snap to the end of the line
+    if(editor->CursorPos.x > lineSize) {
+        editor->CursorPos.x = lineSize;
+    }
+    
+    quitTimes = QUIT_TIMES;
+}
+
+// Maps the file read-only. Only the first screen gets split into lines here,
+// the rest is indexed on demand and while the editor is idle.
+static b32
+MapFile(Term_Editor* editor, int fileHandle) {
+    struct stat fileStat;
+    if(fstat(fileHandle, &fileStat) == -1 || !S_ISREG(fileStat.st_mode) || fileStat.st_size == 0) return false;
+    
+    void* base = mmap(0, fileStat.st_size, PROT_READ, MAP_PRIVATE, fileHandle, 0);
+    if(base == MAP_FAILED) return false;
+    
+    editor->Map.Base = (char*)base;
+    editor->Map.Size = fileStat.st_size;
+    editor->Map.Indexed = 0;
+    editor->Map.Large = editor->MemoryBudget || (u64)fileStat.st_size >= LARGE_FILE_BYTES;
+    editor->Map.PackedMemory = 0;
+    EnsureLineIndexed(editor, editor->RowCount);
+    
+    return true;
+}
+
+static b32
+UpdateWindowSize(Term_Editor* editor) {
+    size_t rows, columns;
+    if(!editor->Backend->GetSize(editor->Backend->Context, &rows, &columns) || rows < 3) return false;
+    
+    editor->RowCount = rows - 2; // leave room for the status bar
+    editor->ColumnCount = columns;
+    ResizeScreen(&editor->Screen, rows, columns);
+    if(editor->SoftWrap) SetWrapWidth(&editor->Text, columns);
+    
+    return true;
+}
+
+static b32 LoadFile(Term_Editor* editor, char* filename);
+
+// Throws the text away and loads the file again, after it was truncated or
+// replaced under a followed name
+static void
+ReloadFile(Term_Editor* editor) {
+    StopFollow(&editor->Follow);
+    u32 lastLineId = editor->Text.LastLineId;
+    size_t wrapWidth = editor->Text.WrapWidth;
+    FreeStore(&editor->Text);
+    editor->Text.LastLineId = lastLineId; // The render cache still knows the old ids
+    editor->Text.WrapWidth = wrapWidth;
+    if(editor->Map.Base) munmap(editor->Map.Base, editor->Map.Size);
+    editor->Map = {};
+    ClearJournal(&editor->Journal);
+    InvalidateSearch(&editor->Search);
+    editor->CursorPos = {};
+    editor->Offset = {};
+    editor->OffsetRow = 0;
+    
+    char* filename = editor->Filename;
+    editor->Filename = 0;
+    if(LoadFile(editor, filename)) {
+        free(filename);
+        SetStatusMessage(editor, "The file was replaced, loaded it again");
+    } else {
+        editor->Filename = filename;
+        SetStatusMessage(editor, "Can't load %s again! %s", filename, strerror(errno));
+    }
+}
+
+// Picks up what was appended to a followed file. While the cursor is on the
+// last line it stays there, so the view sticks to the bottom. Nothing is read
+// while a save is writing the file.
+static void
+UpdateFollow(Term_Editor* editor) {
+    File_Follow* follow = &editor->Follow;
+    if(editor->Save.Running) return;
+    
+    u32 change = CheckFollow(follow);
+    if(change == FollowChange_Appended) {
+        TRACE_SCOPE("follow");
+        b32 atBottom = editor->CursorPos.y + 1 >= editor->Text.LineCount;
+        int error = ReadAppended(follow, &editor->Text);
+        if(error) {
+            SetStatusMessage(editor, "Can't follow %s! %s", editor->Filename, strerror(error));
+            StopFollow(follow);
+            return;
+        }
+        InvalidateSearch(&editor->Search);
+        if(atBottom && editor->Text.LineCount) {
+            editor->CursorPos.y = editor->Text.LineCount - 1;
+            editor->CursorPos.x = 0;
+        }
+    } else if(change == FollowChange_Replaced) {
+        if(editor->Dirty) {
+            SetStatusMessage(editor, "%s changed on disk, stopped following it", editor->Filename);
+            StopFollow(follow);
+            return;
+        }
+        ReloadFile(editor);
+    }
+}
+
+// Whether the lines of the replace are there and hold what it replaces, at
+// the columns ApplyReplace will look at
+static b32
+ReplaceFits(Term_Editor* editor, Recovery_Record* record) {
+    b32 undo = (record->Kind == RecoveryKind_UndoReplace);
+    char* present = undo ? record->To : record->Text;
+    size_t presentLength = undo ? record->ToLength : record->Size;
+    
+    Line_Data* line = 0;
+    size_t lineIndex = 0;
+    size_t onLine = 0; // Matches before this one on the line
+    size_t end = 0;
+    for(size_t index = 0; index < record->MatchCount; index++) {
+        Search_Match match = record->Matches[index];
+        if(!line || match.Line != lineIndex) {
+            EnsureLineIndexed(editor, match.Line + 1);
+            if(match.Line >= editor->Text.LineCount) return false;
+            line = GetLine(&editor->Text, match.Line);
+            lineIndex = match.Line;
+            onLine = 0;
+            end = 0;
+        }
+        
+        size_t column = match.Column;
+        if(undo) {
+            if(column + onLine * record->ToLength < onLine * record->Size) return false;
+            column = column + onLine * record->ToLength - onLine * record->Size;
+        }
+        if(column < end || column > line->Size || presentLength > line->Size - column) return false;
+        if(memcmp(line->Data + column, present, presentLength) != 0) return false;
+        end = column + presentLength;
+        onLine++;
+    }
+    return true;
+}
+
+// Applies an edit read back from the recovery journal, the way it was made.
+// False when it doesn't fit the text, the journal can't be trusted from there.
+static b32
+ReplayRecord(Term_Editor* editor, Recovery_Record* record) {
+    Line_Store* store = &editor->Text;
+    EnsureLineIndexed(editor, (record->Kind == RecoveryKind_Delete ? record->EndY : record->Y) + 1);
+    switch(record->Kind) {
+        case RecoveryKind_Character:
+        case RecoveryKind_Text:
+        case RecoveryKind_Newline:
+        case RecoveryKind_DeleteCharacter: {
+            if(record->Y > store->LineCount) return false;
+            Line_Data* line = GetLine(store, record->Y);
+            if(record->Kind == RecoveryKind_Newline && line && record->X > line->Size) return false;
+            editor->CursorPos.y = record->Y;
+            editor->CursorPos.x = record->X;
+            if(record->Kind == RecoveryKind_Character) InsertCharacter(editor, (u8)record->Text[0]);
+            else if(record->Kind == RecoveryKind_Text) InsertText(editor, record->Text, record->Size);
+            else if(record->Kind == RecoveryKind_Newline) InsertNewline(editor);
+            else DeleteCharacter(editor);
+        } break;
+        case RecoveryKind_Delete: {
+            if(record->EndY >= store->LineCount) return false;
+            if(record->Y == record->EndY && record->X > record->EndX) return false;
+            if(record->X > GetLine(store, record->Y)->Size || record->EndX > GetLine(store, record->EndY)->Size) return false;
+            DeleteText(editor, record->Y, record->X, record->EndY, record->EndX);
+            editor->CursorPos.y = record->Y;
+            editor->CursorPos.x = record->X;
+        } break;
+        case RecoveryKind_AddLine: {
+            if(record->Y > store->LineCount) return false;
+            InsertLine(editor, record->Y, "", 0);
+        } break;
+        case RecoveryKind_DeleteLine: {
+            if(record->Y >= store->LineCount) return false;
+            DeleteLine(editor, record->Y);
+        } break;
+        default: {
+            if(!record->MatchCount || !ReplaceFits(editor, record)) return false;
+            ApplyReplace(editor, record->Matches, record->MatchCount, record->Text, record->Size,
+                         record->To, record->ToLength, record->Kind == RecoveryKind_UndoReplace);
+            editor->CursorPos.y = record->Y;
+            editor->CursorPos.x = 0;
+        } break;
+    }
+    return true;
+}
+
+// Starts the recovery journal of the file that was just loaded. A journal left
+// behind for it, by an editor that didn't get to save, is replayed first: its
+// edits come back as unsaved ones, with the cursor at the last of them. They
+// start the undo history, they aren't in it.
+static void
+RecoverEdits(Term_Editor* editor, struct stat* fileStat) {
+    Recovery_Journal* recovery = &editor->Recovery;
+    if(!StartRecovery(recovery, editor->Filename, fileStat)) return;
+    
+    XBuffer records = {};
+    b32 stale;
+    if(!ReadRecovery(recovery, &records, &stale)) {
+        if(stale) SetStatusMessage(editor, "%s doesn't fit the file, the next edit replaces it", recovery->Path);
+        return;
+    }
+    
+    TRACE_SCOPE("recover");
+    b32 active = recovery->Active;
+    recovery->Active = false;
+    editor->Journal.Replaying = true;
+    Recovery_Reader reader = {};
+    reader.At = (u8*)records.Data;
+    reader.End = reader.At + records.Used;
+    Recovery_Record record;
+    size_t count = 0;
+    size_t replayed = 0; // Bytes of the records that went in
+    while(NextRecord(&reader, &record) && ReplayRecord(editor, &record)) {
+        count++;
+        replayed = (char*)reader.At - records.Data;
+    }
+    editor->Journal.Replaying = false;
+    recovery->Active = active;
+    
+    if(!active) {
+        SetStatusMessage(editor, "Recovered %zu edits, but can't write to %s any more", count, recovery->Path);
+    } else if(replayed < records.Used) {
+        // What didn't fit goes, so it isn't in the way of what comes next
+        int error = ReplaceJournal(recovery, records.Data, replayed);
+        SetStatusMessage(editor, "Recovered %zu edits, the rest of %s didn't fit the file", count, recovery->Path);
+        if(error) recovery->Active = false;
+    } else if(count) {
+        SetStatusMessage(editor, "Recovered %zu unsaved edits", count);
+    }
+    if(count) {
+        editor->Dirty = true;
+        ScrollToCursor(editor);
+    }
+    free(reader.Matches);
+    FreeBuffer(&records);
+}
+
+static b32
+LoadFile(Term_Editor* editor, char* filename) {
+    TRACE_SCOPE("load");
+    FILE* fileHandle = fopen(filename, "r");
+    if(!fileHandle) {
+        return false;
+    }
+    
+    // Save the file name
+    if(editor->Filename) {
+        free(editor->Filename);
+    }
+    editor->Filename = strdup(filename);
+    SetLanguage(&editor->Highlight, DetectLanguage(filename));
+    
+    // A followed file can be truncated under the editor, and touching a mapping
+    // past the new end kills it with SIGBUS, so its lines are read instead
+    u64 bytesRead = 0;
+    b32 partial = false;
+    if(editor->FollowMode || !MapFile(editor, fileno(fileHandle))) {
+        // Read the File
+        char* line = 0;
+        size_t lineCap = 0;
+        ssize_t lineLen;
+        while((lineLen = getline(&line, &lineCap, fileHandle)) != -1) {
+            bytesRead += lineLen;
+            partial = (line[lineLen - 1] != '\n');
+            while(lineLen > 0 && (line[lineLen -1] == '\n' || line[lineLen - 1] == '\r')) {
+                lineLen--;
+            }
+            
+            InsertLine(editor, editor->Text.LineCount, line, lineLen);
+        }
+        free(line);
+    }
+    struct stat fileStat;
+    b32 recover = !editor->FollowMode && fstat(fileno(fileHandle), &fileStat) == 0;
+    fclose(fileHandle); // A mapping stays valid after the close
+    editor->Dirty = false;
+    
+    // A followed file keeps changing under its edits, it has no journal
+    if(recover) RecoverEdits(editor, &fileStat);
+    
+    if(editor->FollowMode) {
+        // Appended lines go after the last one, and that's where the view starts
+        FollowFile(editor, bytesRead, partial);
+        editor->CursorPos.y = editor->Text.LineCount ? editor->Text.LineCount - 1 : 0;
+    }
+    
+    return true;
+}
+// Hooks the editor up to a backend, which has to report a usable size
+static b32
+InitEditor(Term_Editor* editor, Editor_Backend* backend, size_t undoLimit) {
+    editor->Backend = backend;
+    editor->Input.Backend = backend;
+    InitJournal(&editor->Journal, undoLimit);
+    editor->Recovery.FileHandle = -1;
+    if(!UpdateWindowSize(editor)) return false;
+    
+    SetStatusMessage(editor, "HELP: Ctrl-Q quit | Ctrl-S save | Ctrl-F find | Ctrl-R replace | Ctrl-Z undo");
+    return true;
+}
+
+// Waits for a save still running and lets go of the text. Quitting throws
+// the unsaved edits away and their recovery journal with them, it's kept when
+// the input went away instead (the terminal was closed) or a save failed.
+static void
+CloseEditor(Term_Editor* editor) {
+    // Don't cut a save short
+    if(editor->Save.Running) {
+        FinishSave(&editor->Save, &editor->Text);
+        SettleRecovery(editor);
+    }
+    CloseRecovery(&editor->Recovery, editor->Input.Closed || editor->Save.Error);
+    StopFollow(&editor->Follow);
+    FreeStore(&editor->Text);
+}
+
+// Handles every complete key in the input buffer
+static void
+HandleInput(Term_Editor* editor) {
+    if(InputAvailable(&editor->Input)) NoteInput(&editor->Hud);
+    
+    u32 character;
+    while(GlobalRunning && NextKey(&editor->Input, &character)) {
+        TRACE_SCOPE("edit");
+        ProcessKeyInput(editor, character);
+        ScrollToCursor(editor); // Keys like PageUp work from the current view
+    }
+}
@@ -0,0 +1,247 @@
+// Saving.
+//
+// The document is streamed to disk straight out of the line store: every
+// writev() takes a batch of iovecs pointing at the lines and a shared "\n", so
+// there is never a second copy of the text in memory. The data goes to a
+// temporary file next to the target, which is synced and then renamed over
+// it, so a crash in the middle of a save leaves the old file untouched.
+//
+// Saves run on a thread of their own, from a snapshot of the store, so the
+// editor keeps taking input while a big file is being written.
+
+#include <sys/uio.h> // for writev()
+#include <limits.h>  // for PATH_MAX
+#include <pthread.h>
+
+#define SAVE_IOV_COUNT 1024 // iovecs per writev() (IOV_MAX on Linux)
+
+struct Save_Job {
+    b32 Running;      // Started and not collected by FinishSave yet
+    pthread_t Thread;
+    Store_Snapshot Snapshot;
+    char* Filename;
+
+    // Written by the save thread, read with atomics
+    size_t BlocksWritten;
+    b32 Done;
+
+    // Valid once Done is set
+    int Error;
+    u64 BytesWritten;
+
+    f64 StartTime, EndTime; // For the trace
+};
+
+// Writes all the iovecs, picking up after short writes. Returns an errno value, 0 on success.
+static int
+WriteVectors(int fileHandle, struct iovec* vectors, int count) {
+    while(count > 0) {
+        ssize_t written = writev(fileHandle, vectors, count);
+        if(written < 0) {
+            if(errno == EINTR) continue;
+            return errno;
+        }
+
+        // Skip what made it out, the rest goes again
+        size_t remaining = (size_t)written;
+        while(count > 0 && remaining >= vectors->iov_len) {
+            remaining -= vectors->iov_len;
+            vectors++;
+            count--;
+        }
+        if(count > 0) {
+            vectors->iov_base = (char*)vectors->iov_base + remaining;
+            vectors->iov_len -= remaining;
+        }
+    }
+    return 0;
+}
+
+// Every line followed by a newline, a block at a time, so the file comes out
+// as StoreByteCount counts it. A span goes out as the bytes of the file it
+// stands for, a compressed one unpacked first. When its lines end in CRs it
+// is split like IndexFile splits it instead, the CRs dropped as they are from
+// every line that was unpacked, so the line endings don't depend on which
+// spans were looked at.
+static int
+WriteSnapshot(int fileHandle, Save_Job* job) {
+    persist char newline = '\n';
+    struct iovec vectors[SAVE_IOV_COUNT];
+    int count = 0;
+    u64 total = 0;
+
+    for(size_t rank = 0; rank < job->Snapshot.BlockCount; rank++) {
+        Line_Block* block = job->Snapshot.Blocks[rank];
+        __atomic_store_n(&job->BlocksWritten, rank, __ATOMIC_RELAXED);
+        if(IsSpan(block)) {
+            char* text = OpenSpan(block);
+            char* end = text + block->SpanSize;
+            b32 terminated = (end[-1] == '\n'); // Only the last line of the file isn't
+            int error = 0;
+            if(block->SpanSize + !terminated == block->SpanBytes) {
+                // No CRs, the bytes are the lines already
+                vectors[count].iov_base = text;
+                vectors[count].iov_len = block->SpanSize;
+                count++;
+                if(!terminated) {
+                    vectors[count].iov_base = &newline;
+                    vectors[count].iov_len = 1;
+                    count++;
+                }
+            } else {
+                for(char* at = text; !error && at < end;) {
+                    char* line;
+                    size_t size = NextSpanLine(&at, end, &line);
+                    if(size) {
+                        vectors[count].iov_base = line;
+                        vectors[count].iov_len = size;
+                        count++;
+                    }
+                    vectors[count].iov_base = &newline;
+                    vectors[count].iov_len = 1;
+                    count++;
+
+                    if(count > SAVE_IOV_COUNT - 2) {
+                        error = WriteVectors(fileHandle, vectors, count);
+                        count = 0;
+                    }
+                }
+            }
+            total += block->SpanBytes;
+
+            if(!error) error = WriteVectors(fileHandle, vectors, count);
+            CloseSpan(block, text);
+            if(error) return error;
+            count = 0;
+            continue;
+        }
+
+        for(u32 index = 0; index < block->Count; index++) {
+            Line_Data* line = block->Lines + index;
+            if(line->Size) {
+                vectors[count].iov_base = line->Data;
+                vectors[count].iov_len = line->Size;
+                count++;
+            }
+            vectors[count].iov_base = &newline;
+            vectors[count].iov_len = 1;
+            count++;
+            total += line->Size + 1;
+
+            if(count > SAVE_IOV_COUNT - 2) {
+                int error = WriteVectors(fileHandle, vectors, count);
+                if(error) return error;
+                count = 0;
+            }
+        }
+    }
+
+    int error = WriteVectors(fileHandle, vectors, count);
+    if(error) return error;
+    job->BytesWritten = total;
+    return 0;
+}
+
+// Writes the snapshot to `filename` through a temporary file and rename().
+// Returns an errno value, 0 on success.
+static int
+SaveSnapshot(Save_Job* job) {
+    char* filename = job->Filename;
+    // Replace what a symlink points at, not the link
+    char target[PATH_MAX];
+    if(!realpath(filename, target)) {
+        if(errno != ENOENT) return errno;
+        if(snprintf(target, sizeof(target), "%s", filename) >= (int)sizeof(target)) return ENAMETOOLONG;
+    }
+
+    // The temporary file has to be on the same file system for rename() to be atomic
+    char temp[PATH_MAX];
+    char* slash = strrchr(target, '/');
+    int directoryLength = slash ? (int)(slash - target) + 1 : 0;
+    if(snprintf(temp, sizeof(temp), "%.*s.%s.XXXXXX", directoryLength, target, target + directoryLength) >= (int)sizeof(temp)) {
+        return ENAMETOOLONG;
+    }
+
+    int fileHandle = mkstemp(temp);
+    if(fileHandle == -1) return errno;
+
+    struct stat fileStat;
+    mode_t mode = (stat(target, &fileStat) == 0) ? (fileStat.st_mode & 07777) : 0644;
+
+    int error = 0;
+    if(fchmod(fileHandle, mode) == -1) error = errno;
+    if(!error) error = WriteSnapshot(fileHandle, job);
+    if(!error && fsync(fileHandle) == -1) error = errno;
+    if(close(fileHandle) == -1 && !error) error = errno;
+    if(!error && rename(temp, target) == -1) error = errno;
+
+    if(error) {
+        unlink(temp);
+        return error;
+    }
+
+    // Make the rename itself durable
+    if(directoryLength) target[directoryLength] = 0;
+    int directoryHandle = open(directoryLength ? target : ".", O_RDONLY | O_DIRECTORY);
+    if(directoryHandle != -1) {
+        fsync(directoryHandle);
+        close(directoryHandle);
+    }
+    return 0;
+}
+
+static void*
+SaveThread(void* data) {
+    Save_Job* job = (Save_Job*)data;
+    job->Error = SaveSnapshot(job);
+    job->EndTime = GetSeconds();
+    __atomic_store_n(&job->Done, true, __ATOMIC_RELEASE);
+    return 0;
+}
+
+// Snapshots the store and starts writing it out. Returns an errno value, 0
+// when the save is on its way.
+static int
+StartSave(Save_Job* job, Line_Store* store, char* filename) {
+    Assert(!job->Running);
+    *job = {};
+    job->Filename = strdup(filename);
+    if(!job->Filename) return ENOMEM;
+    job->StartTime = GetSeconds();
+    TakeSnapshot(store, &job->Snapshot);
+
+    int error = pthread_create(&job->Thread, 0, SaveThread, job);
+    if(error) {
+        ReleaseSnapshot(store, &job->Snapshot);
+        free(job->Filename);
+        job->Filename = 0;
+        return error;
+    }
+    job->Running = true;
+    return 0;
+}
+
+inline b32
+IsSaveDone(Save_Job* job) {
+    return __atomic_load_n(&job->Done, __ATOMIC_ACQUIRE);
+}
+
+// Percentage of the snapshot written so far
+inline int
+SaveProgress(Save_Job* job) {
+    size_t written = __atomic_load_n(&job->BlocksWritten, __ATOMIC_RELAXED);
+    return job->Snapshot.BlockCount ? (int)(written * 100 / job->Snapshot.BlockCount) : 0;
+}
+
+// Waits for the save thread and lets go of the snapshot. Error and
+// BytesWritten tell how it went.
+static void
+FinishSave(Save_Job* job, Line_Store* store) {
+    Assert(job->Running);
+    pthread_join(job->Thread, 0);
+    TraceEvent("write file", job->StartTime, job->EndTime, TRACE_SAVE_THREAD);
+    ReleaseSnapshot(store, &job->Snapshot);
+    free(job->Filename);
+    job->Filename = 0;
+    job->Running = false;
+}
@@ -0,0 +1,178 @@
+// Following a growing file.
+//
+// inotify watches the file for writes and for being moved or deleted, and its
+// directory for a new file under the same name (log rotation). Bytes appended
+// to the file are read with pread() from where the last read stopped and go on
+// the end of the store as new lines, the lines already there are left alone.
+// Only the last line changes, when the file didn't end with a newline and the
+// writer finishes it.
+//
+// Each read takes at most FOLLOW_STEP_BYTES, the caller comes back for the rest
+// on its next pass, so a fast writer never holds up input.
+
+#include <sys/inotify.h>
+
+#define FOLLOW_STEP_BYTES (1024*1024)
+#define FOLLOW_EVENT_BUFFER 4096
+
+enum Follow_Change {
+    FollowChange_None,
+    FollowChange_Appended, // There are new bytes to read
+    FollowChange_Replaced, // Truncated, or another file took the name, load it again
+};
+
+struct File_Follow {
+    b32 Active;
+    int WatchHandle; // inotify
+    int FileWatch;
+    int DirectoryWatch;
+    int FileHandle;  // The file being followed, even after it was moved away
+    dev_t Device;
+    ino_t Inode;
+    char* Path;
+    char* Name;      // Past the last slash of Path, to match directory events
+
+    u64 Offset;      // Bytes of the file in the store
+    b32 Partial;     // The last line in the store is still waiting for its newline
+    b32 Pending;     // Something happened that wasn't looked at yet
+    char* Buffer;    // FOLLOW_STEP_BYTES
+};
+
+static void
+StopFollow(File_Follow* follow) {
+    if(!follow->Active) return;
+    close(follow->WatchHandle);
+    close(follow->FileHandle);
+    free(follow->Path);
+    free(follow->Buffer);
+    *follow = {};
+}
+
+// Starts watching `path`, of which the first `offset` bytes are already in the
+// store. Returns an errno value, 0 on success.
+static int
+StartFollow(File_Follow* follow, char* path, u64 offset, b32 partial) {
+    Assert(!follow->Active);
+    int fileHandle = open(path, O_RDONLY | O_CLOEXEC);
+    if(fileHandle == -1) return errno;
+
+    struct stat fileStat;
+    int watchHandle = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if(watchHandle == -1 || fstat(fileHandle, &fileStat) == -1) {
+        int error = errno;
+        if(watchHandle != -1) close(watchHandle);
+        close(fileHandle);
+        return error;
+    }
+
+    follow->Path = strdup(path);
+    follow->Buffer = (char*)malloc(FOLLOW_STEP_BYTES);
+    Assert(follow->Path && follow->Buffer);
+    char* slash = strrchr(follow->Path, '/');
+    follow->Name = slash ? slash + 1 : follow->Path;
+
+    // The directory is watched for rotations, following still works without it
+    follow->FileWatch = inotify_add_watch(watchHandle, path, IN_MODIFY | IN_ATTRIB | IN_MOVE_SELF | IN_DELETE_SELF);
+    if(slash) *slash = 0;
+    follow->DirectoryWatch = inotify_add_watch(watchHandle, slash ? (slash == follow->Path ? "/" : follow->Path) : ".", IN_CREATE | IN_MOVED_TO);
+    if(slash) *slash = '/';
+
+    follow->Active = true;
+    follow->WatchHandle = watchHandle;
+    follow->FileHandle = fileHandle;
+    follow->Device = fileStat.st_dev;
+    follow->Inode = fileStat.st_ino;
+    follow->Offset = offset;
+    follow->Partial = partial;
+    follow->Pending = true; // It may have grown since it was loaded
+    return 0;
+}
+
+// Takes the inotify events that arrived and works out what changed. Never
+// blocks.
+static u32
+CheckFollow(File_Follow* follow) {
+    if(!follow->Active) return FollowChange_None;
+
+    alignas(struct inotify_event) char events[FOLLOW_EVENT_BUFFER];
+    ssize_t length;
+    while((length = read(follow->WatchHandle, events, sizeof(events))) > 0) {
+        for(char* at = events; at < events + length;) {
+            struct inotify_event* event = (struct inotify_event*)at;
+            if(event->wd == follow->FileWatch ||
+               (event->len && strcmp(event->name, follow->Name) == 0)) {
+                follow->Pending = true;
+            }
+            at += sizeof(struct inotify_event) + event->len;
+        }
+    }
+    if(!follow->Pending) return FollowChange_None;
+
+    struct stat fileStat;
+    if(fstat(follow->FileHandle, &fileStat) == -1 || (u64)fileStat.st_size < follow->Offset) {
+        return FollowChange_Replaced;
+    }
+
+    // A file that was moved away is read to its end before the new one is loaded
+    if((u64)fileStat.st_size > follow->Offset) return FollowChange_Appended;
+    if(stat(follow->Path, &fileStat) == 0 && (fileStat.st_dev != follow->Device || fileStat.st_ino != follow->Inode)) {
+        return FollowChange_Replaced;
+    }
+
+    follow->Pending = false;
+    return FollowChange_None;
+}
+
+// Reads the next appended bytes into the store. Returns an errno value, 0 on
+// success.
+static int
+ReadAppended(File_Follow* follow, Line_Store* store) {
+    ssize_t bytesRead = pread(follow->FileHandle, follow->Buffer, FOLLOW_STEP_BYTES, follow->Offset);
+    if(bytesRead < 0) return errno;
+    follow->Offset += bytesRead;
+
+    char* at = follow->Buffer;
+    char* end = follow->Buffer + bytesRead;
+    if(follow->Partial && store->LineCount && at < end) {
+        // Finish the last line first
+        size_t length = FindByte(at, end - at, '\n');
+        b32 finished = length < (size_t)(end - at);
+        Line_Data* line = EditLine(store, store->LineCount - 1);
+        ReserveLine(store, line, line->Size + length);
+        memcpy(line->Data + line->Size, at, length);
+        line->Size += length;
+        if(finished) {
+            while(line->Size > 0 && line->Data[line->Size - 1] == '\r') line->Size--;
+        }
+        line->Data[line->Size] = 0;
+        at += finished ? length + 1 : length;
+        follow->Partial = !finished;
+    }
+
+    Line_Data lines[LINE_BLOCK_CAPACITY];
+    size_t count = 0;
+    while(at < end) {
+        size_t remaining = end - at;
+        size_t length = FindByte(at, remaining, '\n');
+        follow->Partial = (length == remaining); // The writer may be in the middle of it
+        size_t size = length;
+        if(!follow->Partial) {
+            while(size > 0 && at[size - 1] == '\r') size--;
+        }
+
+        Line_Data* line = lines + count++;
+        *line = {};
+        line->Size = size;
+        line->Data = AllocLineData(store, size);
+        memcpy(line->Data, at, size);
+        line->Data[size] = 0;
+        at += follow->Partial ? length : length + 1;
+
+        if(count == LINE_BLOCK_CAPACITY) {
+            StoreAppendLines(store, lines, count);
+            count = 0;
+        }
+    }
+    if(count) StoreAppendLines(store, lines, count);
+    return 0;
+}
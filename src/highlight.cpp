@@ -0,0 +1,341 @@
+// Syntax highlighting.
+//
+// Every line remembers the lexer state it started and ended in (inside a
+// block comment, a string that goes on...), so any line can be lexed without
+// looking at the ones above it. The highlighter keeps a frontier: the end
+// states of the lines before it are known to be right. An edit pulls the
+// frontier back to the changed line, and walking forward again re-lexes only
+// until a line starts in the state it was lexed with before; from there on the
+// cached states still hold and are only checked. The walk never goes past the
+// bottom of the screen and has a budget per frame, and only the lines on
+// screen are ever colored (by the render cache). Long lines (LONG_LINE_BYTES)
+// aren't colored at all, and leave the state as they found it.
+
+#define HIGHLIGHT_STEP_BYTES (4*1024*1024) // Bytes of text lexed per frame, at most
+#define HIGHLIGHT_LINE_COST 16             // What checking a cached line counts for
+
+enum Language {
+    Language_None,
+    Language_C,    // C and C++
+    Language_Json,
+    Language_Log,
+};
+
+// End states of a line, per language
+enum Lex_State {
+    LexState_Normal,
+    LexState_Comment, // C: inside /* */
+    LexState_String,  // C: inside a string continued with '\'
+};
+
+struct Highlighter {
+    u8 Language;
+    size_t Frontier; // Lines before this one have the right LexEnd
+    size_t Wanted;   // Where the frontier has to get to for the last frame
+};
+
+global char* CKeywords[] = {
+    "alignas", "alignof", "asm", "auto", "break", "case", "catch", "class", "const", "consteval",
+    "constexpr", "const_cast", "continue", "decltype", "default", "delete", "do", "dynamic_cast",
+    "else", "enum", "explicit", "export", "extern", "false", "for", "friend", "goto", "if",
+    "inline", "mutable", "namespace", "new", "noexcept", "nullptr", "operator", "private",
+    "protected", "public", "register", "reinterpret_cast", "restrict", "return", "sizeof",
+    "static", "static_assert", "static_cast", "struct", "switch", "template", "this",
+    "thread_local", "throw", "true", "try", "typedef", "typeid", "typename", "union", "using",
+    "virtual", "volatile", "while",
+};
+
+global char* CTypes[] = {
+    "bool", "char", "double", "float", "int", "long", "short", "signed", "unsigned", "void",
+    "wchar_t", "char8_t", "char16_t", "char32_t", "size_t", "ssize_t", "ptrdiff_t",
+    "int8_t", "int16_t", "int32_t", "int64_t", "uint8_t", "uint16_t", "uint32_t", "uint64_t",
+    "intptr_t", "uintptr_t", "i8", "i16", "i32", "i64", "u8", "u16", "u32", "u64", "b32",
+    "f32", "f64",
+};
+
+// Picks the language from the file name
+static u8
+DetectLanguage(char* filename) {
+    if(!filename) return Language_None;
+
+    char* name = strrchr(filename, '/');
+    name = name ? name + 1 : filename;
+    char* extension = strrchr(name, '.');
+    if(!extension) return Language_None;
+    extension++;
+
+    persist char* cExtensions[] = {"c", "h", "cc", "cpp", "cxx", "hh", "hpp", "hxx", "inl"};
+    for(size_t index = 0; index < sizeof(cExtensions) / sizeof(cExtensions[0]); index++) {
+        if(strcmp(extension, cExtensions[index]) == 0) return Language_C;
+    }
+    if(strcmp(extension, "json") == 0) return Language_Json;
+    // Rotated logs are "name.log.1"
+    if(strcmp(extension, "log") == 0 || strstr(name, ".log.")) return Language_Log;
+    return Language_None;
+}
+
+// Only C carries state from one line to the next
+inline b32
+HasLineState(u8 language) {
+    return language == Language_C;
+}
+
+inline b32
+IsIdentifierByte(u8 byte) {
+    return isalnum(byte) || byte == '_';
+}
+
+inline b32
+IsOneOf(u8 byte, char* bytes) {
+    return byte && strchr(bytes, byte);
+}
+
+inline void
+SetStyle(u8* styles, size_t from, size_t to, u8 style) {
+    if(styles) memset(styles + from, style, to - from);
+}
+
+static b32
+IsWordIn(char** words, size_t count, char* word, size_t length) {
+    for(size_t index = 0; index < count; index++) {
+        if(strncmp(words[index], word, length) == 0 && words[index][length] == 0) return true;
+    }
+    return false;
+}
+
+// Skips the rest of a string or character closed by `quote`, from `at` on.
+// Returns where it ends; `open` is set when the line ends inside it with a
+// '\' to go on.
+static size_t
+SkipQuoted(char* data, size_t size, size_t at, char quote, b32* open) {
+    *open = false;
+    while(at < size) {
+        if(data[at] == '\\') {
+            if(at + 1 == size) {
+                *open = true;
+                return size;
+            }
+            at += 2;
+        } else if(data[at++] == quote) {
+            return at;
+        }
+    }
+    return size;
+}
+
+static u8
+LexC(u8 state, char* data, size_t size, u8* styles) {
+    size_t at = 0;
+
+    // Finish what the line above left open
+    if(state == LexState_Comment) {
+        char* end = (size >= 2) ? (char*)memmem(data, size, "*/", 2) : 0;
+        at = end ? (size_t)(end - data) + 2 : size;
+        SetStyle(styles, 0, at, CellStyle_Comment);
+        if(!end) return LexState_Comment;
+    } else if(state == LexState_String) {
+        b32 open;
+        at = SkipQuoted(data, size, 0, '"', &open);
+        SetStyle(styles, 0, at, CellStyle_String);
+        if(open) return LexState_String;
+    }
+
+    b32 lineStart = (state == LexState_Normal);
+    while(at < size) {
+        u8 byte = data[at];
+        size_t start = at;
+
+        if(byte == ' ' || byte == '\t') {
+            at++;
+            continue;
+        }
+
+        if(byte == '/' && at + 1 < size && data[at + 1] == '/') {
+            SetStyle(styles, at, size, CellStyle_Comment);
+            return LexState_Normal;
+        }
+
+        if(byte == '/' && at + 1 < size && data[at + 1] == '*') {
+            char* end = (size - at >= 4) ? (char*)memmem(data + at + 2, size - at - 2, "*/", 2) : 0;
+            at = end ? (size_t)(end - data) + 2 : size;
+            SetStyle(styles, start, at, CellStyle_Comment);
+            if(!end) return LexState_Comment;
+        } else if(byte == '"' || byte == '\'') {
+            b32 open;
+            at = SkipQuoted(data, size, at + 1, byte, &open);
+            SetStyle(styles, start, at, CellStyle_String);
+            if(open && byte == '"') return LexState_String;
+        } else if(byte == '#' && lineStart) {
+            at++;
+            while(at < size && (data[at] == ' ' || data[at] == '\t')) at++;
+            while(at < size && IsIdentifierByte(data[at])) at++;
+            SetStyle(styles, start, at, CellStyle_Preprocessor);
+        } else if(isdigit(byte) || (byte == '.' && at + 1 < size && isdigit((u8)data[at + 1]))) {
+            at++;
+            while(at < size && (IsIdentifierByte(data[at]) || IsOneOf(data[at], ".'") ||
+                                (IsOneOf(data[at], "+-") && IsOneOf(data[at - 1], "eEpP")))) {
+                at++;
+            }
+            SetStyle(styles, start, at, CellStyle_Number);
+        } else if(IsIdentifierByte(byte)) {
+            while(at < size && IsIdentifierByte(data[at])) at++;
+            if(styles) {
+                u8 style = CellStyle_Normal;
+                if(IsWordIn(CKeywords, sizeof(CKeywords) / sizeof(CKeywords[0]), data + start, at - start)) style = CellStyle_Keyword;
+                else if(IsWordIn(CTypes, sizeof(CTypes) / sizeof(CTypes[0]), data + start, at - start)) style = CellStyle_Type;
+                SetStyle(styles, start, at, style);
+            }
+        } else {
+            at++;
+        }
+        lineStart = false;
+    }
+    return LexState_Normal;
+}
+
+static void
+LexJson(char* data, size_t size, u8* styles) {
+    size_t at = 0;
+    while(at < size) {
+        u8 byte = data[at];
+        size_t start = at;
+        if(byte == '"') {
+            b32 open;
+            at = SkipQuoted(data, size, at + 1, '"', &open);
+            // A string followed by ':' is a key
+            size_t next = at;
+            while(next < size && (data[next] == ' ' || data[next] == '\t')) next++;
+            SetStyle(styles, start, at, (next < size && data[next] == ':') ? CellStyle_Keyword : CellStyle_String);
+        } else if(isdigit(byte) || byte == '-') {
+            at++;
+            while(at < size && (isdigit((u8)data[at]) || IsOneOf(data[at], ".eE+-"))) at++;
+            SetStyle(styles, start, at, CellStyle_Number);
+        } else if(isalpha(byte)) {
+            while(at < size && isalpha((u8)data[at])) at++;
+            SetStyle(styles, start, at, CellStyle_Type); // true, false, null
+        } else {
+            at++;
+        }
+    }
+}
+
+static void
+LexLog(char* data, size_t size, u8* styles) {
+    size_t at = 0;
+
+    // A leading timestamp, "2024-01-02 12:34:56,789" or "[...]"
+    if(size && (isdigit((u8)data[0]) || (data[0] == '[' && size > 1 && isdigit((u8)data[1])))) {
+        while(at < size && (isdigit((u8)data[at]) || IsOneOf(data[at], "-:.,/TZ+[]") ||
+                            (data[at] == ' ' && at + 1 < size && isdigit((u8)data[at + 1])))) {
+            at++;
+        }
+        SetStyle(styles, 0, at, CellStyle_Comment);
+    }
+
+    while(at < size) {
+        u8 byte = data[at];
+        size_t start = at;
+        if(byte == '"') {
+            b32 open;
+            at = SkipQuoted(data, size, at + 1, '"', &open);
+            SetStyle(styles, start, at, CellStyle_String);
+        } else if(isupper(byte)) {
+            while(at < size && isupper((u8)data[at])) at++;
+            if(at < size && IsIdentifierByte(data[at])) {
+                while(at < size && IsIdentifierByte(data[at])) at++;
+                continue;
+            }
+
+            persist char* errors[] = {"ERROR", "ERR", "FATAL", "CRITICAL", "CRIT", "PANIC", "SEVERE"};
+            persist char* warnings[] = {"WARN", "WARNING"};
+            persist char* infos[] = {"INFO", "NOTICE"};
+            persist char* debugs[] = {"DEBUG", "TRACE"};
+            char* word = data + start;
+            size_t length = at - start;
+            if(IsWordIn(errors, sizeof(errors) / sizeof(errors[0]), word, length)) SetStyle(styles, start, at, CellStyle_Error);
+            else if(IsWordIn(warnings, sizeof(warnings) / sizeof(warnings[0]), word, length)) SetStyle(styles, start, at, CellStyle_Warning);
+            else if(IsWordIn(infos, sizeof(infos) / sizeof(infos[0]), word, length)) SetStyle(styles, start, at, CellStyle_Type);
+            else if(IsWordIn(debugs, sizeof(debugs) / sizeof(debugs[0]), word, length)) SetStyle(styles, start, at, CellStyle_Comment);
+        } else if(IsIdentifierByte(byte)) {
+            while(at < size && IsIdentifierByte(data[at])) at++;
+        } else {
+            at++;
+        }
+    }
+}
+
+// Lexes a line that starts in `state` and returns the state at its end. With
+// `styles` set the style of every byte is written there, otherwise only the
+// state is worked out.
+static u8
+LexLine(u8 language, u8 state, char* data, size_t size, u8* styles) {
+    SetStyle(styles, 0, size, CellStyle_Normal);
+    switch(language) {
+        case Language_C: return LexC(state, data, size, styles);
+        case Language_Json: if(styles) LexJson(data, size, styles); break;
+        case Language_Log: if(styles) LexLog(data, size, styles); break;
+    }
+    return LexState_Normal;
+}
+
+static void
+SetLanguage(Highlighter* highlighter, u8 language) {
+    highlighter->Language = language;
+    highlighter->Frontier = 0;
+}
+
+// The state line `lineIndex` starts in, as far as the highlighter knows
+inline u8
+LineStartState(Line_Store* store, size_t lineIndex) {
+    Line_Data* above = lineIndex ? GetLine(store, lineIndex - 1) : 0;
+    return above ? above->LexEnd : (u8)LexState_Normal;
+}
+
+// Moves the frontier towards line `target`, within the budget of a frame
+static void
+UpdateHighlight(Highlighter* highlighter, Line_Store* store, size_t target) {
+    if(store->ChangedFrom < highlighter->Frontier) highlighter->Frontier = store->ChangedFrom;
+    store->ChangedFrom = (size_t)-1;
+
+    if(target > store->LineCount) target = store->LineCount;
+    highlighter->Wanted = target;
+    if(!HasLineState(highlighter->Language)) {
+        highlighter->Frontier = target > highlighter->Frontier ? target : highlighter->Frontier;
+        return;
+    }
+
+    if(highlighter->Frontier >= target) return;
+    TRACE_SCOPE("highlight");
+
+    size_t spent = 0;
+    u8 state = LineStartState(store, highlighter->Frontier);
+    while(highlighter->Frontier < target && spent < HIGHLIGHT_STEP_BYTES) {
+        Store_Path path;
+        Line_Block* block = FindBlock(store, highlighter->Frontier, &path)->Block;
+        // The lexer state isn't part of the text, it's written in place even
+        // when a snapshot holds the block
+        for(size_t index = highlighter->Frontier - path.FirstLine; index < block->Count && highlighter->Frontier < target; index++) {
+            Line_Data* line = block->Lines + index;
+            if(!(line->Flags & LineFlag_Lexed) || line->LexStart != state) {
+                line->LexStart = state;
+                line->LexEnd = state;
+                // Long lines aren't colored, the state goes through them
+                if(line->Size < LONG_LINE_BYTES) {
+                    line->LexEnd = LexLine(highlighter->Language, state, line->Data, line->Size, 0);
+                    spent += line->Size;
+                }
+                line->Flags |= LineFlag_Lexed;
+            }
+            spent += HIGHLIGHT_LINE_COST;
+            state = line->LexEnd;
+            highlighter->Frontier++;
+        }
+    }
+}
+
+// The frontier didn't make it to the bottom of the screen in the last frame
+inline b32
+IsHighlightPending(Highlighter* highlighter) {
+    return highlighter->Frontier < highlighter->Wanted;
+}
+
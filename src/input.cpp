@@ -0,0 +1,207 @@
+// Terminal input.
+//
+// The main loop sleeps in the backend until there is input, then drains
+// everything the terminal sent into a ring buffer. Keys
+// (including escape sequences) are decoded from the buffer, so a burst of
+// input is handled with a single redraw.
+
+#define INPUT_BUFFER_SIZE 4096 // Power of 2
+#define ESCAPE_TIMEOUT_MS 25   // How long to wait for the rest of an escape sequence
+#define ESCAPE_MAX_LENGTH 32
+#define PASTE_TIMEOUT_MS 1000  // Give up on a paste whose end marker never shows up
+#define PASTE_END "\x1b[201~"
+#define PASTE_END_LENGTH 6
+
+struct Input_Buffer {
+    u8 Data[INPUT_BUFFER_SIZE];
+    u32 ReadIndex;  // Free running, wrap with the mask
+    u32 WriteIndex;
+    b32 Closed;     // The input hit EOF or failed
+    Editor_Backend* Backend;
+};
+
+inline u32
+InputAvailable(Input_Buffer* input) {
+    return input->WriteIndex - input->ReadIndex;
+}
+
+inline u8
+PeekInput(Input_Buffer* input, u32 offset) {
+    return input->Data[(input->ReadIndex + offset) & (INPUT_BUFFER_SIZE - 1)];
+}
+
+// Reads whatever input there is into the buffer. Waits up to `timeoutMs` for it to
+// become readable (-1 blocks, 0 only takes what is already there). Returns
+// the number of bytes added.
+static u32
+FillInput(Input_Buffer* input, int timeoutMs) {
+    u32 added = 0;
+    for(;;) {
+        u32 space = INPUT_BUFFER_SIZE - InputAvailable(input);
+        if(space == 0 || input->Closed) break;
+
+        // Read up to the end of the ring, the next pass picks up the wrapped part
+        u32 writeAt = input->WriteIndex & (INPUT_BUFFER_SIZE - 1);
+        u32 contiguous = INPUT_BUFFER_SIZE - writeAt;
+        if(contiguous > space) contiguous = space;
+
+        Editor_Backend* backend = input->Backend;
+        ssize_t bytesRead = backend->Read(backend->Context, input->Data + writeAt, contiguous, added ? 0 : timeoutMs);
+        if(bytesRead <= 0) {
+            if(bytesRead < 0) input->Closed = true;
+            break; // Timeout, or a signal the caller wants to see
+        }
+        input->WriteIndex += bytesRead;
+        added += bytesRead;
+    }
+    return added;
+}
+
+// Maps a complete escape sequence (without the ESC) to a key. Unknown
+// sequences are swallowed as KEY_ESC.
+static u32
+DecodeEscapeSequence(u8* sequence, u32 length) {
+    if(sequence[0] == '[') {
+        u8 final = sequence[length - 1];
+        if(final == '~') {
+            u32 number = 0;
+            for(u32 index = 1; index < length - 1 && sequence[index] >= '0' && sequence[index] <= '9'; index++) {
+                number = number*10 + (sequence[index] - '0');
+            }
+            switch(number) {
+                case 200: return KeyType_Paste;
+                case 1: return KeyType_Home;
+                case 3: return KeyType_Del;
+                case 4: return KeyType_End;
+                case 5: return KeyType_PageUp;
+                case 6: return KeyType_PageDown;
+                case 7: return KeyType_Home;
+                case 8: return KeyType_End;
+            }
+        } else {
+            switch(final) {
+                case 'A': return KeyType_Up;
+                case 'B': return KeyType_Down;
+                case 'C': return KeyType_Right;
+                case 'D': return KeyType_Left;
+                case 'H': return KeyType_Home;
+                case 'F': return KeyType_End;
+            }
+        }
+    } else if(sequence[0] == 'O' && length == 2) {
+        switch(sequence[1]) {
+            case 'H': return KeyType_Home;
+            case 'F': return KeyType_End;
+        }
+    }
+    return '\x1b';
+}
+
+// Length of the escape sequence after an ESC at the read position, 0 while it
+// is still incomplete, or when it is cut short by a byte that can't be in one.
+static u32
+EscapeSequenceLength(Input_Buffer* input) {
+    u32 available = InputAvailable(input) - 1;
+    if(available == 0) return 0;
+
+    u8 introducer = PeekInput(input, 1);
+    if(introducer == 'O') return available >= 2 ? 2 : 0;
+    if(introducer != '[') return 0;
+
+    // CSI: parameter bytes, then a final byte in 0x40-0x7E
+    for(u32 index = 1; index < available && index < ESCAPE_MAX_LENGTH; index++) {
+        u8 byte = PeekInput(input, 1 + index);
+        if(byte < 0x20 || byte > 0x7E) return 0;
+        if(byte >= 0x40) return index + 1;
+    }
+    return 0;
+}
+
+// Takes the next key out of the buffer. A lone ESC is only reported once the
+// rest of a sequence failed to arrive in time. Returns false when there is no
+// complete key buffered.
+static b32
+NextKey(Input_Buffer* input, u32* key) {
+    if(InputAvailable(input) == 0) return false;
+
+    u8 byte = PeekInput(input, 0);
+    if(byte != '\x1b') {
+        input->ReadIndex++;
+        *key = byte;
+        return true;
+    }
+
+    u32 length = EscapeSequenceLength(input);
+    if(!length && FillInput(input, ESCAPE_TIMEOUT_MS)) {
+        length = EscapeSequenceLength(input);
+    }
+
+    if(!length) {
+        // Just the ESC key, or a sequence we don't know how to read: drop what
+        // there is of it, up to its final byte. The keys after it are kept.
+        u32 available = InputAvailable(input);
+        u8 introducer = available > 1 ? PeekInput(input, 1) : 0;
+        u32 skip = (introducer == '[' || introducer == 'O') ? 2 : 1;
+        while(introducer == '[' && skip < available) {
+            u8 byte = PeekInput(input, skip);
+            if(byte < 0x20 || byte > 0x7E) break;
+            skip++;
+            if(byte >= 0x40) break;
+        }
+        input->ReadIndex += skip;
+        *key = '\x1b';
+        return true;
+    }
+
+    u8 sequence[ESCAPE_MAX_LENGTH];
+    for(u32 index = 0; index < length; index++) {
+        sequence[index] = PeekInput(input, 1 + index);
+    }
+    input->ReadIndex += 1 + length;
+    *key = DecodeEscapeSequence(sequence, length);
+    return true;
+}
+
+// Blocks until a key is available (prompts read keys one at a time)
+static b32
+ReadKey(Input_Buffer* input, u32* key) {
+    while(!NextKey(input, key)) {
+        if(input->Closed) return false;
+        FillInput(input, -1);
+    }
+    return true;
+}
+
+// Collects the text of a bracketed paste (after ESC[200~) into `paste`, up to
+// the end marker. Whole runs between ESCs are copied at once.
+static b32
+ReadPaste(Input_Buffer* input, XBuffer* paste) {
+    u32 matched = 0; // Bytes of the end marker seen so far
+    for(;;) {
+        while(InputAvailable(input)) {
+            if(!matched) {
+                u32 readAt = input->ReadIndex & (INPUT_BUFFER_SIZE - 1);
+                u32 contiguous = INPUT_BUFFER_SIZE - readAt;
+                if(contiguous > InputAvailable(input)) contiguous = InputAvailable(input);
+
+                size_t run = FindByte((char*)input->Data + readAt, contiguous, '\x1b');
+                if(run) AppendToBuffer(paste, (char*)input->Data + readAt, run);
+                input->ReadIndex += run;
+                if(run == contiguous) continue;
+            }
+
+            u8 byte = PeekInput(input, 0);
+            input->ReadIndex++;
+            if(byte == (u8)PASTE_END[matched]) {
+                if(++matched == PASTE_END_LENGTH) return true;
+            } else {
+                // Not the marker after all, keep what was held back
+                AppendToBuffer(paste, PASTE_END, matched);
+                matched = (byte == '\x1b') ? 1 : 0;
+                if(!matched) AppendToBuffer(paste, (char*)&byte, 1);
+            }
+        }
+
+        if(input->Closed || !FillInput(input, PASTE_TIMEOUT_MS)) return false;
+    }
+}
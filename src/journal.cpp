@@ -0,0 +1,283 @@
+// Undo journal.
+//
+// Every edit is appended to a single arena as an entry that says which span
+// of text was inserted or deleted, and where, followed by the bytes of that
+// span. Undo walks the entries backwards and applies the opposite edit, redo
+// walks forward again, so both cost time in the size of the edit. Typing and
+// deleting one character after the other extends the last entry instead of
+// adding a new one. A replace-all is a single entry that lists where the
+// matches were.
+//
+// The arena has a memory limit. When it fills up the oldest half of the
+// history is dropped.
+
+#define JOURNAL_DEFAULT_LIMIT (64*1024*1024)
+#define JOURNAL_MERGE_LIMIT 256 // Longest run of keystrokes merged into one entry
+#define JOURNAL_NONE ((size_t)-1)
+
+enum Journal_Kind {
+    JournalKind_Insert,
+    JournalKind_Delete,
+    JournalKind_Replace, // The text is a Journal_Replace
+};
+
+enum Journal_Flags {
+    JournalFlag_AppendedLine = 0x1, // The edit started by adding a line past the end
+};
+
+// Positions are (line, byte). End is where the span ends in the text that has it.
+struct Journal_Entry {
+    u32 Kind;
+    u32 Flags;
+    size_t Previous; // Offset of the entry before this one, JOURNAL_NONE for the first
+    size_t Y, X;
+    size_t EndY, EndX;
+    size_t Size;     // Bytes of text right after the entry
+};
+
+// Every `From` at the matches was replaced with `To`. The matches are
+// positions in the text from before the replace.
+struct Journal_Replace {
+    size_t FromLength;
+    size_t ToLength;
+    size_t Count;
+    // From, To, then the Search_Match array (8 byte aligned)
+};
+
+struct Undo_Journal {
+    char* Base;
+    size_t Used;
+    size_t Capacity;
+    size_t Limit;
+
+    size_t Position; // Entries before this are applied, the ones after it can be redone
+    size_t Last;     // The entry right before Position, JOURNAL_NONE when there is nothing to undo
+    b32 Sealed;      // The next edit starts a new entry
+    b32 Replaying;   // Undo/redo are editing, don't record
+};
+
+inline char*
+EntryText(Journal_Entry* entry) {
+    return (char*)(entry + 1);
+}
+
+inline size_t
+EntrySize(size_t textSize) {
+    return (sizeof(Journal_Entry) + textSize + 7) & ~(size_t)7;
+}
+
+inline Journal_Entry*
+EntryAt(Undo_Journal* journal, size_t offset) {
+    return (Journal_Entry*)(journal->Base + offset);
+}
+
+inline char*
+ReplaceFrom(Journal_Replace* replace) {
+    return (char*)(replace + 1);
+}
+
+inline char*
+ReplaceTo(Journal_Replace* replace) {
+    return ReplaceFrom(replace) + replace->FromLength;
+}
+
+inline size_t
+ReplaceMatchesOffset(size_t fromLength, size_t toLength) {
+    return (sizeof(Journal_Replace) + fromLength + toLength + 7) & ~(size_t)7;
+}
+
+inline Search_Match*
+ReplaceMatches(Journal_Replace* replace) {
+    return (Search_Match*)((char*)replace + ReplaceMatchesOffset(replace->FromLength, replace->ToLength));
+}
+
+static void
+ClearJournal(Undo_Journal* journal) {
+    journal->Used = 0;
+    journal->Position = 0;
+    journal->Last = JOURNAL_NONE;
+    journal->Sealed = true;
+}
+
+static void
+InitJournal(Undo_Journal* journal, size_t limit) {
+    journal->Limit = limit ? limit : JOURNAL_DEFAULT_LIMIT;
+    ClearJournal(journal);
+}
+
+// Drops the oldest entries until `needed` more bytes fit in half the limit
+static void
+TrimJournal(Undo_Journal* journal, size_t needed) {
+    size_t keepFrom = 0;
+    while(keepFrom < journal->Used && journal->Used - keepFrom + needed > journal->Limit / 2) {
+        keepFrom += EntrySize(EntryAt(journal, keepFrom)->Size);
+    }
+    if(!keepFrom) return;
+
+    memmove(journal->Base, journal->Base + keepFrom, journal->Used - keepFrom);
+    journal->Used -= keepFrom;
+    journal->Position -= keepFrom;
+
+    // Offsets moved with the data
+    size_t previous = JOURNAL_NONE;
+    for(size_t offset = 0; offset < journal->Used; offset += EntrySize(EntryAt(journal, offset)->Size)) {
+        EntryAt(journal, offset)->Previous = previous;
+        previous = offset;
+    }
+    if(journal->Last != JOURNAL_NONE) {
+        journal->Last = (journal->Last >= keepFrom) ? journal->Last - keepFrom : JOURNAL_NONE;
+    }
+}
+
+// Makes room for `size` more bytes. False when they can't fit under the limit.
+static b32
+ReserveJournal(Undo_Journal* journal, size_t size) {
+    if(size > journal->Limit / 2) return false;
+    if(journal->Used + size > journal->Limit) TrimJournal(journal, size);
+
+    if(journal->Used + size > journal->Capacity) {
+        size_t capacity = journal->Capacity ? journal->Capacity * 2 : 4096;
+        while(capacity < journal->Used + size) capacity *= 2;
+        if(capacity > journal->Limit) capacity = journal->Limit;
+        char* base = (char*)realloc(journal->Base, capacity);
+        if(!base) return false;
+        journal->Base = base;
+        journal->Capacity = capacity;
+    }
+    return true;
+}
+
+// Extends the last entry with a keystroke, if it continues it
+static b32
+MergeEdit(Undo_Journal* journal, u32 kind, size_t y, size_t x, char* text, size_t size) {
+    if(journal->Sealed || journal->Last == JOURNAL_NONE || size != 1 || text[0] == '\n') return false;
+
+    Journal_Entry* entry = EntryAt(journal, journal->Last);
+    if(entry->Kind != kind || entry->Y != entry->EndY || entry->Size >= JOURNAL_MERGE_LIMIT) return false;
+
+    // Typing goes on at the end, Backspace eats into the start, Del keeps the start
+    b32 append;
+    if(kind == JournalKind_Insert && y == entry->EndY && x == entry->EndX) {
+        append = true;
+    } else if(kind == JournalKind_Delete && y == entry->Y && x + 1 == entry->X) {
+        append = false;
+    } else if(kind == JournalKind_Delete && y == entry->Y && x == entry->X) {
+        append = true;
+    } else {
+        return false;
+    }
+
+    size_t grow = EntrySize(entry->Size + 1) - EntrySize(entry->Size);
+    if(grow) {
+        // Trimming would move the entry, so only take what is already there
+        if(journal->Used + grow > journal->Capacity) return false;
+        journal->Used += grow;
+        journal->Position = journal->Used;
+    }
+
+    if(append) {
+        EntryText(entry)[entry->Size] = text[0];
+        entry->EndX++;
+    } else {
+        memmove(EntryText(entry) + 1, EntryText(entry), entry->Size);
+        EntryText(entry)[0] = text[0];
+        entry->X = x;
+    }
+    entry->Size++;
+    return true;
+}
+
+// Adds an entry with room for `size` bytes of text, the caller fills it in.
+// Redo history past the current position is dropped. Returns 0 when the
+// entry doesn't fit under the limit.
+static Journal_Entry*
+AppendEntry(Undo_Journal* journal, u32 kind, u32 flags, size_t size) {
+    size_t entrySize = EntrySize(size);
+    if(!ReserveJournal(journal, entrySize)) {
+        // Too big to remember, and nothing before it can be undone on its own
+        ClearJournal(journal);
+        return 0;
+    }
+
+    Journal_Entry* entry = EntryAt(journal, journal->Used);
+    *entry = {};
+    entry->Kind = kind;
+    entry->Flags = flags;
+    entry->Previous = journal->Last;
+    entry->Size = size;
+
+    journal->Last = journal->Used;
+    journal->Used += entrySize;
+    journal->Position = journal->Used;
+    journal->Sealed = true;
+    return entry;
+}
+
+// Records an insert or delete of `text` between (y, x) and (endY, endX)
+static void
+RecordEdit(Undo_Journal* journal, u32 kind, u32 flags, size_t y, size_t x, size_t endY, size_t endX, char* text, size_t size) {
+    if(journal->Replaying) return;
+
+    journal->Used = journal->Position;
+    if(!flags && MergeEdit(journal, kind, y, x, text, size)) return;
+
+    Journal_Entry* entry = AppendEntry(journal, kind, flags, size);
+    if(!entry) return;
+    entry->Y = y;
+    entry->X = x;
+    entry->EndY = endY;
+    entry->EndX = endX;
+    memcpy(EntryText(entry), text, size);
+    journal->Sealed = (size != 1 || text[0] == '\n');
+}
+
+// Records a replace-all. `matches` are sorted and don't overlap.
+static void
+RecordReplace(Undo_Journal* journal, char* from, size_t fromLength, char* to, size_t toLength, Search_Match* matches, size_t count) {
+    if(journal->Replaying || !count) return;
+
+    journal->Used = journal->Position;
+    size_t matchesOffset = ReplaceMatchesOffset(fromLength, toLength);
+    Journal_Entry* entry = AppendEntry(journal, JournalKind_Replace, 0, matchesOffset + count * sizeof(Search_Match));
+    if(!entry) return;
+    entry->Y = entry->EndY = matches[0].Line;
+    entry->X = entry->EndX = matches[0].Column;
+
+    Journal_Replace* replace = (Journal_Replace*)EntryText(entry);
+    replace->FromLength = fromLength;
+    replace->ToLength = toLength;
+    replace->Count = count;
+    memcpy(ReplaceFrom(replace), from, fromLength);
+    memcpy(ReplaceTo(replace), to, toLength);
+    memcpy(ReplaceMatches(replace), matches, count * sizeof(Search_Match));
+}
+
+// Keeps the next edit out of the last entry (the cursor moved, ...)
+inline void
+SealJournal(Undo_Journal* journal) {
+    journal->Sealed = true;
+}
+
+// The entry to undo, the position moves back over it. 0 when there is none.
+static Journal_Entry*
+JournalUndo(Undo_Journal* journal) {
+    if(journal->Last == JOURNAL_NONE) return 0;
+
+    Journal_Entry* entry = EntryAt(journal, journal->Last);
+    journal->Position = journal->Last;
+    journal->Last = entry->Previous;
+    journal->Sealed = true;
+    return entry;
+}
+
+// The entry to redo, the position moves forward over it. 0 when there is none.
+static Journal_Entry*
+JournalRedo(Undo_Journal* journal) {
+    if(journal->Position >= journal->Used) return 0;
+
+    Journal_Entry* entry = EntryAt(journal, journal->Position);
+    journal->Last = journal->Position;
+    journal->Position += EntrySize(entry->Size);
+    journal->Sealed = true;
+    return entry;
+}
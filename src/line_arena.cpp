@@ -0,0 +1,198 @@
+// Line memory.
+//
+// The text of edited lines comes from slabs instead of one malloc() per line.
+// A slab is a 64 KB mapping carved into slots of a single size class. The
+// classes grow geometrically, and a line that outgrows its slot moves to one at
+// least half as big again, so typing at the end of a line only allocates every
+// so often. Freed slots go on a free list of their slab, and the slabs with
+// free slots on a list of their class.
+//
+// Slabs are aligned to their size and start with a header, so the header of
+// any pointer the arena handed out is found by masking the pointer, and a
+// slot doesn't need a header of its own. Lines too big for a class get an
+// aligned mapping of their own with the same header in front.
+//
+// A slab whose slots are all freed again is given back, so text the store
+// lets go of in bulk (cold blocks it compresses) leaves the process. The rest
+// goes at once when the store is freed.
+
+#define SLAB_SIZE (64*1024) // Also the alignment of every mapping
+#define SLAB_HEADER_SIZE 64 // Slots start past the header
+#define SLAB_CLASS_COUNT 19
+#define SLAB_LARGE_CLASS 0xFF
+
+global size_t SlabClassSizes[SLAB_CLASS_COUNT] = {
+    16, 24, 32, 48, 64, 96, 128, 192, 256, 384, 512, 768, 1024, 1536, 2048, 3072, 4096, 6144, 8192,
+};
+
+struct Slab_Header {
+    Slab_Header* Prev; // Every mapping of the arena
+    Slab_Header* Next;
+    size_t MappedSize;
+    char* FreeSlots;   // Each free slot points at the next one
+    Slab_Header* PartialPrev; // The slabs of the class that have free slots
+    Slab_Header* PartialNext;
+    u32 Class;         // SLAB_LARGE_CLASS for a single big allocation
+    u32 LiveSlots;     // Handed out and not freed
+};
+
+struct Line_Arena {
+    Slab_Header* Mappings;
+    Slab_Header* Partial[SLAB_CLASS_COUNT]; // Slabs with free slots, per class
+
+    // The slab of each class that slots are still being cut from
+    char* Carve[SLAB_CLASS_COUNT];
+    char* CarveEnd[SLAB_CLASS_COUNT];
+
+    // Stats
+    size_t BytesMapped;
+    size_t Allocations; // Every allocation the arena served
+    size_t SlabCount;
+    size_t LargeCount;
+};
+
+inline Slab_Header*
+SlabOf(char* data) {
+    return (Slab_Header*)((uintptr_t)data & ~(uintptr_t)(SLAB_SIZE - 1));
+}
+
+static u32
+SlabClassFor(size_t size) {
+    u32 low = 0;
+    u32 high = SLAB_CLASS_COUNT;
+    while(low < high) {
+        u32 middle = (low + high) / 2;
+        if(SlabClassSizes[middle] < size) low = middle + 1;
+        else high = middle;
+    }
+    return low; // SLAB_CLASS_COUNT when it's too big for a slab
+}
+
+// Maps `size` bytes aligned to SLAB_SIZE and links them into the arena
+static Slab_Header*
+MapSlab(Line_Arena* arena, size_t size, u32 slabClass) {
+    // Map more than needed and trim both ends to get the alignment
+    size_t mappedSize = size + SLAB_SIZE;
+    char* mapping = (char*)mmap(0, mappedSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    Assert(mapping != MAP_FAILED);
+
+    char* aligned = (char*)(((uintptr_t)mapping + SLAB_SIZE - 1) & ~(uintptr_t)(SLAB_SIZE - 1));
+    if(aligned > mapping) munmap(mapping, aligned - mapping);
+    size_t tail = (mapping + mappedSize) - (aligned + size);
+    if(tail) munmap(aligned + size, tail);
+
+    Slab_Header* slab = (Slab_Header*)aligned;
+    slab->Prev = 0;
+    slab->Next = arena->Mappings;
+    if(arena->Mappings) arena->Mappings->Prev = slab;
+    arena->Mappings = slab;
+    slab->MappedSize = size;
+    slab->FreeSlots = 0;
+    slab->PartialPrev = slab->PartialNext = 0;
+    slab->Class = slabClass;
+    slab->LiveSlots = 0;
+    arena->BytesMapped += size;
+    return slab;
+}
+
+static void
+UnmapSlab(Line_Arena* arena, Slab_Header* slab) {
+    if(slab->Prev) slab->Prev->Next = slab->Next;
+    else arena->Mappings = slab->Next;
+    if(slab->Next) slab->Next->Prev = slab->Prev;
+    arena->BytesMapped -= slab->MappedSize;
+    munmap(slab, slab->MappedSize);
+}
+
+inline void
+UnlinkPartial(Line_Arena* arena, Slab_Header* slab) {
+    if(slab->PartialPrev) slab->PartialPrev->PartialNext = slab->PartialNext;
+    else arena->Partial[slab->Class] = slab->PartialNext;
+    if(slab->PartialNext) slab->PartialNext->PartialPrev = slab->PartialPrev;
+    slab->PartialPrev = slab->PartialNext = 0;
+}
+
+// Bytes that fit in the allocation
+inline size_t
+ArenaCapacity(char* data) {
+    Slab_Header* slab = SlabOf(data);
+    if(slab->Class == SLAB_LARGE_CLASS) return slab->MappedSize - SLAB_HEADER_SIZE;
+    return SlabClassSizes[slab->Class];
+}
+
+// Room for at least `size` bytes
+static char*
+ArenaAlloc(Line_Arena* arena, size_t size) {
+    arena->Allocations++;
+    u32 slabClass = SlabClassFor(size ? size : 1);
+
+    if(slabClass == SLAB_CLASS_COUNT) {
+        size_t pageSize = 4096;
+        size_t mappedSize = (SLAB_HEADER_SIZE + size + pageSize - 1) & ~(pageSize - 1);
+        Slab_Header* slab = MapSlab(arena, mappedSize, SLAB_LARGE_CLASS);
+        arena->LargeCount++;
+        return (char*)slab + SLAB_HEADER_SIZE;
+    }
+
+    Slab_Header* partial = arena->Partial[slabClass];
+    if(partial) {
+        char* slot = partial->FreeSlots;
+        partial->FreeSlots = *(char**)slot;
+        if(!partial->FreeSlots) UnlinkPartial(arena, partial);
+        partial->LiveSlots++;
+        return slot;
+    }
+
+    size_t slotSize = SlabClassSizes[slabClass];
+    if(!arena->Carve[slabClass] || arena->Carve[slabClass] + slotSize > arena->CarveEnd[slabClass]) {
+        Slab_Header* slab = MapSlab(arena, SLAB_SIZE, slabClass);
+        arena->Carve[slabClass] = (char*)slab + SLAB_HEADER_SIZE;
+        arena->CarveEnd[slabClass] = (char*)slab + SLAB_SIZE;
+        arena->SlabCount++;
+    }
+    char* slot = arena->Carve[slabClass];
+    arena->Carve[slabClass] += slotSize;
+    SlabOf(slot)->LiveSlots++;
+    return slot;
+}
+
+static void
+ArenaFree(Line_Arena* arena, char* data) {
+    if(!data) return;
+
+    Slab_Header* slab = SlabOf(data);
+    if(slab->Class == SLAB_LARGE_CLASS) {
+        UnmapSlab(arena, slab);
+        arena->LargeCount--;
+        return;
+    }
+
+    // An empty slab goes back, unless slots are still being cut from it
+    char* carve = arena->Carve[slab->Class];
+    if(--slab->LiveSlots == 0 && SlabOf(carve - 1) != slab) {
+        if(slab->FreeSlots) UnlinkPartial(arena, slab);
+        UnmapSlab(arena, slab);
+        arena->SlabCount--;
+        return;
+    }
+
+    if(!slab->FreeSlots) {
+        slab->PartialNext = arena->Partial[slab->Class];
+        if(slab->PartialNext) slab->PartialNext->PartialPrev = slab;
+        arena->Partial[slab->Class] = slab;
+    }
+    *(char**)data = slab->FreeSlots;
+    slab->FreeSlots = data;
+}
+
+// Gives back every mapping at once
+static void
+ReleaseArena(Line_Arena* arena) {
+    Slab_Header* slab = arena->Mappings;
+    while(slab) {
+        Slab_Header* next = slab->Next;
+        munmap(slab, slab->MappedSize);
+        slab = next;
+    }
+    *arena = {};
+}
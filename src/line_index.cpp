@@ -0,0 +1,278 @@
+// Column index for long lines.
+//
+// Finding the screen column of a byte means walking the line from its start,
+// which is fine for code and hopeless for a line of megabytes (minified JSON,
+// a dumped blob) when the cursor is at its far end. Lines of LONG_LINE_BYTES
+// or more get an index instead: the line is cut into chunks of about
+// LINE_CHUNK_BYTES on character boundaries, and a segment tree over the chunks
+// sums their bytes and what they do to the screen column. A TAB makes the
+// width of a chunk depend on the column it starts on, so a chunk is kept as a
+// Column_Run, which still joins with the next one in O(1). Going from a byte
+// to its column, or back, is a walk down the tree and a scan of one chunk.
+//
+// The indexes are kept in a small cache by line id and generation, like the
+// rendered lines. Typing in a long line measures the one chunk that changed
+// and its path up the tree, instead of indexing the line again, and the width
+// of the line comes with it.
+
+#define LONG_LINE_BYTES (64*1024)
+#define LINE_CHUNK_BYTES 4096
+#define LINE_INDEX_CACHE_SIZE 4
+
+// What a run of text does to the screen column. Without a TAB it moves it
+// Columns to the right. With one it moves Lead columns, to the next tab stop,
+// then Columns more from there.
+struct Column_Run {
+    b32 Tab;
+    size_t Lead;
+    size_t Columns;
+};
+
+struct Chunk_Node {
+    size_t Bytes;
+    Column_Run Run;
+    b32 Ascii;
+};
+
+struct Line_Index {
+    u32 LineId; // 0 when the entry is free
+    u32 Generation;
+    u64 LastUsed;
+
+    // Nodes[1] is the root and the children of node n are 2n and 2n+1. The
+    // chunks are the first leaves, from Nodes[Leaves] on, the rest are empty.
+    size_t Leaves; // Power of 2
+    size_t Capacity;
+    Chunk_Node* Nodes;
+};
+
+struct Line_Index_Cache {
+    Line_Index Indexes[LINE_INDEX_CACHE_SIZE];
+    u64 Clock;
+};
+
+// The column after the run, when it starts on `column`
+inline size_t
+RunEnd(Column_Run run, size_t column) {
+    if(!run.Tab) return column + run.Columns;
+    column += run.Lead;
+    return column + TAB_WIDTH - (column % TAB_WIDTH) + run.Columns;
+}
+
+// The run of `first` followed by `second`. Past its first TAB a run is lined
+// up on a tab stop, so what comes after it is counted from there.
+inline Column_Run
+JoinRuns(Column_Run first, Column_Run second) {
+    if(!second.Tab) {
+        first.Columns += second.Columns;
+        return first;
+    }
+    if(!first.Tab) {
+        second.Lead += first.Columns;
+        return second;
+    }
+    first.Columns = RunEnd(second, first.Columns);
+    return first;
+}
+
+static Column_Run
+MeasureRun(char* data, size_t size, b32 ascii) {
+    Column_Run run = {};
+    size_t tab = FindByte(data, size, '\t');
+    if(tab == size) {
+        run.Columns = CountColumns(data, size, ascii);
+    } else {
+        run.Tab = true;
+        run.Lead = CountColumns(data, tab, ascii);
+        run.Columns = CountColumns(data + tab + 1, size - tab - 1, ascii);
+    }
+    return run;
+}
+
+inline void
+MeasureChunk(Chunk_Node* node, char* data, size_t size) {
+    node->Bytes = size;
+    node->Ascii = (FindNonAscii(data, size) == size);
+    node->Run = MeasureRun(data, size, node->Ascii);
+}
+
+inline void
+JoinChunks(Line_Index* index, size_t node) {
+    Chunk_Node* left = index->Nodes + 2*node;
+    Chunk_Node* right = left + 1;
+    index->Nodes[node].Bytes = left->Bytes + right->Bytes;
+    index->Nodes[node].Run = JoinRuns(left->Run, right->Run);
+    index->Nodes[node].Ascii = left->Ascii && right->Ascii;
+}
+
+// A chunk can end at `at` when no UTF-8 sequence runs across it, so both
+// sides decode the same as the whole line
+static b32
+IsChunkBoundary(Line_Data* line, size_t at) {
+    if(at == 0 || at >= line->Size) return true;
+    if(!IsContinuationByte(line->Data[at])) return true;
+
+    size_t start = at;
+    while(start > 0 && at - start < 4 && IsContinuationByte(line->Data[start])) start--;
+    u32 codepoint;
+    return start + DecodeUtf8(line->Data + start, line->Size - start, &codepoint) <= at;
+}
+
+static void
+BuildLineIndex(Line_Index* index, Line_Data* line) {
+    TRACE_SCOPE("index line");
+    size_t chunkCount = line->Size / LINE_CHUNK_BYTES + 1;
+    index->Leaves = 1;
+    while(index->Leaves < chunkCount) index->Leaves *= 2;
+    if(2*index->Leaves > index->Capacity) {
+        free(index->Nodes);
+        index->Capacity = 2*index->Leaves;
+        index->Nodes = (Chunk_Node*)malloc(index->Capacity * sizeof(Chunk_Node));
+        Assert(index->Nodes);
+    }
+
+    Chunk_Node* leaf = index->Nodes + index->Leaves;
+    size_t at = 0;
+    while(at < line->Size) {
+        size_t end = line->Size - at > LINE_CHUNK_BYTES ? at + LINE_CHUNK_BYTES : line->Size;
+        while(!IsChunkBoundary(line, end)) end++;
+        MeasureChunk(leaf++, line->Data + at, end - at);
+        at = end;
+    }
+    for(; leaf < index->Nodes + 2*index->Leaves; leaf++) {
+        *leaf = {};
+        leaf->Ascii = true;
+    }
+    for(size_t node = index->Leaves - 1; node > 0; node--) JoinChunks(index, node);
+
+    index->LineId = line->Id;
+    index->Generation = line->Generation;
+}
+
+// The index of the line, up to date, or 0 when the line is too short to need one
+static Line_Index*
+GetLineIndex(Line_Index_Cache* cache, Line_Data* line) {
+    if(line->Size < LONG_LINE_BYTES) return 0;
+
+    Line_Index* oldest = cache->Indexes;
+    for(u32 entry = 0; entry < LINE_INDEX_CACHE_SIZE; entry++) {
+        Line_Index* index = cache->Indexes + entry;
+        if(index->LineId == line->Id && index->Generation == line->Generation) {
+            index->LastUsed = ++cache->Clock;
+            return index;
+        }
+        if(index->LastUsed < oldest->LastUsed) oldest = index;
+    }
+
+    BuildLineIndex(oldest, line);
+    oldest->LastUsed = ++cache->Clock;
+    return oldest;
+}
+
+// The leaf holding byte `at`, where it starts and the column it starts on. The
+// end of the line is in the last chunk.
+static size_t
+ChunkAtByte(Line_Index* index, size_t at, size_t* start, size_t* column) {
+    Column_Run before = {};
+    *start = 0;
+    size_t node = 1;
+    while(node < index->Leaves) {
+        Chunk_Node* left = index->Nodes + 2*node;
+        if(at < left->Bytes || !left[1].Bytes) {
+            node = 2*node;
+        } else {
+            at -= left->Bytes;
+            *start += left->Bytes;
+            before = JoinRuns(before, left->Run);
+            node = 2*node + 1;
+        }
+    }
+    *column = RunEnd(before, 0);
+    return node;
+}
+
+// The leaf covering screen column `rx`, where it starts and the column it
+// starts on. Past the end of the line it's the last chunk.
+static size_t
+ChunkAtColumn(Line_Index* index, size_t rx, size_t* start, size_t* column) {
+    *start = 0;
+    *column = 0;
+    size_t node = 1;
+    while(node < index->Leaves) {
+        Chunk_Node* left = index->Nodes + 2*node;
+        size_t leftEnd = RunEnd(left->Run, *column);
+        if(rx < leftEnd || !left[1].Bytes) {
+            node = 2*node;
+        } else {
+            *start += left->Bytes;
+            *column = leftEnd;
+            node = 2*node + 1;
+        }
+    }
+    return node;
+}
+
+// Screen column of the byte `cx` of the line, like LineCxToRx
+static size_t
+IndexedCxToRx(Line_Index_Cache* cache, Line_Data* line, size_t cx) {
+    Line_Index* index = GetLineIndex(cache, line);
+    if(!index) return LineCxToRx(line, cx);
+    if(cx > line->Size) cx = line->Size;
+
+    size_t start, column;
+    size_t leaf = ChunkAtByte(index, cx, &start, &column);
+    return RunEnd(MeasureRun(line->Data + start, cx - start, index->Nodes[leaf].Ascii), column);
+}
+
+// Byte of the line on screen column `rx`, like LineRxToCx
+static size_t
+IndexedRxToCx(Line_Index_Cache* cache, Line_Data* line, size_t rx) {
+    Line_Index* index = GetLineIndex(cache, line);
+    if(!index) return LineRxToCx(line, rx);
+
+    size_t start, column;
+    size_t leaf = ChunkAtColumn(index, rx, &start, &column);
+    Chunk_Node* chunk = index->Nodes + leaf;
+    return start + ColumnToByte(line->Data + start, chunk->Bytes, chunk->Ascii, column, rx);
+}
+
+// The line was just changed at `at`: `removed` bytes made way for `inserted`
+// new ones, after one EditLine. Brings its index along when the change stays
+// inside one chunk, and measures the line from it. Otherwise the index is
+// dropped and built again when it's next needed.
+static void
+NoteLineEdit(Line_Index_Cache* cache, Line_Data* line, size_t at, size_t removed, size_t inserted) {
+    for(u32 entry = 0; entry < LINE_INDEX_CACHE_SIZE; entry++) {
+        Line_Index* index = cache->Indexes + entry;
+        if(index->LineId != line->Id) continue;
+        if(index->Generation + 1 != line->Generation) {
+            index->LineId = 0;
+            return;
+        }
+
+        size_t start, column;
+        size_t leaf = ChunkAtByte(index, at, &start, &column);
+        Chunk_Node* chunk = index->Nodes + leaf;
+        if(at + removed > start + chunk->Bytes) {
+            index->LineId = 0;
+            return;
+        }
+        size_t bytes = chunk->Bytes - removed + inserted;
+        if(!bytes || bytes > 2*LINE_CHUNK_BYTES ||
+           !IsChunkBoundary(line, start) || !IsChunkBoundary(line, start + bytes)) {
+            index->LineId = 0;
+            return;
+        }
+
+        MeasureChunk(chunk, line->Data + start, bytes);
+        for(size_t node = leaf / 2; node > 0; node /= 2) JoinChunks(index, node);
+        index->Generation = line->Generation;
+
+        size_t width = RunEnd(index->Nodes[1].Run, 0);
+        line->Width = width < 0xFFFFFFFF ? (u32)width : 0xFFFFFFFF;
+        line->Flags |= LineFlag_Measured;
+        if(index->Nodes[1].Ascii) line->Flags |= LineFlag_Ascii;
+        else line->Flags &= ~LineFlag_Ascii;
+        return;
+    }
+}
@@ -0,0 +1,1317 @@
+// Line storage for the editor.
+//
+// Lines live in fixed capacity blocks, and the blocks are the nodes of an
+// implicit treap ordered by position (a rope of line chunks). Every node keeps
+// the totals of its subtree, so finding a line, inserting or deleting a line
+// and splitting/joining blocks are all O(log n) instead of touching the whole
+// document.
+//
+// Blocks are reference counted so a snapshot of the whole store (for saving
+// in the background) is just a list of block pointers. A block that is shared
+// with a snapshot is copied before it changes, and the line data it points at
+// is copied before it is edited, so the snapshot never sees a change.
+//
+// A large file isn't split into lines up front. Its index is a run of spans,
+// blocks that only hold the byte range and line count of SPAN_LINES lines of
+// the mapped file (a sparse checkpoint index). A span is unpacked into
+// ordinary blocks of borrowed lines the first time a line in it is looked up,
+// and PackSpans turns untouched blocks back into spans to keep the store
+// within a memory budget. The edited lines stay as they are, an overlay over
+// the file.
+//
+// Blocks that can't go back to the file (edited lines, or lines read from a
+// followed file) are compressed instead when the budget runs out: a run of
+// them becomes a span that holds its text itself, packed by lz_codec.cpp.
+// It's unpacked like any other span the next time one of its lines is looked
+// up, and read in place by search and save.
+//
+// Every node also sums up the bytes of its subtree, a newline counted after
+// each line, so a line and its byte offset in the document are found from
+// each other in O(log n) (for paging by percentage and the status bar). Edits
+// change line sizes after EditLine returns, so the totals above the edited
+// block are fixed up lazily, before the next walk down the tree.
+//
+// With soft wrap the nodes count the screen rows of their lines too (a
+// cumulative visual-row index), so the line at any wrapped row is found the
+// same way. Every line caches its own row count for the width it was wrapped
+// at, the totals are counted again when the width changes.
+//
+// Line data the store owns comes from its arena (line_arena.cpp) and always
+// has room for the zero after the last byte. Edits grow it through
+// ReserveLine, which leaves slack so typing doesn't reallocate every key.
+
+#define LINE_BLOCK_CAPACITY 64
+#define STORE_MAX_DEPTH 128
+#define SPAN_LINES 4096
+#define PACK_RUN_BYTES (1024*1024) // Text of a compressed span, about
+
+enum Line_Flags {
+    LineFlag_Borrowed = 0x1, // Data points into memory the line doesn't own (a mapped file)
+    LineFlag_Shared = 0x2,   // Data may still be read by a snapshot, don't change or free it in place
+    LineFlag_Lexed = 0x4,    // LexStart/LexEnd belong to the current data
+    LineFlag_Measured = 0x8, // Width and LineFlag_Ascii belong to the current data
+    LineFlag_Ascii = 0x10,   // No byte is 0x80 or above
+    LineFlag_Wrapped = 0x20, // WrapRows belongs to the current data
+};
+
+// Caches that are worked out when needed are cleared by every edit
+#define LINE_DERIVED_FLAGS (LineFlag_Lexed | LineFlag_Measured | LineFlag_Ascii | LineFlag_Wrapped)
+
+struct Line_Data {
+    size_t Size;
+    char* Data;
+    u16 Flags;
+
+    // Syntax highlighter state the line starts and ends in
+    u8 LexStart;
+    u8 LexEnd;
+
+    // Identify the contents of the line, for caches
+    u32 Id;         // Unique for the lifetime of the store
+    u32 Generation; // Bumped on every edit
+
+    u32 Width; // Display columns, TABs expanded
+
+    // Screen rows the line takes wrapped at WrapWidth columns
+    u32 WrapRows;
+    u32 WrapWidth;
+};
+
+// In utf8.cpp, which needs Line_Data
+static size_t CountWrapRows(char* data, size_t size, size_t width);
+static size_t LineWrapRows(Line_Data* line, size_t width);
+
+struct Line_Block {
+    u32 Refs; // The store plus the snapshots holding the block
+    u32 Count;
+
+    // A span has no Lines (Count is 0), it stands for SpanLines lines of a
+    // mapped file. SpanSize includes the newlines, SpanBytes counts the lines
+    // as they are when unpacked (CRs dropped, one newline each). A compressed
+    // span has no SpanData, its SpanSize bytes are in Packed.
+    u32 SpanLines;
+    char* SpanData;
+    size_t SpanSize;
+    char* Packed;
+    size_t PackedSize;
+    size_t SpanBytes;
+    size_t SpanRows;       // Wrapped at SpanWrapWidth columns
+    size_t SpanWrapWidth;
+
+    Line_Data Lines[LINE_BLOCK_CAPACITY];
+};
+
+#define SPAN_BLOCK_SIZE offsetof(Line_Block, Lines) // Spans are allocated without Lines
+
+struct Line_Node {
+    Line_Node* Left;
+    Line_Node* Right;
+    u32 Priority;
+
+    // Subtree totals
+    size_t LineCount;
+    size_t NodeCount;
+    size_t ByteCount;
+    size_t RowCount;
+
+    Line_Block* Block;
+    size_t BlockBytes; // The lines of Block, as counted by CountBlockBytes
+    size_t BlockRows;  // And by CountBlockRows
+};
+
+struct Line_Store {
+    Line_Node* Root;
+    size_t LineCount;
+    u32 Seed;
+    u32 LastLineId;
+    size_t ChangedFrom; // Lowest line changed since the highlighter last looked
+    Line_Arena Arena;
+    size_t SpanCount;
+    size_t WrapWidth; // Columns the rows are counted at, 0 when lines aren't wrapped
+
+    // The compressed spans: what they take, and the text they stand for
+    size_t PackedBytes;
+    size_t PackedTextBytes;
+
+    // A line that may have changed since the byte and row totals were updated
+    b32 TotalsStale;
+    size_t StaleLine;
+
+    // Line data replaced while snapshots were alive, freed with the last one
+    u32 SnapshotCount;
+    char** Retired;
+    size_t RetiredCount;
+    size_t RetiredCapacity;
+};
+
+// The blocks of the store at one point in time, in document order. They stay
+// unchanged until the snapshot is released, other threads can read them.
+struct Store_Snapshot {
+    Line_Block** Blocks;
+    size_t BlockCount;
+    size_t LineCount;
+};
+
+// The path from the root to a block, used to fix the subtree totals after the
+// block changed.
+struct Store_Path {
+    Line_Node* Nodes[STORE_MAX_DEPTH];
+    u32 Depth;
+    size_t FirstLine; // Index of the first line of the block
+    size_t Rank;      // Index of the block
+};
+
+inline size_t
+NodeLineCount(Line_Node* node) {
+    return node ? node->LineCount : 0;
+}
+
+inline size_t
+NodeCount(Line_Node* node) {
+    return node ? node->NodeCount : 0;
+}
+
+inline b32
+IsSpan(Line_Block* block) {
+    return block->SpanLines != 0;
+}
+
+inline size_t
+BlockLineCount(Line_Block* block) {
+    return block->Count + block->SpanLines;
+}
+
+inline size_t
+NodeByteCount(Line_Node* node) {
+    return node ? node->ByteCount : 0;
+}
+
+// Bytes of the lines of a block, each one with its newline
+static size_t
+CountBlockBytes(Line_Block* block) {
+    if(IsSpan(block)) return block->SpanBytes;
+    size_t bytes = block->Count;
+    for(u32 index = 0; index < block->Count; index++) {
+        bytes += block->Lines[index].Size;
+    }
+    return bytes;
+}
+
+inline size_t
+NodeRowCount(Line_Node* node) {
+    return node ? node->RowCount : 0;
+}
+
+inline void
+UpdateNode(Line_Node* node) {
+    node->LineCount = BlockLineCount(node->Block) + NodeLineCount(node->Left) + NodeLineCount(node->Right);
+    node->NodeCount = 1 + NodeCount(node->Left) + NodeCount(node->Right);
+    node->ByteCount = node->BlockBytes + NodeByteCount(node->Left) + NodeByteCount(node->Right);
+    node->RowCount = node->BlockRows + NodeRowCount(node->Left) + NodeRowCount(node->Right);
+}
+
+static u32
+NextPriority(Line_Store* store) {
+    // xorshift32
+    u32 x = store->Seed ? store->Seed : 0x9E3779B9;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    store->Seed = x;
+    return x;
+}
+
+static Line_Node*
+CreateNode(Line_Store* store) {
+    Line_Node* node = (Line_Node*)calloc(1, sizeof(Line_Node));
+    node->Block = (Line_Block*)calloc(1, sizeof(Line_Block));
+    Assert(node && node->Block);
+    node->Block->Refs = 1;
+    node->Priority = NextPriority(store);
+    UpdateNode(node);
+    return node;
+}
+
+static Line_Node*
+MergeNodes(Line_Node* left, Line_Node* right) {
+    if(!left) return right;
+    if(!right) return left;
+
+    if(left->Priority > right->Priority) {
+        left->Right = MergeNodes(left->Right, right);
+        UpdateNode(left);
+        return left;
+    } else {
+        right->Left = MergeNodes(left, right->Left);
+        UpdateNode(right);
+        return right;
+    }
+}
+
+// Splits the first `count` blocks into `left` and the rest into `right`
+static void
+SplitNodes(Line_Node* node, size_t count, Line_Node** left, Line_Node** right) {
+    if(!node) {
+        *left = *right = 0;
+        return;
+    }
+
+    size_t leftCount = NodeCount(node->Left);
+    if(count <= leftCount) {
+        SplitNodes(node->Left, count, left, &node->Left);
+        *right = node;
+    } else {
+        SplitNodes(node->Right, count - leftCount - 1, &node->Right, right);
+        *left = node;
+    }
+    UpdateNode(node);
+}
+
+// Find the node that holds `lineIndex`, which may be a span. An index equal
+// to the line count resolves to the last node so lines can be appended.
+static Line_Node*
+FindNode(Line_Store* store, size_t lineIndex, Store_Path* path) {
+    path->Depth = 0;
+    path->FirstLine = 0;
+    path->Rank = 0;
+
+    Line_Node* node = store->Root;
+    if(!node) return 0;
+    if(lineIndex >= store->LineCount) lineIndex = store->LineCount ? store->LineCount - 1 : 0;
+
+    for(;;) {
+        Assert(path->Depth < STORE_MAX_DEPTH);
+        path->Nodes[path->Depth++] = node;
+
+        size_t leftLines = NodeLineCount(node->Left);
+        if(node->Left && lineIndex < leftLines) {
+            node = node->Left;
+        } else if(lineIndex < leftLines + BlockLineCount(node->Block) || !node->Right) {
+            path->FirstLine += leftLines;
+            path->Rank += NodeCount(node->Left);
+            return node;
+        } else {
+            path->FirstLine += leftLines + BlockLineCount(node->Block);
+            path->Rank += NodeCount(node->Left) + 1;
+            lineIndex -= leftLines + BlockLineCount(node->Block);
+            node = node->Right;
+        }
+    }
+}
+
+static Line_Node*
+FindBlockByRank(Line_Store* store, size_t rank, Store_Path* path) {
+    path->Depth = 0;
+    path->FirstLine = 0;
+    path->Rank = rank;
+
+    Line_Node* node = store->Root;
+    while(node) {
+        Assert(path->Depth < STORE_MAX_DEPTH);
+        path->Nodes[path->Depth++] = node;
+
+        size_t leftCount = NodeCount(node->Left);
+        if(rank < leftCount) {
+            node = node->Left;
+        } else {
+            path->FirstLine += NodeLineCount(node->Left);
+            if(rank == leftCount) break;
+            path->FirstLine += BlockLineCount(node->Block);
+            rank -= leftCount + 1;
+            node = node->Right;
+        }
+    }
+    return node;
+}
+
+inline void
+ReleaseBlock(Line_Block* block) {
+    if(--block->Refs == 0) {
+        free(block->Packed);
+        free(block);
+    }
+}
+
+// The next line of a span, as IndexFile splits them: up to the newline, CRs
+// before it dropped. Moves `at` past the newline.
+inline size_t
+NextSpanLine(char** at, char* end, char** line) {
+    *line = *at;
+    size_t remaining = end - *at;
+    size_t length = FindByte(*at, remaining, '\n');
+    *at += (length < remaining) ? length + 1 : length;
+    while(length > 0 && (*line)[length - 1] == '\r') length--;
+    return length;
+}
+
+// Lets the kernel drop the pages of a span that was read, they come back from
+// the file when they are needed again
+inline void
+DropSpanPages(Line_Block* span) {
+    uintptr_t pageSize = 4096;
+    uintptr_t start = (uintptr_t)span->SpanData & ~(pageSize - 1);
+    uintptr_t end = ((uintptr_t)span->SpanData + span->SpanSize + pageSize - 1) & ~(pageSize - 1);
+    madvise((void*)start, end - start, MADV_DONTNEED);
+}
+
+// The SpanSize bytes a span stands for: the mapped file, or a compressed
+// span unpacked into a new buffer. Give it back to CloseSpan.
+static char*
+OpenSpan(Line_Block* span) {
+    if(!span->Packed) return span->SpanData;
+
+    // No trace scope, the save and search threads read spans too
+    char* text = (char*)malloc(span->SpanSize);
+    Assert(text);
+    b32 unpacked = LzDecompress(span->Packed, span->PackedSize, text, span->SpanSize);
+    Assert(unpacked);
+    return text;
+}
+
+// Done reading the span for now
+inline void
+CloseSpan(Line_Block* span, char* text) {
+    if(span->Packed) free(text);
+    else DropSpanPages(span);
+}
+
+// Screen rows of the lines of a block at the store's wrap width, one per line
+// without wrapping. A span is split into lines the way UnpackSpan would, once
+// per width.
+static size_t
+CountBlockRows(Line_Store* store, Line_Block* block) {
+    size_t width = store->WrapWidth;
+    if(!width) return BlockLineCount(block);
+
+    if(IsSpan(block)) {
+        if(block->SpanWrapWidth != width) {
+            size_t rows = 0;
+            char* text = OpenSpan(block);
+            char* at = text;
+            char* end = text + block->SpanSize;
+            while(at < end) {
+                char* line;
+                size_t size = NextSpanLine(&at, end, &line);
+                rows += CountWrapRows(line, size, width);
+            }
+            block->SpanRows = rows;
+            block->SpanWrapWidth = width;
+            CloseSpan(block, text);
+        }
+        return block->SpanRows;
+    }
+
+    size_t rows = 0;
+    for(u32 index = 0; index < block->Count; index++) {
+        rows += LineWrapRows(block->Lines + index, width);
+    }
+    return rows;
+}
+
+// After the lines of the node's block changed
+inline void
+UpdateBlockNode(Line_Store* store, Line_Node* node) {
+    node->BlockBytes = CountBlockBytes(node->Block);
+    node->BlockRows = CountBlockRows(store, node->Block);
+    UpdateNode(node);
+}
+
+// Room for a line of `size` bytes plus its zero
+inline char*
+AllocLineData(Line_Store* store, size_t size) {
+    return ArenaAlloc(&store->Arena, size + 1);
+}
+
+inline void
+FreeLineData(Line_Store* store, char* data) {
+    ArenaFree(&store->Arena, data);
+}
+
+// `rows` are the rows of the lines at the store's wrap width, 0 when they
+// still have to be counted
+static Line_Node*
+CreateSpanNode(Line_Store* store, char* data, size_t size, size_t lineCount, size_t bytes, size_t rows) {
+    Line_Node* node = (Line_Node*)calloc(1, sizeof(Line_Node));
+    node->Block = (Line_Block*)calloc(1, SPAN_BLOCK_SIZE);
+    Assert(node && node->Block);
+    node->Block->Refs = 1;
+    node->Block->SpanLines = lineCount;
+    node->Block->SpanData = data;
+    node->Block->SpanSize = size;
+    node->Block->SpanBytes = bytes;
+    if(rows) {
+        node->Block->SpanRows = rows;
+        node->Block->SpanWrapWidth = store->WrapWidth;
+    }
+    node->Priority = NextPriority(store);
+    UpdateBlockNode(store, node);
+    store->SpanCount++;
+    return node;
+}
+
+// Splits the span at `path` into blocks of borrowed lines, or of lines of
+// their own for a compressed span
+static void
+UnpackSpan(Line_Store* store, Store_Path* path) {
+    TRACE_SCOPE("unpack span");
+    Line_Node* spanNode = path->Nodes[path->Depth - 1];
+    Line_Block* span = spanNode->Block;
+
+    Line_Node* middle = 0;
+    Line_Node* node = 0;
+    char* text = OpenSpan(span);
+    char* at = text;
+    char* end = text + span->SpanSize;
+    size_t lineCount = 0;
+    while(at < end) {
+        if(!node || node->Block->Count == LINE_BLOCK_CAPACITY) {
+            if(node) {
+                UpdateBlockNode(store, node);
+                middle = MergeNodes(middle, node);
+            }
+            node = CreateNode(store);
+        }
+        Line_Data* line = node->Block->Lines + node->Block->Count++;
+        line->Size = NextSpanLine(&at, end, &line->Data);
+        line->Flags = LineFlag_Borrowed;
+        if(span->Packed) {
+            char* data = AllocLineData(store, line->Size);
+            memcpy(data, line->Data, line->Size);
+            data[line->Size] = 0;
+            line->Data = data;
+            line->Flags = 0;
+        }
+        line->Id = ++store->LastLineId;
+        lineCount++;
+    }
+    Assert(node && lineCount == span->SpanLines);
+    if(span->Packed) {
+        free(text);
+        store->PackedBytes -= span->PackedSize;
+        store->PackedTextBytes -= span->SpanSize;
+    }
+    UpdateBlockNode(store, node);
+    middle = MergeNodes(middle, node);
+
+    Line_Node *left, *right;
+    SplitNodes(store->Root, path->Rank, &left, &right);
+    SplitNodes(right, 1, &spanNode, &right);
+    store->Root = MergeNodes(MergeNodes(left, middle), right);
+    ReleaseBlock(spanNode->Block);
+    free(spanNode);
+    store->SpanCount--;
+}
+
+// Like FindNode, but always gives a block with lines: a span is unpacked first
+static Line_Node*
+FindBlock(Line_Store* store, size_t lineIndex, Store_Path* path) {
+    for(;;) {
+        Line_Node* node = FindNode(store, lineIndex, path);
+        if(!node || !IsSpan(node->Block)) return node;
+        UnpackSpan(store, path);
+    }
+}
+
+inline void
+NoteChange(Line_Store* store, size_t lineIndex) {
+    if(lineIndex < store->ChangedFrom) store->ChangedFrom = lineIndex;
+}
+
+// After the block at the end of the path changed
+inline void
+RefreshPath(Line_Store* store, Store_Path* path) {
+    for(u32 depth = path->Depth; depth > 0; depth--) {
+        if(depth == path->Depth) UpdateBlockNode(store, path->Nodes[depth - 1]);
+        else UpdateNode(path->Nodes[depth - 1]);
+    }
+    store->LineCount = NodeLineCount(store->Root);
+}
+
+// Brings the byte and row totals up to date with the line marked by
+// MarkStale. Every change that moves lines around or edits another line calls
+// it first, plain lookups don't, the caller may still be changing the line.
+static void
+SettleTotals(Line_Store* store) {
+    if(!store->TotalsStale) return;
+    store->TotalsStale = false;
+    Store_Path path;
+    Line_Node* node = FindNode(store, store->StaleLine, &path);
+    if(!node) return;
+    RefreshPath(store, &path);
+}
+
+// The size of the line is about to change, behind the store's back. Only
+// one line at a time, the last one EditLine returned.
+inline void
+MarkStale(Line_Store* store, size_t lineIndex) {
+    Assert(!store->TotalsStale);
+    store->TotalsStale = true;
+    store->StaleLine = lineIndex;
+}
+
+static void
+InsertNodeAt(Line_Store* store, size_t rank, Line_Node* node) {
+    Line_Node *left, *right;
+    SplitNodes(store->Root, rank, &left, &right);
+    store->Root = MergeNodes(MergeNodes(left, node), right);
+    store->LineCount = NodeLineCount(store->Root);
+}
+
+// Gives the node a block of its own before it is changed. The copy points at
+// the same line data, which now has to be copied before it is edited.
+static Line_Block*
+UnshareBlock(Line_Node* node) {
+    Line_Block* block = node->Block;
+    if(block->Refs == 1) return block;
+
+    Line_Block* copy = (Line_Block*)malloc(sizeof(Line_Block));
+    Assert(copy);
+    memcpy(copy, block, sizeof(Line_Block));
+    copy->Refs = 1;
+    for(u32 index = 0; index < copy->Count; index++) {
+        if(!(copy->Lines[index].Flags & LineFlag_Borrowed)) copy->Lines[index].Flags |= LineFlag_Shared;
+    }
+
+    block->Refs--;
+    node->Block = copy;
+    return copy;
+}
+
+// Frees line data once no snapshot can be reading it
+static void
+RetireLineData(Line_Store* store, char* data) {
+    if(!store->SnapshotCount) {
+        FreeLineData(store, data);
+        return;
+    }
+
+    if(store->RetiredCount == store->RetiredCapacity) {
+        store->RetiredCapacity = store->RetiredCapacity ? store->RetiredCapacity * 2 : 64;
+        store->Retired = (char**)realloc(store->Retired, store->RetiredCapacity * sizeof(char*));
+        Assert(store->Retired);
+    }
+    store->Retired[store->RetiredCount++] = data;
+}
+
+// Frees the data of a line that is leaving the store
+inline void
+ReleaseLineData(Line_Store* store, Line_Data* line) {
+    if(line->Flags & LineFlag_Borrowed) return;
+    if(line->Flags & LineFlag_Shared) RetireLineData(store, line->Data);
+    else FreeLineData(store, line->Data);
+}
+
+static void
+RemoveNodeAt(Line_Store* store, size_t rank) {
+    Line_Node *left, *middle, *right;
+    SplitNodes(store->Root, rank, &left, &middle);
+    SplitNodes(middle, 1, &middle, &right);
+    Assert(middle && middle->Block->Count == 0);
+
+    ReleaseBlock(middle->Block);
+    free(middle);
+    store->Root = MergeNodes(left, right);
+    store->LineCount = NodeLineCount(store->Root);
+}
+
+static Line_Data*
+GetLine(Line_Store* store, size_t lineIndex) {
+    if(lineIndex >= store->LineCount) return 0;
+
+    Store_Path path;
+    Line_Node* node = FindBlock(store, lineIndex, &path);
+    return node->Block->Lines + (lineIndex - path.FirstLine);
+}
+
+// What the node totals count
+enum Store_Measure {
+    StoreMeasure_Bytes, // A newline after every line
+    StoreMeasure_Rows,  // Screen rows, one per line when they aren't wrapped
+};
+
+inline size_t
+NodeMeasure(Line_Node* node, u32 measure) {
+    return measure == StoreMeasure_Bytes ? NodeByteCount(node) : NodeRowCount(node);
+}
+
+inline size_t
+BlockMeasure(Line_Node* node, u32 measure) {
+    return measure == StoreMeasure_Bytes ? node->BlockBytes : node->BlockRows;
+}
+
+inline size_t
+LineMeasure(Line_Store* store, Line_Data* line, u32 measure) {
+    if(measure == StoreMeasure_Bytes) return line->Size + 1;
+    return store->WrapWidth ? LineWrapRows(line, store->WrapWidth) : 1;
+}
+
+// Bytes or rows before line `lineIndex`, the total for the line after the
+// last one
+static size_t
+StoreMeasureBefore(Line_Store* store, size_t lineIndex, u32 measure) {
+    SettleTotals(store);
+    if(lineIndex >= store->LineCount) return NodeMeasure(store->Root, measure);
+
+    Store_Path path;
+    Line_Node* node = FindBlock(store, lineIndex, &path);
+
+    // Everything left of the path on the way down, then the block's own lines
+    size_t total = NodeMeasure(node->Left, measure);
+    for(u32 depth = 0; depth + 1 < path.Depth; depth++) {
+        Line_Node* parent = path.Nodes[depth];
+        if(parent->Right == path.Nodes[depth + 1]) total += NodeMeasure(parent->Left, measure) + BlockMeasure(parent, measure);
+    }
+    Line_Block* block = node->Block;
+    for(size_t index = 0; index < lineIndex - path.FirstLine; index++) {
+        total += LineMeasure(store, block->Lines + index, measure);
+    }
+    return total;
+}
+
+// The line byte or row `value` is in, and in `within` how far into the line
+// it is. Past the end it's the end of the last line.
+static size_t
+StoreLineAtMeasure(Line_Store* store, size_t value, u32 measure, size_t* within) {
+    *within = 0;
+    for(;;) {
+        SettleTotals(store);
+        Line_Node* node = store->Root;
+        if(!node) return 0;
+
+        size_t firstLine = 0;
+        size_t remaining = value;
+        for(;;) {
+            size_t left = NodeMeasure(node->Left, measure);
+            if(node->Left && remaining < left) {
+                node = node->Left;
+            } else if(remaining < left + BlockMeasure(node, measure) || !node->Right) {
+                remaining -= left;
+                firstLine += NodeLineCount(node->Left);
+                break;
+            } else {
+                remaining -= left + BlockMeasure(node, measure);
+                firstLine += NodeLineCount(node->Left) + BlockLineCount(node->Block);
+                node = node->Right;
+            }
+        }
+
+        Line_Block* block = node->Block;
+        if(IsSpan(block)) {
+            // Split it into lines and walk down again
+            Store_Path path;
+            FindBlock(store, firstLine, &path);
+            continue;
+        }
+        for(u32 index = 0; index < block->Count; index++) {
+            size_t size = LineMeasure(store, block->Lines + index, measure);
+            if(remaining < size || index + 1 == block->Count) {
+                *within = remaining < size ? remaining : size - 1;
+                return firstLine + index;
+            }
+            remaining -= size;
+        }
+        return firstLine;
+    }
+}
+
+// Bytes of the whole document, a newline after every line
+inline size_t
+StoreByteCount(Line_Store* store) {
+    SettleTotals(store);
+    return NodeByteCount(store->Root);
+}
+
+// Byte offset of the start of line `lineIndex`, the byte count for the line
+// after the last one
+inline size_t
+StoreLineOffset(Line_Store* store, size_t lineIndex) {
+    return StoreMeasureBefore(store, lineIndex, StoreMeasure_Bytes);
+}
+
+// The line byte `offset` is in, the last line for an offset past the end
+inline size_t
+StoreLineAtOffset(Line_Store* store, size_t offset) {
+    size_t within;
+    return StoreLineAtMeasure(store, offset, StoreMeasure_Bytes, &within);
+}
+
+// Screen rows of the whole document at the wrap width
+inline size_t
+StoreRowCount(Line_Store* store) {
+    SettleTotals(store);
+    return NodeRowCount(store->Root);
+}
+
+// The first screen row of line `lineIndex`
+inline size_t
+StoreLineRow(Line_Store* store, size_t lineIndex) {
+    return StoreMeasureBefore(store, lineIndex, StoreMeasure_Rows);
+}
+
+// The line on screen row `row`, and which of its rows that is
+inline size_t
+StoreLineAtRow(Line_Store* store, size_t row, size_t* rowInLine) {
+    return StoreLineAtMeasure(store, row, StoreMeasure_Rows, rowInLine);
+}
+
+static void
+CountRowsAgain(Line_Store* store, Line_Node* node) {
+    if(!node) return;
+    CountRowsAgain(store, node->Left);
+    CountRowsAgain(store, node->Right);
+    UpdateBlockNode(store, node);
+}
+
+// Wraps the lines at `width` columns from now on, 0 for not at all. Every
+// block is counted again, which splits all the spans of a large file once.
+static void
+SetWrapWidth(Line_Store* store, size_t width) {
+    if(width == store->WrapWidth) return;
+    TRACE_SCOPE("wrap");
+    SettleTotals(store);
+    store->WrapWidth = width;
+    CountRowsAgain(store, store->Root);
+}
+
+// Makes room for a new line at `lineIndex` and returns it zeroed. The caller
+// fills in the line data.
+static Line_Data*
+StoreInsertLine(Line_Store* store, size_t lineIndex) {
+    if(lineIndex > store->LineCount) return 0;
+    SettleTotals(store);
+    NoteChange(store, lineIndex);
+
+    if(!store->Root) {
+        store->Root = CreateNode(store);
+    }
+
+    Store_Path path;
+    Line_Node* node = FindBlock(store, lineIndex, &path);
+    Line_Block* block = UnshareBlock(node);
+    size_t at = lineIndex - path.FirstLine;
+
+    if(block->Count == LINE_BLOCK_CAPACITY) {
+        // Split the block, the upper part goes to a new node right after it.
+        // Appending past the end of a full block just starts a fresh one.
+        u32 half = (at == LINE_BLOCK_CAPACITY) ? LINE_BLOCK_CAPACITY : LINE_BLOCK_CAPACITY / 2;
+        Line_Node* newNode = CreateNode(store);
+        newNode->Block->Count = LINE_BLOCK_CAPACITY - half;
+        memcpy(newNode->Block->Lines, block->Lines + half, newNode->Block->Count * sizeof(Line_Data));
+        UpdateBlockNode(store, newNode);
+
+        block->Count = half;
+        RefreshPath(store, &path);
+
+        size_t rank = path.Rank;
+        InsertNodeAt(store, rank + 1, newNode);
+
+        if(at > half || half == LINE_BLOCK_CAPACITY) {
+            rank++;
+            at -= half;
+        }
+        node = FindBlockByRank(store, rank, &path);
+        block = UnshareBlock(node);
+    }
+
+    memmove(block->Lines + at + 1, block->Lines + at, (block->Count - at) * sizeof(Line_Data));
+    block->Count++;
+    block->Lines[at] = {};
+    block->Lines[at].Id = ++store->LastLineId;
+    RefreshPath(store, &path);
+    // Counting the rows measured the empty line, the caller fills it in next
+    block->Lines[at].Flags &= ~LINE_DERIVED_FLAGS;
+    MarkStale(store, lineIndex);
+
+    return block->Lines + at;
+}
+
+// Removes `count` lines starting at `lineIndex` and frees their data. Works
+// a block at a time, so the cost is in the lines removed, not the store.
+static void
+StoreDeleteLines(Line_Store* store, size_t lineIndex, size_t count) {
+    if(lineIndex >= store->LineCount) return;
+    if(count > store->LineCount - lineIndex) count = store->LineCount - lineIndex;
+    SettleTotals(store);
+    NoteChange(store, lineIndex);
+
+    while(count) {
+        Store_Path path;
+        Line_Node* node = FindBlock(store, lineIndex, &path);
+        Line_Block* block = UnshareBlock(node);
+        size_t at = lineIndex - path.FirstLine;
+        size_t removed = block->Count - at < count ? block->Count - at : count;
+
+        for(size_t index = at; index < at + removed; index++) {
+            ReleaseLineData(store, block->Lines + index);
+        }
+        memmove(block->Lines + at, block->Lines + at + removed, (block->Count - at - removed) * sizeof(Line_Data));
+        block->Count -= removed;
+        RefreshPath(store, &path);
+        count -= removed;
+
+        if(block->Count == 0) {
+            RemoveNodeAt(store, path.Rank);
+        }
+    }
+}
+
+inline void
+StoreDeleteLine(Line_Store* store, size_t lineIndex) {
+    StoreDeleteLines(store, lineIndex, 1);
+}
+
+// Appends `count` lines at the end of the store, filling whole blocks at a time.
+static void
+StoreAppendLines(Line_Store* store, Line_Data* lines, size_t count) {
+    SettleTotals(store);
+    NoteChange(store, store->LineCount);
+    for(size_t index = 0; index < count; index++) {
+        lines[index].Id = ++store->LastLineId;
+    }
+
+    Store_Path path;
+    Line_Node* node = FindBlockByRank(store, NodeCount(store->Root) - 1, &path);
+
+    if(node && !IsSpan(node->Block) && node->Block->Count < LINE_BLOCK_CAPACITY) {
+        Line_Block* block = UnshareBlock(node);
+        size_t fill = LINE_BLOCK_CAPACITY - block->Count;
+        if(fill > count) fill = count;
+        memcpy(block->Lines + block->Count, lines, fill * sizeof(Line_Data));
+        block->Count += fill;
+        RefreshPath(store, &path);
+        lines += fill;
+        count -= fill;
+    }
+
+    while(count) {
+        size_t fill = count < LINE_BLOCK_CAPACITY ? count : LINE_BLOCK_CAPACITY;
+        node = CreateNode(store);
+        memcpy(node->Block->Lines, lines, fill * sizeof(Line_Data));
+        node->Block->Count = fill;
+        UpdateBlockNode(store, node);
+        store->Root = MergeNodes(store->Root, node);
+        store->LineCount = NodeLineCount(store->Root);
+        lines += fill;
+        count -= fill;
+    }
+}
+
+// Appends `lineCount` lines of a mapped file as a span, `size` bytes from
+// `data` that come to `bytes` once split into lines
+static void
+StoreAppendSpan(Line_Store* store, char* data, size_t size, size_t lineCount, size_t bytes) {
+    NoteChange(store, store->LineCount);
+    SettleTotals(store);
+    store->Root = MergeNodes(store->Root, CreateSpanNode(store, data, size, lineCount, bytes, 0));
+    store->LineCount = NodeLineCount(store->Root);
+}
+
+// Bytes the store holds for the index and the edited lines
+static size_t
+StoreMemory(Line_Store* store) {
+    size_t nodes = NodeCount(store->Root);
+    return nodes * sizeof(Line_Node) + (nodes - store->SpanCount) * sizeof(Line_Block) +
+           store->SpanCount * SPAN_BLOCK_SIZE + store->Arena.BytesMapped + store->PackedBytes;
+}
+
+static void
+CollectNodes(Line_Node* node, Line_Node** nodes, size_t* count) {
+    if(!node) return;
+    CollectNodes(node->Left, nodes, count);
+    nodes[(*count)++] = node;
+    CollectNodes(node->Right, nodes, count);
+    node->Left = node->Right = 0;
+}
+
+// Where the bytes of a borrowed line end in the file: past the CRs and the
+// newline IndexFile dropped
+inline char*
+BorrowedLineEnd(Line_Data* line, char* fileEnd) {
+    char* end = line->Data + line->Size;
+    while(end < fileEnd && *end == '\r') end++;
+    if(end < fileEnd && *end == '\n') end++;
+    return end;
+}
+
+// The block still holds the file as it was: borrowed lines, one right after
+// the other. Returns where they end, 0 when the block was edited.
+static char*
+UntouchedBlockEnd(Line_Block* block, char* fileEnd) {
+    if(IsSpan(block) || !block->Count) return 0;
+
+    char* end = block->Lines[0].Data;
+    for(u32 index = 0; index < block->Count; index++) {
+        Line_Data* line = block->Lines + index;
+        if(!(line->Flags & LineFlag_Borrowed) || line->Data != end) return 0;
+        end = BorrowedLineEnd(line, fileEnd);
+    }
+    return end;
+}
+
+// Turns the untouched blocks outside of the lines [keepFrom, keepTo) back
+// into spans of up to SPAN_LINES lines, and lets go of their file pages.
+// Edited blocks, and the ones around the view, stay as they are.
+static void
+PackSpans(Line_Store* store, size_t keepFrom, size_t keepTo, char* fileEnd) {
+    TRACE_SCOPE("pack spans");
+    SettleTotals(store);
+    size_t nodeCount = NodeCount(store->Root);
+    Line_Node** nodes = (Line_Node**)malloc(nodeCount * sizeof(Line_Node*));
+    Assert(nodes);
+    size_t count = 0;
+    CollectNodes(store->Root, nodes, &count);
+
+    // The run of untouched lines being packed
+    char* runStart = 0;
+    char* runEnd = 0;
+    size_t runLines = 0;
+    size_t runBytes = 0;
+    size_t runRows = 0;
+
+    Line_Node* root = 0;
+    size_t firstLine = 0;
+    for(size_t index = 0; index <= count; index++) {
+        Line_Node* node = index < count ? nodes[index] : 0;
+        size_t lineCount = node ? BlockLineCount(node->Block) : 0;
+        b32 kept = firstLine < keepTo && firstLine + lineCount > keepFrom;
+        char* blockEnd = (node && !kept) ? UntouchedBlockEnd(node->Block, fileEnd) : 0;
+        firstLine += lineCount;
+
+        if(blockEnd && runLines && runEnd == node->Block->Lines[0].Data && runLines + lineCount <= SPAN_LINES) {
+            runEnd = blockEnd;
+            runLines += lineCount;
+            runBytes += node->BlockBytes;
+            runRows += node->BlockRows;
+        } else {
+            if(runLines) {
+                Line_Node* spanNode = CreateSpanNode(store, runStart, runEnd - runStart, runLines, runBytes, runRows);
+                DropSpanPages(spanNode->Block);
+                root = MergeNodes(root, spanNode);
+                runLines = 0;
+            }
+            if(!node) break;
+            if(!blockEnd) {
+                UpdateNode(node);
+                root = MergeNodes(root, node);
+                continue;
+            }
+            runStart = node->Block->Lines[0].Data;
+            runEnd = blockEnd;
+            runLines = lineCount;
+            runBytes = node->BlockBytes;
+            runRows = node->BlockRows;
+        }
+
+        // The lines are borrowed, nothing to free but the block
+        ReleaseBlock(node->Block);
+        free(node);
+    }
+    free(nodes);
+
+    store->Root = root;
+    Assert(NodeLineCount(root) == store->LineCount);
+}
+
+// Blocks of lines that only the store holds can be compressed. A line ending
+// in a CR or holding a newline wouldn't come back the same out of
+// NextSpanLine, and a borrowed line may have lost its CR on the way in, so
+// blocks with any of those stay as they are.
+// Untouched text goes back to the file with PackSpans instead.
+static b32
+CanPackBlock(Line_Block* block) {
+    if(IsSpan(block) || !block->Count || block->Refs > 1) return false;
+    for(u32 index = 0; index < block->Count; index++) {
+        Line_Data* line = block->Lines + index;
+        if(line->Flags & LineFlag_Borrowed) return false;
+        if(line->Size && line->Data[line->Size - 1] == '\r') return false;
+        if(FindByte(line->Data, line->Size, '\n') < line->Size) return false;
+    }
+    return true;
+}
+
+// A compressed span of `lineCount` lines, from their text with a newline after each
+static Line_Node*
+CreatePackedSpan(Line_Store* store, char* text, size_t size, size_t lineCount, size_t rows) {
+    char* packed = (char*)malloc(LzBound(size));
+    Assert(packed);
+    size_t packedSize = LzCompress(text, size, packed);
+    packed = (char*)realloc(packed, packedSize);
+    Assert(packed);
+
+    Line_Node* node = CreateSpanNode(store, 0, size, lineCount, size, rows);
+    node->Block->Packed = packed;
+    node->Block->PackedSize = packedSize;
+    store->PackedBytes += packedSize;
+    store->PackedTextBytes += size;
+    return node;
+}
+
+// Compresses the blocks outside of the lines [keepFrom, keepTo) that can't go
+// back to the file, in runs of up to SPAN_LINES lines and about PACK_RUN_BYTES
+// of text, and frees their lines. Not while a snapshot is alive, it may be
+// reading them.
+static void
+PackBlocks(Line_Store* store, size_t keepFrom, size_t keepTo) {
+    if(store->SnapshotCount) return;
+    TRACE_SCOPE("compress blocks");
+    SettleTotals(store);
+    size_t nodeCount = NodeCount(store->Root);
+    Line_Node** nodes = (Line_Node**)malloc(nodeCount * sizeof(Line_Node*));
+    Assert(nodes);
+    size_t count = 0;
+    CollectNodes(store->Root, nodes, &count);
+
+    // The text of the run being packed
+    char* text = 0;
+    size_t textSize = 0;
+    size_t textCapacity = 0;
+    size_t runLines = 0;
+    size_t runRows = 0;
+
+    Line_Node* root = 0;
+    size_t firstLine = 0;
+    for(size_t index = 0; index <= count; index++) {
+        Line_Node* node = index < count ? nodes[index] : 0;
+        size_t lineCount = node ? BlockLineCount(node->Block) : 0;
+        b32 kept = firstLine < keepTo && firstLine + lineCount > keepFrom;
+        b32 packed = node && !kept && CanPackBlock(node->Block);
+        firstLine += lineCount;
+
+        if(runLines && (!packed || runLines + lineCount > SPAN_LINES || textSize >= PACK_RUN_BYTES)) {
+            root = MergeNodes(root, CreatePackedSpan(store, text, textSize, runLines, runRows));
+            textSize = 0;
+            runLines = 0;
+            runRows = 0;
+        }
+        if(!node) break;
+        if(!packed) {
+            UpdateNode(node);
+            root = MergeNodes(root, node);
+            continue;
+        }
+
+        if(textSize + node->BlockBytes > textCapacity) {
+            textCapacity = 2*(textSize + node->BlockBytes);
+            text = (char*)realloc(text, textCapacity);
+            Assert(text);
+        }
+        Line_Block* block = node->Block;
+        for(u32 line = 0; line < block->Count; line++) {
+            memcpy(text + textSize, block->Lines[line].Data, block->Lines[line].Size);
+            textSize += block->Lines[line].Size;
+            text[textSize++] = '\n';
+            FreeLineData(store, block->Lines[line].Data);
+        }
+        runLines += lineCount;
+        runRows += node->BlockRows;
+        ReleaseBlock(block);
+        free(node);
+    }
+    free(text);
+    free(nodes);
+
+    store->Root = root;
+    Assert(NodeLineCount(root) == store->LineCount);
+}
+
+// Borrowed lines, and lines a snapshot may be reading, get their own copy of
+// the data the first time they are edited.
+inline void
+MakeLineWritable(Line_Store* store, Line_Data* line) {
+    if(!(line->Flags & (LineFlag_Borrowed | LineFlag_Shared))) return;
+    if(!(line->Flags & LineFlag_Borrowed) && !store->SnapshotCount) {
+        line->Flags &= ~LineFlag_Shared; // The snapshots are gone, it's ours again
+        return;
+    }
+
+    char* data = AllocLineData(store, line->Size);
+    memcpy(data, line->Data, line->Size);
+    data[line->Size] = 0;
+
+    if(line->Flags & LineFlag_Shared) RetireLineData(store, line->Data);
+    line->Data = data;
+    line->Flags &= ~(LineFlag_Borrowed | LineFlag_Shared);
+}
+
+// Makes room for the line from EditLine to hold `size` bytes plus its zero.
+// It grows by half at least, so the next few keys fit in place.
+static void
+ReserveLine(Line_Store* store, Line_Data* line, size_t size) {
+    size_t capacity = ArenaCapacity(line->Data);
+    if(size + 1 <= capacity) return;
+
+    size_t wanted = capacity + capacity / 2;
+    if(wanted < size + 1) wanted = size + 1;
+    char* data = ArenaAlloc(&store->Arena, wanted);
+    memcpy(data, line->Data, line->Size + 1);
+    FreeLineData(store, line->Data);
+    line->Data = data;
+}
+
+// Call before changing the bytes of a line, and use the line it returns: the
+// block holding it may have been copied.
+static Line_Data*
+EditLine(Line_Store* store, size_t lineIndex) {
+    if(lineIndex >= store->LineCount) return 0;
+    SettleTotals(store);
+
+    Store_Path path;
+    Line_Node* node = FindBlock(store, lineIndex, &path);
+    Line_Data* line = UnshareBlock(node)->Lines + (lineIndex - path.FirstLine);
+    MakeLineWritable(store, line);
+    line->Flags &= ~LINE_DERIVED_FLAGS;
+    line->Generation++;
+    NoteChange(store, lineIndex);
+    MarkStale(store, lineIndex);
+    return line;
+}
+
+// The block holding `lineIndex`, ready to be changed. Used to edit many lines
+// of a block without walking the tree for every one of them.
+static Line_Block*
+EditBlock(Line_Store* store, size_t lineIndex, size_t* firstLine) {
+    if(lineIndex >= store->LineCount) return 0;
+    SettleTotals(store);
+
+    Store_Path path;
+    Line_Node* node = FindBlock(store, lineIndex, &path);
+    *firstLine = path.FirstLine;
+    NoteChange(store, lineIndex);
+    MarkStale(store, lineIndex);
+    return UnshareBlock(node);
+}
+
+// Swaps in new data for a line of a block from EditBlock. The line takes
+// ownership of `data`, which is zero terminated like all owned line data.
+static void
+SetLineData(Line_Store* store, Line_Data* line, char* data, size_t size) {
+    ReleaseLineData(store, line);
+    line->Data = data;
+    line->Size = size;
+    line->Flags &= ~(LineFlag_Borrowed | LineFlag_Shared | LINE_DERIVED_FLAGS);
+    line->Generation++;
+}
+
+// Inserts `count` lines before `lineIndex` in one pass: the block there is cut
+// in two and the new lines go in whole blocks between the halves.
+static void
+StoreInsertLines(Line_Store* store, size_t lineIndex, Line_Data* lines, size_t count) {
+    if(lineIndex > store->LineCount || count == 0) return;
+    if(lineIndex == store->LineCount) {
+        StoreAppendLines(store, lines, count);
+        return;
+    }
+
+    for(size_t index = 0; index < count; index++) {
+        lines[index].Id = ++store->LastLineId;
+    }
+    NoteChange(store, lineIndex);
+    SettleTotals(store);
+
+    Store_Path path;
+    Line_Node* node = FindBlock(store, lineIndex, &path);
+    Line_Block* block = UnshareBlock(node);
+    size_t at = lineIndex - path.FirstLine;
+
+    // Set aside the lines after the cut
+    Line_Data tail[LINE_BLOCK_CAPACITY];
+    size_t tailCount = block->Count - at;
+    memcpy(tail, block->Lines + at, tailCount * sizeof(Line_Data));
+    block->Count = at;
+
+    // Top up the cut block, then fill new blocks with the rest and the tail
+    size_t fill = LINE_BLOCK_CAPACITY - block->Count;
+    if(fill > count) fill = count;
+    memcpy(block->Lines + block->Count, lines, fill * sizeof(Line_Data));
+    block->Count += fill;
+    lines += fill;
+    count -= fill;
+    RefreshPath(store, &path);
+
+    Line_Node* middle = 0;
+    Line_Node* last = 0;
+    while(count || tailCount) {
+        last = CreateNode(store);
+        Line_Block* newBlock = last->Block;
+
+        fill = count < LINE_BLOCK_CAPACITY ? count : LINE_BLOCK_CAPACITY;
+        memcpy(newBlock->Lines, lines, fill * sizeof(Line_Data));
+        newBlock->Count = fill;
+        lines += fill;
+        count -= fill;
+
+        if(!count) {
+            size_t tailFill = LINE_BLOCK_CAPACITY - newBlock->Count;
+            if(tailFill > tailCount) tailFill = tailCount;
+            memcpy(newBlock->Lines + newBlock->Count, tail, tailFill * sizeof(Line_Data));
+            newBlock->Count += tailFill;
+            tailCount -= tailFill;
+            memmove(tail, tail + tailFill, tailCount * sizeof(Line_Data));
+        }
+
+        UpdateBlockNode(store, last);
+        middle = MergeNodes(middle, last);
+    }
+
+    Line_Node *left, *right;
+    SplitNodes(store->Root, path.Rank + 1, &left, &right);
+    store->Root = MergeNodes(MergeNodes(left, middle), right);
+    store->LineCount = NodeLineCount(store->Root);
+}
+
+static void
+CollectBlocks(Line_Node* node, Store_Snapshot* snapshot) {
+    if(!node) return;
+    CollectBlocks(node->Left, snapshot);
+    node->Block->Refs++;
+    snapshot->Blocks[snapshot->BlockCount++] = node->Block;
+    CollectBlocks(node->Right, snapshot);
+}
+
+// Takes a reference on every block, O(blocks) and no line is copied
+static void
+TakeSnapshot(Line_Store* store, Store_Snapshot* snapshot) {
+    snapshot->Blocks = (Line_Block**)malloc((NodeCount(store->Root) + 1) * sizeof(Line_Block*));
+    Assert(snapshot->Blocks);
+    snapshot->BlockCount = 0;
+    snapshot->LineCount = store->LineCount;
+    CollectBlocks(store->Root, snapshot);
+    store->SnapshotCount++;
+}
+
+static void
+ReleaseSnapshot(Line_Store* store, Store_Snapshot* snapshot) {
+    for(size_t index = 0; index < snapshot->BlockCount; index++) {
+        ReleaseBlock(snapshot->Blocks[index]);
+    }
+    free(snapshot->Blocks);
+    *snapshot = {};
+
+    Assert(store->SnapshotCount > 0);
+    if(--store->SnapshotCount == 0) {
+        for(size_t index = 0; index < store->RetiredCount; index++) {
+            FreeLineData(store, store->Retired[index]);
+        }
+        store->RetiredCount = 0;
+    }
+}
+
+static void
+FreeNodes(Line_Node* node) {
+    if(!node) return;
+    FreeNodes(node->Left);
+    FreeNodes(node->Right);
+    ReleaseBlock(node->Block);
+    free(node);
+}
+
+// Drops every line at once: the line data goes with the arena instead of
+// being freed line by line. No snapshot may be alive.
+static void
+FreeStore(Line_Store* store) {
+    Assert(!store->SnapshotCount);
+    FreeNodes(store->Root);
+    free(store->Retired);
+    ReleaseArena(&store->Arena);
+    *store = {};
+}
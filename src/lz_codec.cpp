@@ -0,0 +1,143 @@
+// LZ compression of line text.
+//
+// A byte oriented LZ77 in the style of LZ4, for packing cold blocks of the
+// line store into memory: fast enough that unpacking a block when it scrolls
+// back into view doesn't show, and good at what logs repeat (timestamps,
+// levels, the same messages over and over).
+//
+// The output is a run of sequences. Each starts with a token byte, the count
+// of literals in the high nibble and the length of the match minus
+// LZ_MIN_MATCH in the low one, a nibble of 15 meaning that more bytes of 255
+// (and a last one below) add to it. The literals follow, then the match as a
+// 2 byte little-endian offset back into the output and the rest of its length.
+// The last sequence only has literals.
+
+#define LZ_HASH_BITS 14
+#define LZ_MIN_MATCH 4
+#define LZ_MAX_OFFSET 0xFFFF
+#define LZ_LAST_LITERALS 8 // Matches stop short of the end of the input
+
+// Room LzCompress may need for `size` bytes, when nothing matches
+inline size_t
+LzBound(size_t size) {
+    return size + size / 255 + 16;
+}
+
+inline u32
+Read32(char* data) {
+    u32 value;
+    memcpy(&value, data, sizeof(value));
+    return value;
+}
+
+// A length that didn't fit in its nibble
+inline char*
+PutLzLength(char* out, size_t length) {
+    while(length >= 255) {
+        *out++ = (char)255;
+        length -= 255;
+    }
+    *out++ = (char)length;
+    return out;
+}
+
+// Literals, and a match after them unless `matchLength` is 0
+static char*
+PutLzSequence(char* out, char* literals, size_t literalCount, size_t offset, size_t matchLength) {
+    u8* token = (u8*)out++;
+    *token = (u8)((literalCount < 15 ? literalCount : 15) << 4);
+    if(literalCount >= 15) out = PutLzLength(out, literalCount - 15);
+    memcpy(out, literals, literalCount);
+    out += literalCount;
+    if(!matchLength) return out;
+
+    *out++ = (char)(offset & 0xFF);
+    *out++ = (char)(offset >> 8);
+    size_t extra = matchLength - LZ_MIN_MATCH;
+    *token |= (u8)(extra < 15 ? extra : 15);
+    if(extra >= 15) out = PutLzLength(out, extra - 15);
+    return out;
+}
+
+// Compresses `size` bytes into `out`, which has room for LzBound(size).
+// Returns the compressed size.
+static size_t
+LzCompress(char* data, size_t size, char* out) {
+    Assert(size < 0xFFFFFFFF);
+    u32 table[1 << LZ_HASH_BITS]; // Where 4 bytes with the hash were last seen
+    memset(table, 0, sizeof(table));
+
+    char* start = out;
+    size_t anchor = 0; // Start of the literals not written yet
+    size_t at = 0;
+    size_t limit = size > LZ_LAST_LITERALS ? size - LZ_LAST_LITERALS : 0;
+    while(at + LZ_MIN_MATCH <= limit) {
+        u32 sequence = Read32(data + at);
+        u32 hash = (sequence * 2654435761u) >> (32 - LZ_HASH_BITS);
+        size_t candidate = table[hash];
+        table[hash] = (u32)at;
+        if(candidate >= at || at - candidate > LZ_MAX_OFFSET || Read32(data + candidate) != sequence) {
+            // The longer nothing matched, the bigger the steps, so text that
+            // doesn't compress goes by quickly
+            at += 1 + ((at - anchor) >> 6);
+            continue;
+        }
+
+        size_t length = LZ_MIN_MATCH;
+        while(at + length < limit && data[candidate + length] == data[at + length]) length++;
+        out = PutLzSequence(out, data + anchor, at - anchor, at - candidate, length);
+        at += length;
+        anchor = at;
+    }
+    out = PutLzSequence(out, data + anchor, size - anchor, 0, 0);
+    return out - start;
+}
+
+// A length that goes on past its nibble, 0 when the input ends in it
+inline size_t
+GetLzLength(u8** in, u8* end, size_t length) {
+    u8 byte;
+    do {
+        if(*in == end) return 0;
+        byte = *(*in)++;
+        length += byte;
+    } while(byte == 255);
+    return length;
+}
+
+// Unpacks what LzCompress made into the `size` bytes at `out`. False when the
+// data is damaged or doesn't come to exactly `size` bytes.
+static b32
+LzDecompress(char* data, size_t packedSize, char* out, size_t size) {
+    u8* in = (u8*)data;
+    u8* inEnd = in + packedSize;
+    char* outStart = out;
+    char* outEnd = out + size;
+    while(in < inEnd) {
+        u8 token = *in++;
+        size_t literalCount = token >> 4;
+        if(literalCount == 15 && !(literalCount = GetLzLength(&in, inEnd, 15))) return false;
+        if(literalCount > (size_t)(inEnd - in) || literalCount > (size_t)(outEnd - out)) return false;
+        memcpy(out, in, literalCount);
+        in += literalCount;
+        out += literalCount;
+        if(in == inEnd) break; // The last sequence
+
+        if(inEnd - in < 2) return false;
+        size_t offset = in[0] | (in[1] << 8);
+        in += 2;
+        size_t length = (token & 15) + LZ_MIN_MATCH;
+        if((token & 15) == 15 && !(length = GetLzLength(&in, inEnd, length))) return false;
+        if(!offset || offset > (size_t)(out - outStart) || length > (size_t)(outEnd - out)) return false;
+
+        char* from = out - offset;
+        if(offset >= length) {
+            memcpy(out, from, length);
+            out += length;
+        } else {
+            // Overlaps what it writes, a run repeating the last `offset` bytes
+            for(size_t index = 0; index < length; index++) *out++ = from[index];
+        }
+    }
+    return out == outEnd;
+}
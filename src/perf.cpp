@@ -0,0 +1,176 @@
+// Performance instrumentation.
+//
+// Three things, all cheap enough to leave in: a count of every heap
+// allocation, the numbers the HUD shows for the last frame (Ctrl-P), and a
+// trace of timed scopes (--trace=FILE). The trace is written as Chrome trace
+// JSON, load it in chrome://tracing or Perfetto.
+
+#define TRACE_MAIN_THREAD 1
+#define TRACE_SAVE_THREAD 2
+#define TRACE_JOURNAL_THREAD 3
+#define HUD_RESIDENT_INTERVAL 0.5 // Seconds between reads of the resident size
+
+// Every malloc(), calloc() and realloc() is counted. These definitions win
+// over the ones in libc, which do the actual work.
+extern "C" void* __libc_malloc(size_t size);
+extern "C" void* __libc_calloc(size_t count, size_t size);
+extern "C" void* __libc_realloc(void* memory, size_t size);
+
+global u64 GlobalHeapAllocations; // Threads allocate too
+
+extern "C" void*
+malloc(size_t size) noexcept {
+    __atomic_fetch_add(&GlobalHeapAllocations, 1, __ATOMIC_RELAXED);
+    return __libc_malloc(size);
+}
+
+extern "C" void*
+calloc(size_t count, size_t size) noexcept {
+    __atomic_fetch_add(&GlobalHeapAllocations, 1, __ATOMIC_RELAXED);
+    return __libc_calloc(count, size);
+}
+
+extern "C" void*
+realloc(void* memory, size_t size) noexcept {
+    __atomic_fetch_add(&GlobalHeapAllocations, 1, __ATOMIC_RELAXED);
+    return __libc_realloc(memory, size);
+}
+
+inline u64
+HeapAllocations() {
+    return __atomic_load_n(&GlobalHeapAllocations, __ATOMIC_RELAXED);
+}
+
+// Resident set size from /proc, 0 when it can't be read
+static size_t
+ReadResidentBytes() {
+    int fileHandle = open("/proc/self/statm", O_RDONLY);
+    if(fileHandle == -1) return 0;
+
+    char text[128];
+    ssize_t length = read(fileHandle, text, sizeof(text) - 1);
+    close(fileHandle);
+    if(length <= 0) return 0;
+    text[length] = 0;
+
+    unsigned long pages, resident;
+    if(sscanf(text, "%lu %lu", &pages, &resident) != 2) return 0;
+    return resident * (size_t)sysconf(_SC_PAGESIZE);
+}
+
+struct Perf_Hud {
+    b32 Visible;
+    f64 InputTime; // When the keys of the next frame were read, 0 when there are none
+
+    // The last frame
+    f64 BuildSeconds;   // Drawing and diffing it, not writing it out
+    f64 LatencySeconds; // From reading the keys to writing the frame that shows them
+    size_t Bytes;
+    u64 Allocations;    // Since the frame before, heap and line arena
+
+    u64 AllocationMark;
+    size_t ResidentBytes;
+    f64 ResidentTime;
+
+    // Text held compressed, and what it comes to unpacked
+    size_t PackedBytes;
+    size_t PackedTextBytes;
+};
+
+inline void
+NoteInput(Perf_Hud* hud) {
+    if(!hud->InputTime) hud->InputTime = GetSeconds();
+}
+
+// Called once a frame is written. `allocations` is the running total.
+static void
+FinishFrame(Perf_Hud* hud, f64 buildSeconds, size_t bytes, u64 allocations) {
+    f64 now = GetSeconds();
+    hud->BuildSeconds = buildSeconds;
+    hud->Bytes = bytes;
+    if(hud->InputTime) {
+        hud->LatencySeconds = now - hud->InputTime;
+        hud->InputTime = 0;
+    }
+    hud->Allocations = allocations - hud->AllocationMark;
+    hud->AllocationMark = allocations;
+
+    if(hud->Visible && now - hud->ResidentTime >= HUD_RESIDENT_INTERVAL) {
+        hud->ResidentBytes = ReadResidentBytes();
+        hud->ResidentTime = now;
+    }
+}
+
+static size_t
+FormatHud(Perf_Hud* hud, char* text, size_t size) {
+    int length = snprintf(text, size, " frame %.2f ms | %lu B out | latency %.2f ms | %llu allocs | RSS %.1f MB ",
+                          hud->BuildSeconds * 1000.0, hud->Bytes, hud->LatencySeconds * 1000.0,
+                          (unsigned long long)hud->Allocations, hud->ResidentBytes / (1024.0*1024.0));
+    if(length < 0) return 0;
+    if((size_t)length < size && hud->PackedBytes) {
+        int packed = snprintf(text + length, size - length, "| packed %.1f MB %.1fx ", hud->PackedBytes / (1024.0*1024.0),
+                              (f64)hud->PackedTextBytes / hud->PackedBytes);
+        if(packed > 0) length += packed;
+    }
+    return (size_t)length < size ? (size_t)length : size - 1;
+}
+
+struct Trace_Log {
+    FILE* File; // 0 when not tracing
+    f64 StartTime;
+    u64 EventCount;
+};
+
+global Trace_Log GlobalTrace;
+
+inline b32
+IsTracing() {
+    return GlobalTrace.File != 0;
+}
+
+static void
+TraceEvent(char* name, f64 start, f64 end, u32 thread) {
+    if(!GlobalTrace.File) return;
+    f64 startUs = (start - GlobalTrace.StartTime) * 1e6;
+    fprintf(GlobalTrace.File, ",\n{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%u,\"ts\":%.3f,\"dur\":%.3f}",
+            name, thread, startUs, (end - start) * 1e6);
+    GlobalTrace.EventCount++;
+}
+
+// Returns an errno value, 0 when the trace is being recorded
+static int
+StartTrace(char* filename) {
+    GlobalTrace.File = fopen(filename, "w");
+    if(!GlobalTrace.File) return errno;
+    GlobalTrace.StartTime = GetSeconds();
+    fprintf(GlobalTrace.File, "{\"traceEvents\":[\n"
+            "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%d,\"args\":{\"name\":\"editor\"}},\n"
+            "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%d,\"args\":{\"name\":\"save\"}},\n"
+            "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%d,\"args\":{\"name\":\"journal\"}}",
+            TRACE_MAIN_THREAD, TRACE_SAVE_THREAD, TRACE_JOURNAL_THREAD);
+    return 0;
+}
+
+static void
+StopTrace() {
+    if(!GlobalTrace.File) return;
+    fprintf(GlobalTrace.File, "\n]}\n");
+    fclose(GlobalTrace.File);
+    GlobalTrace = {};
+}
+
+// Times the rest of the enclosing scope, on the main thread
+struct Trace_Scope {
+    char* Name;
+    f64 Start;
+
+    Trace_Scope(char* name) {
+        Name = name;
+        Start = GlobalTrace.File ? GetSeconds() : 0;
+    }
+    ~Trace_Scope() {
+        if(GlobalTrace.File) TraceEvent(Name, Start, GetSeconds(), TRACE_MAIN_THREAD);
+    }
+};
+
+#define TRACE_SCOPE(name) Trace_Scope traceScope(name)
@@ -0,0 +1,582 @@
+// Crash recovery journal.
+//
+// Saving is the only thing that puts edits on disk, and writing out a big
+// file is far too slow to do every so often. So every edit is also appended
+// to a journal next to the file (".name.recover"), and a crash or a dropped
+// connection loses at most the last RECOVERY_FLUSH_MS of typing.
+//
+// An edit goes in as a record: a kind byte, then where it happened as varints,
+// then what else it needs (the text for typing and pasting, the range for a
+// delete). Records collect in memory and are handed out as a frame every
+// RECOVERY_FLUSH_MS, so a keystroke only costs a few bytes of copying. A
+// thread of its own writes the frame and waits for fdatasync(), the editor
+// keeps taking input meanwhile. A frame starts with its size and a checksum.
+// A frame that was torn by a crash is where the replay stops.
+//
+// The journal starts with what the file looked like (size, mtime, inode) when
+// the edits were made on top of it. Loading that same file again replays the
+// journal, and a file that changed since then leaves it alone. A save starts
+// the journal over, with only the edits made after the save's snapshot.
+// Quitting removes it, unless the input went away under the editor.
+
+#include <limits.h> // for PATH_MAX
+#include <pthread.h>
+
+#define RECOVERY_MAGIC "RECOVER1"
+#define RECOVERY_FLUSH_MS 1000
+#define RECOVERY_FLUSH_BYTES (1024*1024) // Written right away past this, not on the timer
+#define RECOVERY_POLL_MS 10 // How often a frame being written is looked at
+
+enum Recovery_Kind {
+    RecoveryKind_Character,       // InsertCharacter at the cursor
+    RecoveryKind_Text,            // InsertText at the cursor
+    RecoveryKind_Newline,         // Enter at the cursor
+    RecoveryKind_DeleteCharacter, // Backspace at the cursor
+    RecoveryKind_Delete,          // DeleteText of a range
+    RecoveryKind_AddLine,         // An empty line put in (redo)
+    RecoveryKind_DeleteLine,      // A line taken out (undo)
+    RecoveryKind_Replace,         // ApplyReplace
+    RecoveryKind_UndoReplace,     // ApplyReplace, taken back
+    RecoveryKind_Count,
+};
+
+// The file the edits go on top of
+struct Recovery_Header {
+    char Magic[8];
+    u64 FileSize;
+    i64 ModifiedSeconds;
+    i64 ModifiedNanoseconds;
+    u64 Inode;
+};
+
+struct Recovery_Frame {
+    u32 Size;  // Bytes of records after this
+    u32 Check; // FNV-1a of them
+};
+
+struct Recovery_Journal {
+    b32 Active;       // Edits are being recorded
+    char* Path;
+    Recovery_Header Header;
+    int FileHandle;   // -1 until the first frame creates the journal
+    XBuffer Pending;  // Records not written yet
+    f64 FlushTime;    // When Pending is due to go out
+
+    // The frame the writer thread has, which owns FileHandle meanwhile
+    b32 Writing;      // Started and not collected by FinishRecoveryWrite yet
+    pthread_t Thread;
+    XBuffer Frame;
+    b32 Written;      // Set by the writer thread, read with atomics
+    int WriteError;   // Valid once Written is set
+    f64 StartTime, EndTime;
+
+    b32 Saving;       // A save took its snapshot, SinceSave has what came after it
+    XBuffer SinceSave;
+};
+
+// A record as read back
+struct Recovery_Record {
+    u32 Kind;
+    size_t Y, X;
+    size_t EndY, EndX; // RecoveryKind_Delete
+    char* Text;        // Typed or pasted, or what a replace looks for
+    size_t Size;
+    char* To;          // What a replace puts in its place
+    size_t ToLength;
+    Search_Match* Matches;
+    size_t MatchCount;
+};
+
+struct Recovery_Reader {
+    u8* At;
+    u8* End;
+    Search_Match* Matches; // Of the last replace read
+    size_t MatchCapacity;
+};
+
+inline u32
+RecoveryCheck(char* data, size_t size) {
+    u32 check = 2166136261u;
+    for(size_t index = 0; index < size; index++) {
+        check = (check ^ (u8)data[index]) * 16777619u;
+    }
+    return check;
+}
+
+// The journal of `filename` is ".name.recover" in the directory of what it
+// points at. False when the name doesn't fit.
+static b32
+GetRecoveryPath(char* filename, char* path, size_t size) {
+    char target[PATH_MAX];
+    if(!realpath(filename, target)) {
+        if(snprintf(target, sizeof(target), "%s", filename) >= (int)sizeof(target)) return false;
+    }
+    char* slash = strrchr(target, '/');
+    int directoryLength = slash ? (int)(slash - target) + 1 : 0;
+    return snprintf(path, size, "%.*s.%s.recover", directoryLength, target, target + directoryLength) < (int)size;
+}
+
+inline void
+SetRecoveryHeader(Recovery_Header* header, struct stat* fileStat) {
+    memcpy(header->Magic, RECOVERY_MAGIC, sizeof(header->Magic));
+    header->FileSize = fileStat->st_size;
+    header->ModifiedSeconds = fileStat->st_mtim.tv_sec;
+    header->ModifiedNanoseconds = fileStat->st_mtim.tv_nsec;
+    header->Inode = fileStat->st_ino;
+}
+
+// Starts recording edits made on top of `filename`, as `fileStat` found it.
+// Nothing is written until there is an edit.
+static b32
+StartRecovery(Recovery_Journal* journal, char* filename, struct stat* fileStat) {
+    char path[PATH_MAX];
+    if(!GetRecoveryPath(filename, path, sizeof(path))) return false;
+    free(journal->Path);
+    journal->Path = strdup(path);
+    if(!journal->Path) return false;
+
+    SetRecoveryHeader(&journal->Header, fileStat);
+    journal->FileHandle = -1;
+    journal->Pending.Used = 0;
+    journal->Active = true;
+    return true;
+}
+
+// Writes all of `size` bytes. Returns an errno value, 0 on success.
+static int
+WriteAll(int fileHandle, char* data, size_t size) {
+    while(size) {
+        ssize_t written = write(fileHandle, data, size);
+        if(written < 0) {
+            if(errno == EINTR) continue;
+            return errno;
+        }
+        data += written;
+        size -= written;
+    }
+    return 0;
+}
+
+inline int
+WriteFrame(int fileHandle, char* records, size_t size) {
+    Recovery_Frame frame = {(u32)size, RecoveryCheck(records, size)};
+    int error = WriteAll(fileHandle, (char*)&frame, sizeof(frame));
+    if(!error) error = WriteAll(fileHandle, records, size);
+    return error;
+}
+
+// Makes the name of a new file durable
+static void
+SyncDirectory(char* path) {
+    char directory[PATH_MAX];
+    char* slash = strrchr(path, '/');
+    int directoryLength = slash ? (int)(slash - path) + 1 : 0;
+    snprintf(directory, sizeof(directory), "%.*s", directoryLength, path);
+    int directoryHandle = open(directoryLength ? directory : ".", O_RDONLY | O_DIRECTORY);
+    if(directoryHandle != -1) {
+        fsync(directoryHandle);
+        close(directoryHandle);
+    }
+}
+
+// Puts a new journal with just `records` in place of the old one, written to
+// a temporary file and renamed over it. Returns an errno value, 0 on success.
+static int
+ReplaceJournal(Recovery_Journal* journal, char* records, size_t size) {
+    char temp[PATH_MAX];
+    if(snprintf(temp, sizeof(temp), "%s.XXXXXX", journal->Path) >= (int)sizeof(temp)) return ENAMETOOLONG;
+    int fileHandle = mkstemp(temp);
+    if(fileHandle == -1) return errno;
+
+    int error = WriteAll(fileHandle, (char*)&journal->Header, sizeof(Recovery_Header));
+    if(!error) error = WriteFrame(fileHandle, records, size);
+    if(!error && fdatasync(fileHandle) == -1) error = errno;
+    if(!error && rename(temp, journal->Path) == -1) error = errno;
+    if(error) {
+        close(fileHandle);
+        unlink(temp);
+        return error;
+    }
+    SyncDirectory(journal->Path);
+    if(journal->FileHandle != -1) close(journal->FileHandle);
+    journal->FileHandle = fileHandle;
+    return 0;
+}
+
+// Reads the records of a journal left behind for the file StartRecovery was
+// given, the ones of every frame that made it to disk whole. False when there
+// is no journal, or it is for another version of the file. `stale` tells
+// which. A journal that is read is the one the edits from now on go to.
+static b32
+ReadRecovery(Recovery_Journal* journal, XBuffer* records, b32* stale) {
+    *stale = false;
+    int fileHandle = open(journal->Path, O_RDWR | O_APPEND | O_CLOEXEC);
+    if(fileHandle == -1) return false;
+
+    struct stat fileStat;
+    char* data = 0;
+    size_t size = 0;
+    if(fstat(fileHandle, &fileStat) == 0 && fileStat.st_size >= (off_t)sizeof(Recovery_Header)) {
+        size = fileStat.st_size;
+        data = (char*)malloc(size);
+        if(data && pread(fileHandle, data, size, 0) != (ssize_t)size) size = 0;
+    }
+
+    Recovery_Header* header = (Recovery_Header*)data;
+    if(!data || !size || memcmp(header, &journal->Header, sizeof(Recovery_Header)) != 0) {
+        *stale = true;
+        free(data);
+        close(fileHandle);
+        return false;
+    }
+
+    // Frames are put together in place, until one doesn't check out
+    records->Data = data;
+    records->Size = size;
+    records->Used = 0;
+    size_t at = sizeof(Recovery_Header);
+    while(size - at >= sizeof(Recovery_Frame)) {
+        Recovery_Frame frame;
+        memcpy(&frame, data + at, sizeof(frame));
+        char* frameRecords = data + at + sizeof(frame);
+        if(frame.Size > size - at - sizeof(frame) || RecoveryCheck(frameRecords, frame.Size) != frame.Check) break;
+        memmove(data + records->Used, frameRecords, frame.Size);
+        records->Used += frame.Size;
+        at += sizeof(frame) + frame.Size;
+    }
+
+    // A torn frame at the end is cut off, new ones go after the last good one.
+    // When it can't be, the good ones go in a new journal. Failing that too,
+    // nothing more is recorded, the journal stays as it is for the next start.
+    journal->FileHandle = fileHandle;
+    if(at < size && ftruncate(fileHandle, at) == -1 && ReplaceJournal(journal, records->Data, records->Used) != 0) {
+        close(journal->FileHandle);
+        journal->FileHandle = -1;
+        journal->Active = false;
+    }
+    return true;
+}
+
+inline void
+PutVarint(XBuffer* buffer, size_t value) {
+    u8 bytes[10];
+    int count = 0;
+    while(value >= 0x80) {
+        bytes[count++] = (u8)(value | 0x80);
+        value >>= 7;
+    }
+    bytes[count++] = (u8)value;
+    AppendToBuffer(buffer, (char*)bytes, count);
+}
+
+// The buffers a record goes to: the next frame, and during a save the
+// journal that goes with the saved file
+inline u32
+RecordBuffers(Recovery_Journal* journal, XBuffer** buffers) {
+    u32 count = 0;
+    if(journal->Active) {
+        if(!journal->Pending.Used) journal->FlushTime = GetSeconds() + RECOVERY_FLUSH_MS / 1000.0;
+        buffers[count++] = &journal->Pending;
+    }
+    if(journal->Saving) buffers[count++] = &journal->SinceSave;
+    return count;
+}
+
+// Records an edit at (y, x), with `size` bytes of text
+static void
+LogEdit(Recovery_Journal* journal, u32 kind, size_t y, size_t x, char* text, size_t size) {
+    XBuffer* buffers[2];
+    u32 count = RecordBuffers(journal, buffers);
+    for(u32 index = 0; index < count; index++) {
+        char kindByte = (char)kind;
+        AppendToBuffer(buffers[index], &kindByte, 1);
+        PutVarint(buffers[index], y);
+        PutVarint(buffers[index], x);
+        if(kind == RecoveryKind_Character) {
+            AppendToBuffer(buffers[index], text, 1);
+        } else if(kind == RecoveryKind_Text) {
+            PutVarint(buffers[index], size);
+            AppendToBuffer(buffers[index], text, size);
+        }
+    }
+}
+
+// Records the delete of the text from (y0, x0) up to (y1, x1)
+static void
+LogDelete(Recovery_Journal* journal, size_t y0, size_t x0, size_t y1, size_t x1) {
+    XBuffer* buffers[2];
+    u32 count = RecordBuffers(journal, buffers);
+    for(u32 index = 0; index < count; index++) {
+        char kindByte = RecoveryKind_Delete;
+        AppendToBuffer(buffers[index], &kindByte, 1);
+        PutVarint(buffers[index], y0);
+        PutVarint(buffers[index], x0);
+        PutVarint(buffers[index], y1 - y0);
+        PutVarint(buffers[index], x1);
+    }
+}
+
+// Records a replace, the matches as they were handed to ApplyReplace. Lines
+// go in as the distance from the match before.
+static void
+LogReplace(Recovery_Journal* journal, char* from, size_t fromLength, char* to, size_t toLength,
+           Search_Match* matches, size_t count, b32 undo) {
+    XBuffer* buffers[2];
+    u32 bufferCount = RecordBuffers(journal, buffers);
+    for(u32 index = 0; index < bufferCount; index++) {
+        XBuffer* buffer = buffers[index];
+        char kindByte = undo ? RecoveryKind_UndoReplace : RecoveryKind_Replace;
+        AppendToBuffer(buffer, &kindByte, 1);
+        PutVarint(buffer, fromLength);
+        AppendToBuffer(buffer, from, fromLength);
+        PutVarint(buffer, toLength);
+        AppendToBuffer(buffer, to, toLength);
+        PutVarint(buffer, count);
+        size_t line = 0;
+        for(size_t match = 0; match < count; match++) {
+            PutVarint(buffer, matches[match].Line - line);
+            PutVarint(buffer, matches[match].Column);
+            line = matches[match].Line;
+        }
+    }
+}
+
+// Creates the journal with just the header in it. Returns the handle, -1
+// with errno set when it can't.
+static int
+CreateJournal(Recovery_Journal* journal) {
+    int fileHandle = open(journal->Path, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND | O_CLOEXEC, 0600);
+    if(fileHandle == -1) return -1;
+    int error = WriteAll(fileHandle, (char*)&journal->Header, sizeof(Recovery_Header));
+    if(error) {
+        close(fileHandle);
+        unlink(journal->Path);
+        errno = error;
+        return -1;
+    }
+    return fileHandle;
+}
+
+static void*
+RecoveryWriter(void* data) {
+    Recovery_Journal* journal = (Recovery_Journal*)data;
+    journal->StartTime = GetSeconds();
+
+    int error = 0;
+    b32 created = false;
+    if(journal->FileHandle == -1) {
+        journal->FileHandle = CreateJournal(journal);
+        if(journal->FileHandle == -1) error = errno;
+        created = !error;
+    }
+    if(!error) error = WriteFrame(journal->FileHandle, journal->Frame.Data, journal->Frame.Used);
+    if(!error && fdatasync(journal->FileHandle) == -1) error = errno;
+    if(!error && created) SyncDirectory(journal->Path);
+
+    journal->WriteError = error;
+    journal->EndTime = GetSeconds();
+    __atomic_store_n(&journal->Written, true, __ATOMIC_RELEASE);
+    return 0;
+}
+
+inline b32
+IsRecoveryWritten(Recovery_Journal* journal) {
+    return __atomic_load_n(&journal->Written, __ATOMIC_ACQUIRE);
+}
+
+// Waits for the frame being written, if there is one. Returns its errno
+// value, 0 on success. Recording stops when it failed.
+static int
+FinishRecoveryWrite(Recovery_Journal* journal) {
+    if(!journal->Writing) return 0;
+    pthread_join(journal->Thread, 0);
+    TraceEvent("sync journal", journal->StartTime, journal->EndTime, TRACE_JOURNAL_THREAD);
+    journal->Writing = false;
+    if(journal->WriteError) journal->Active = false;
+    return journal->WriteError;
+}
+
+// Hands what was recorded since the last frame to the writer thread, once the
+// frame before is done. Returns an errno value, 0 on success, also of the
+// frame before. Recording stops when it can't.
+static int
+FlushRecovery(Recovery_Journal* journal) {
+    if(journal->Writing && !IsRecoveryWritten(journal)) return 0;
+    int error = FinishRecoveryWrite(journal);
+    if(error || !journal->Active || !journal->Pending.Used) return error;
+
+    XBuffer frame = journal->Frame;
+    journal->Frame = journal->Pending;
+    journal->Pending = frame;
+    journal->Pending.Used = 0;
+    journal->Written = false;
+    error = pthread_create(&journal->Thread, 0, RecoveryWriter, journal);
+    if(error) {
+        journal->Active = false;
+        return error;
+    }
+    journal->Writing = true;
+    return 0;
+}
+
+// Writes out what is waiting and waits for it. Returns an errno value, 0 on
+// success.
+static int
+SyncRecovery(Recovery_Journal* journal) {
+    int error = FinishRecoveryWrite(journal);
+    if(!error) error = FlushRecovery(journal);
+    if(!error) error = FinishRecoveryWrite(journal);
+    return error;
+}
+
+// The frame is due, or has grown big enough to go out early, or the one
+// before is written and waits to be collected
+inline b32
+IsRecoveryDue(Recovery_Journal* journal) {
+    if(journal->Writing) return IsRecoveryWritten(journal);
+    if(!journal->Active || !journal->Pending.Used) return false;
+    return journal->Pending.Used >= RECOVERY_FLUSH_BYTES || GetSeconds() >= journal->FlushTime;
+}
+
+// Milliseconds until the frame is due, -1 when there is none waiting
+inline int
+RecoveryTimeout(Recovery_Journal* journal) {
+    if(journal->Writing) return IsRecoveryWritten(journal) ? 0 : RECOVERY_POLL_MS;
+    if(!journal->Active || !journal->Pending.Used) return -1;
+    f64 wait = journal->FlushTime - GetSeconds();
+    return wait > 0 ? (int)(wait * 1000.0) + 1 : 0;
+}
+
+// A save took its snapshot. What is recorded from now on is kept aside too,
+// for the journal that goes with the saved file, also when there was none
+// for the file before (a new one).
+inline void
+BeginRecoverySave(Recovery_Journal* journal) {
+    journal->Saving = true;
+    journal->SinceSave.Used = 0;
+}
+
+// The save failed, the journal goes on as it was
+inline void
+CancelRecoverySave(Recovery_Journal* journal) {
+    journal->Saving = false;
+    journal->SinceSave.Used = 0;
+}
+
+// The save made it to disk as `filename`, which is what the edits go on top
+// of now. The journal starts over with the ones made after the snapshot, and
+// the old one, for a file that is gone, is removed. Returns an errno value, 0
+// on success.
+static int
+RestartRecovery(Recovery_Journal* journal, char* filename) {
+    FinishRecoveryWrite(journal); // Its records are in SinceSave too
+    char* oldPath = journal->Path;
+    b32 hadJournal = (journal->FileHandle != -1);
+    if(hadJournal) close(journal->FileHandle);
+    journal->Path = 0;
+    journal->FileHandle = -1;
+    journal->Saving = false;
+
+    int error = 0;
+    struct stat fileStat;
+    if(stat(filename, &fileStat) == -1) error = errno;
+    else if(!StartRecovery(journal, filename, &fileStat)) error = ENAMETOOLONG;
+    if(!error && journal->SinceSave.Used) error = ReplaceJournal(journal, journal->SinceSave.Data, journal->SinceSave.Used);
+
+    // Unless the new journal took its place
+    if(hadJournal && (journal->FileHandle == -1 || strcmp(oldPath, journal->Path) != 0)) unlink(oldPath);
+    free(oldPath);
+    journal->SinceSave.Used = 0;
+    if(error) journal->Active = false;
+    return error;
+}
+
+// Stops recording. With `keep` set what is waiting is written out and the
+// journal stays for the next start, otherwise it is removed.
+static int
+CloseRecovery(Recovery_Journal* journal, b32 keep) {
+    int error = keep ? SyncRecovery(journal) : FinishRecoveryWrite(journal);
+    if(journal->FileHandle != -1) {
+        close(journal->FileHandle);
+        if(!keep) unlink(journal->Path);
+    }
+    free(journal->Path);
+    FreeBuffer(&journal->Pending);
+    FreeBuffer(&journal->Frame);
+    FreeBuffer(&journal->SinceSave);
+    *journal = {};
+    journal->FileHandle = -1;
+    return error;
+}
+
+inline b32
+GetVarint(Recovery_Reader* reader, size_t* value) {
+    *value = 0;
+    for(u32 shift = 0; shift < 64; shift += 7) {
+        if(reader->At == reader->End) return false;
+        u8 byte = *reader->At++;
+        *value |= (size_t)(byte & 0x7F) << shift;
+        if(!(byte & 0x80)) return true;
+    }
+    return false;
+}
+
+inline b32
+GetRecordText(Recovery_Reader* reader, char** text, size_t* size) {
+    if(!GetVarint(reader, size) || *size > (size_t)(reader->End - reader->At)) return false;
+    *text = (char*)reader->At;
+    reader->At += *size;
+    return true;
+}
+
+// The next record, false at the end or when the rest doesn't read as one
+static b32
+NextRecord(Recovery_Reader* reader, Recovery_Record* record) {
+    if(reader->At == reader->End) return false;
+    *record = {};
+    record->Kind = *reader->At++;
+    switch(record->Kind) {
+        case RecoveryKind_Replace:
+        case RecoveryKind_UndoReplace: {
+            if(!GetRecordText(reader, &record->Text, &record->Size)) return false;
+            if(!GetRecordText(reader, &record->To, &record->ToLength)) return false;
+            if(!GetVarint(reader, &record->MatchCount) || record->MatchCount > (size_t)(reader->End - reader->At) / 2) return false;
+            if(record->MatchCount > reader->MatchCapacity) {
+                free(reader->Matches);
+                reader->MatchCapacity = record->MatchCount;
+                reader->Matches = (Search_Match*)malloc(reader->MatchCapacity * sizeof(Search_Match));
+                Assert(reader->Matches);
+            }
+            size_t line = 0;
+            for(size_t match = 0; match < record->MatchCount; match++) {
+                size_t distance;
+                if(!GetVarint(reader, &distance) || !GetVarint(reader, &reader->Matches[match].Column)) return false;
+                line += distance;
+                reader->Matches[match].Line = line;
+            }
+            record->Matches = reader->Matches;
+            if(record->MatchCount) {
+                record->Y = record->Matches[0].Line;
+                record->X = record->Matches[0].Column;
+            }
+            return true;
+        }
+        default: {
+            if(record->Kind >= RecoveryKind_Count) return false;
+            if(!GetVarint(reader, &record->Y) || !GetVarint(reader, &record->X)) return false;
+        }
+    }
+
+    if(record->Kind == RecoveryKind_Character) {
+        if(reader->At == reader->End) return false;
+        record->Text = (char*)reader->At++;
+        record->Size = 1;
+    } else if(record->Kind == RecoveryKind_Text) {
+        return GetRecordText(reader, &record->Text, &record->Size);
+    } else if(record->Kind == RecoveryKind_Delete) {
+        size_t lines;
+        if(!GetVarint(reader, &lines) || !GetVarint(reader, &record->EndX)) return false;
+        record->EndY = record->Y + lines;
+    }
+    return true;
+}
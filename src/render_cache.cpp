@@ -0,0 +1,288 @@
+// Render cache.
+//
+// Lines don't keep a rendered (tab expanded) copy of themselves. Rows are
+// rendered when they are drawn, and the result is kept in a small LRU cache
+// keyed by the line id and its edit generation, so only the lines that are
+// actually on screen ever get rendered. Syntax colors are worked out at the
+// same time, so the key also has the lexer state the line starts in.
+//
+// With soft wrap an entry also keeps where its rows start, worked out once
+// for the width the screen has.
+//
+// A long line (see line_index.cpp) isn't rendered whole when it scrolls
+// sideways, only a window of columns around the screen, which its index finds
+// without walking the line. Such lines aren't highlighted, lexing them would
+// walk all of them anyway.
+
+#define RENDER_CACHE_SIZE 512
+#define RENDER_CACHE_BUCKETS 1024 // Power of 2
+#define RENDER_WINDOW_STEP 256 // Columns a window starts on a multiple of
+
+struct Render_Entry {
+    u32 LineId;
+    u32 Generation;
+    u8 Language;
+    u8 LexStart;
+    u8 LexEnd; // The state the line ends in
+
+    // Columns asked for, a long line is rendered a window at a time. No
+    // columns for a whole line.
+    size_t WindowStart;
+    size_t WindowColumns;
+
+    size_t FirstColumn; // Of the line, in Cells[0]
+    size_t Size; // Cells, one per column
+    size_t Capacity;
+    Frame_Cell* Cells;
+
+    // First cell of every row, wrapped at WrapWidth (0 until wrapped)
+    size_t WrapWidth;
+    size_t* Breaks;
+    size_t BreakCount;
+    size_t BreakCapacity;
+
+    Render_Entry* HashNext;
+    Render_Entry* Prev; // LRU list, most recent first
+    Render_Entry* Next;
+};
+
+struct Render_Cache {
+    b32 Initialized;
+    Render_Entry Entries[RENDER_CACHE_SIZE];
+    Render_Entry* Buckets[RENDER_CACHE_BUCKETS];
+    Render_Entry Sentinel;
+
+    // Styles of the bytes of the line being rendered
+    u8* ByteStyles;
+    size_t ByteStylesCapacity;
+
+    u32 Hits, Misses;
+};
+
+inline u32
+RenderBucket(u32 lineId) {
+    return (lineId * 2654435761u) & (RENDER_CACHE_BUCKETS - 1);
+}
+
+inline void
+UnlinkEntry(Render_Entry* entry) {
+    entry->Prev->Next = entry->Next;
+    entry->Next->Prev = entry->Prev;
+}
+
+inline void
+LinkEntryFront(Render_Cache* cache, Render_Entry* entry) {
+    entry->Prev = &cache->Sentinel;
+    entry->Next = cache->Sentinel.Next;
+    entry->Next->Prev = entry;
+    cache->Sentinel.Next = entry;
+}
+
+static void
+InitRenderCache(Render_Cache* cache) {
+    cache->Sentinel.Prev = cache->Sentinel.Next = &cache->Sentinel;
+    for(u32 index = 0; index < RENDER_CACHE_SIZE; index++) {
+        LinkEntryFront(cache, cache->Entries + index);
+    }
+    cache->Initialized = true;
+}
+
+// Expands the TABs of the line into cells. Other control bytes would mess up
+// the terminal, they show up as '?' like bytes that aren't UTF-8. ASCII lines
+// and the ASCII runs of the others are copied without decoding. With a
+// language the line is lexed too, and every cell gets the style of its first
+// byte. The TABs line up with entry->FirstColumn as the column of the first
+// byte.
+static void
+RenderLine(Render_Cache* cache, Line_Data* line, Render_Entry* entry, u8 language, u8 lexStart) {
+    size_t tabCount = CountByte(line->Data, line->Size, '\t');
+
+    // A wide character takes 2 columns but at least 3 bytes, so this is enough
+    size_t needed = line->Size + (tabCount*(TAB_WIDTH-1)) + 1; // line->Size already counts 1 for each tab
+    if(needed > entry->Capacity) {
+        free(entry->Cells);
+        entry->Capacity = needed;
+        entry->Cells = (Frame_Cell*)malloc(entry->Capacity * sizeof(Frame_Cell));
+        Assert(entry->Cells);
+    }
+
+    u8* byteStyles = 0;
+    entry->LexEnd = lexStart;
+    if(language != Language_None && line->Size < LONG_LINE_BYTES) {
+        if(line->Size > cache->ByteStylesCapacity) {
+            free(cache->ByteStyles);
+            cache->ByteStylesCapacity = line->Size * 2;
+            cache->ByteStyles = (u8*)malloc(cache->ByteStylesCapacity);
+            Assert(cache->ByteStyles);
+        }
+        byteStyles = cache->ByteStyles;
+        entry->LexEnd = LexLine(language, lexStart, line->Data, line->Size, byteStyles);
+    }
+
+    b32 ascii = IsAsciiLine(line);
+    Frame_Cell* cells = entry->Cells;
+    size_t index = 0;
+    size_t colIndex = 0;
+    while(colIndex < line->Size) {
+        size_t runEnd = ascii ? line->Size : colIndex + FindNonAscii(line->Data + colIndex, line->Size - colIndex);
+        while(colIndex < runEnd) {
+            size_t run = FindControl(line->Data + colIndex, runEnd - colIndex);
+            for(size_t end = colIndex + run; colIndex < end; colIndex++) {
+                u8 byte = line->Data[colIndex];
+                // A colored space looks like any other, don't make it a change of style
+                u8 style = (byteStyles && byte != ' ') ? byteStyles[colIndex] : (u8)CellStyle_Normal;
+                cells[index++] = ByteCell(byte, style);
+            }
+            if(colIndex == runEnd) break;
+
+            u8 style = byteStyles ? byteStyles[colIndex] : (u8)CellStyle_Normal;
+            if(line->Data[colIndex] == '\t') {
+                cells[index++] = ByteCell(' ', CellStyle_Normal);
+                while((entry->FirstColumn + index) % TAB_WIDTH != 0) cells[index++] = ByteCell(' ', CellStyle_Normal);
+            } else {
+                cells[index++] = ByteCell('?', style);
+            }
+            colIndex++;
+        }
+        if(colIndex == line->Size) break;
+
+        u32 codepoint;
+        size_t length = DecodeUtf8(line->Data + colIndex, line->Size - colIndex, &codepoint);
+        u8 style = byteStyles ? byteStyles[colIndex] : (u8)CellStyle_Normal;
+        if(codepoint == UTF8_INVALID || codepoint < 0xA0) { // C1 control or not UTF-8
+            cells[index++] = ByteCell('?', style);
+        } else {
+            index = PutCharacter(cells, index, entry->Capacity, line->Data + colIndex, length, CharWidth(codepoint), style);
+        }
+        colIndex += length;
+    }
+    entry->Size = index;
+    entry->WrapWidth = 0;
+}
+
+// The entry for the line rendered starting in the lexer state `lexStart`, or
+// a free one taken for it, which RenderLine should fill in (*found is false)
+static Render_Entry*
+LookUpEntry(Render_Cache* cache, Line_Data* line, u8 language, u8 lexStart, size_t windowStart, size_t windowColumns, b32* found) {
+    if(!cache->Initialized) InitRenderCache(cache);
+
+    Render_Entry** bucket = cache->Buckets + RenderBucket(line->Id);
+    for(Render_Entry* entry = *bucket; entry; entry = entry->HashNext) {
+        if(entry->LineId == line->Id && entry->Generation == line->Generation && entry->Cells &&
+           entry->Language == language && entry->LexStart == lexStart &&
+           entry->WindowStart == windowStart && entry->WindowColumns == windowColumns) {
+            UnlinkEntry(entry);
+            LinkEntryFront(cache, entry);
+            cache->Hits++;
+            *found = true;
+            return entry;
+        }
+    }
+
+    // Reuse the least recently used entry
+    Render_Entry* entry = cache->Sentinel.Prev;
+    if(entry->Cells) {
+        Render_Entry** link = cache->Buckets + RenderBucket(entry->LineId);
+        while(*link != entry) link = &(*link)->HashNext;
+        *link = entry->HashNext;
+    }
+
+    entry->LineId = line->Id;
+    entry->Generation = line->Generation;
+    entry->Language = language;
+    entry->LexStart = lexStart;
+    entry->WindowStart = windowStart;
+    entry->WindowColumns = windowColumns;
+    entry->HashNext = *bucket;
+    *bucket = entry;
+
+    UnlinkEntry(entry);
+    LinkEntryFront(cache, entry);
+    cache->Misses++;
+    *found = false;
+    return entry;
+}
+
+// Returns the line rendered starting in the lexer state `lexStart`. The entry
+// stays valid until the next lookup evicts it, so use it right away.
+static Render_Entry*
+GetRenderedLine(Render_Cache* cache, Line_Data* line, u8 language, u8 lexStart) {
+    b32 found;
+    Render_Entry* entry = LookUpEntry(cache, line, language, lexStart, 0, 0, &found);
+    if(!found) {
+        entry->FirstColumn = 0;
+        RenderLine(cache, line, entry, language, lexStart);
+    }
+    return entry;
+}
+
+// Like GetRenderedLine, for drawing `columnCount` columns of the line from
+// `column` on. A long line is only rendered around them: Cells[0] is then
+// entry->FirstColumn of the line, which is at or before `column`.
+static Render_Entry*
+GetRenderedColumns(Render_Cache* cache, Line_Index_Cache* indexes, Line_Data* line, u8 language, u8 lexStart,
+                   size_t column, size_t columnCount) {
+    if(line->Size < LONG_LINE_BYTES) return GetRenderedLine(cache, line, language, lexStart);
+
+    // Windows start on a step, so scrolling a little uses the same one
+    size_t windowStart = column - (column % RENDER_WINDOW_STEP);
+    size_t windowColumns = columnCount + RENDER_WINDOW_STEP;
+    b32 found;
+    Render_Entry* entry = LookUpEntry(cache, line, language, lexStart, windowStart, windowColumns, &found);
+    if(found) return entry;
+
+    // From the character covering the first column to the one covering the last
+    size_t start = IndexedRxToCx(indexes, line, windowStart);
+    size_t end = IndexedRxToCx(indexes, line, windowStart + windowColumns - 1);
+    end = NextCharBoundary(line->Data, line->Size, end);
+
+    Line_Data window = {};
+    window.Data = line->Data + start;
+    window.Size = end - start;
+    entry->FirstColumn = start < line->Size ? IndexedCxToRx(indexes, line, start) : windowStart; // Past the end it's empty
+    RenderLine(cache, &window, entry, Language_None, lexStart);
+    return entry;
+}
+
+// Splits the rendered line into rows of `width` cells. A row is cut short
+// instead of splitting a wide character, CountWrapRows counts the same rows.
+static void
+WrapRenderedLine(Render_Entry* entry, size_t width) {
+    if(entry->WrapWidth == width) return;
+
+    entry->BreakCount = 0;
+    size_t start = 0;
+    do {
+        if(entry->BreakCount == entry->BreakCapacity) {
+            entry->BreakCapacity = entry->BreakCapacity ? entry->BreakCapacity * 2 : 16;
+            entry->Breaks = (size_t*)realloc(entry->Breaks, entry->BreakCapacity * sizeof(size_t));
+            Assert(entry->Breaks);
+        }
+        entry->Breaks[entry->BreakCount++] = start;
+
+        size_t next = start + width;
+        if(next < entry->Size && !entry->Cells[next].Length && next - 1 > start) next--; // Right half of a wide one
+        start = next;
+    } while(start < entry->Size);
+    entry->WrapWidth = width;
+}
+
+// The row of a wrapped entry that cell `column` is on
+static size_t
+WrapRowOf(Render_Entry* entry, size_t column) {
+    size_t low = 1;
+    size_t high = entry->BreakCount;
+    while(low < high) {
+        size_t middle = low + (high - low) / 2;
+        if(entry->Breaks[middle] <= column) low = middle + 1;
+        else high = middle;
+    }
+    return low - 1;
+}
+
+// Cells [*start, *end) of row `row` of a wrapped entry
+inline void
+WrapRowCells(Render_Entry* entry, size_t row, size_t* start, size_t* end) {
+    *start = entry->Breaks[row];
+    *end = row + 1 < entry->BreakCount ? entry->Breaks[row + 1] : entry->Size;
+}
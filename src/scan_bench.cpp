@@ -0,0 +1,176 @@
+// Benchmark for the byte scanning kernels.
+//
+// Usage: scan_bench [megabytes] [file]
+// Scans the file (or a generated log-like buffer of the given size) with every
+// kernel set and prints the throughput of the scans the editor does: indexing
+// newlines, counting TABs, finding control bytes and searching for a string.
+
+#include "main.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "scan_kernels.cpp"
+
+static f64
+GetSeconds() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec * 1e-9;
+}
+
+static char*
+GenerateBuffer(size_t size) {
+    char* data = (char*)malloc(size);
+    if(!data) return 0;
+
+    u32 seed = 0x1234567;
+    size_t index = 0;
+    while(index < size) {
+        seed ^= seed << 13; seed ^= seed >> 17; seed ^= seed << 5;
+        size_t lineLength = 40 + (seed % 120);
+        for(size_t column = 0; column < lineLength && index < size; column++) {
+            u32 pick = (seed >> (column % 24)) + column;
+            data[index++] = (column % 37 == 36) ? '\t' : (char)('a' + (pick % 26));
+        }
+        if(index < size) data[index++] = '\n';
+    }
+    return data;
+}
+
+// Splits the whole buffer into lines the way IndexFile does
+static size_t
+CountLines(Scan_Kernels* kernels, char* data, size_t size) {
+    size_t lines = 0;
+    size_t at = 0;
+    while(at < size) {
+        size_t length = kernels->FindByte(data + at, size - at, '\n');
+        at += length + 1;
+        lines++;
+    }
+    return lines;
+}
+
+static size_t
+CountControlRuns(Scan_Kernels* kernels, char* data, size_t size) {
+    size_t runs = 0;
+    size_t at = 0;
+    while(at < size) {
+        at += kernels->FindControl(data + at, size - at) + 1;
+        runs++;
+    }
+    return runs;
+}
+
+// Non-ASCII bytes, found one after the other
+static size_t
+CountNonAscii(Scan_Kernels* kernels, char* data, size_t size) {
+    size_t found = 0;
+    size_t at = 0;
+    while(at < size) {
+        at += kernels->FindNonAscii(data + at, size - at);
+        if(at == size) break;
+        found++;
+        at++;
+    }
+    return found;
+}
+
+static size_t
+CountSubstrings(Scan_Kernels* kernels, char* data, size_t size, char* needle) {
+    size_t needleLength = strlen(needle);
+    size_t matches = 0;
+    size_t at = 0;
+    while(at < size) {
+        at += kernels->FindSubstring(data + at, size - at, needle, needleLength);
+        if(at == size) break;
+        matches++;
+        at++;
+    }
+    return matches;
+}
+
+int main(int argCount, char** args) {
+    size_t size = (size_t)(argCount >= 2 ? atol(args[1]) : 1024) * 1024 * 1024;
+    char* data = 0;
+
+    if(argCount >= 3) {
+        int fileHandle = open(args[2], O_RDONLY);
+        struct stat fileStat;
+        if(fileHandle == -1 || fstat(fileHandle, &fileStat) == -1) {
+            fprintf(stderr, "ERROR: Can't open %s\n", args[2]);
+            return -1;
+        }
+        size = fileStat.st_size;
+        data = (char*)mmap(0, size, PROT_READ, MAP_PRIVATE | MAP_POPULATE, fileHandle, 0);
+        if(data == MAP_FAILED) return -1;
+    } else {
+        data = GenerateBuffer(size);
+        if(!data) {
+            fprintf(stderr, "ERROR: Can't allocate %lu bytes\n", size);
+            return -1;
+        }
+    }
+
+    Scan_Kernels* sets[3] = {&GlobalScalarKernels};
+    int setCount = 1;
+#if SCAN_X86
+    __builtin_cpu_init();
+    if(__builtin_cpu_supports("sse2")) sets[setCount++] = &GlobalSSE2Kernels;
+    if(__builtin_cpu_supports("avx2")) sets[setCount++] = &GlobalAVX2Kernels;
+#endif
+
+    printf("Scanning %.2f MB\n", size / (1024.0*1024.0));
+    printf("%-8s %14s %14s %14s %14s %14s\n", "kernels", "newlines GB/s", "tabs GB/s", "control GB/s", "search GB/s", "ascii GB/s");
+
+    size_t expected[5] = {};
+    f64 baseline[5] = {};
+    for(int setIndex = 0; setIndex < setCount; setIndex++) {
+        Scan_Kernels* kernels = sets[setIndex];
+        size_t results[5];
+        f64 seconds[5];
+
+        f64 start = GetSeconds();
+        results[0] = CountLines(kernels, data, size);
+        seconds[0] = GetSeconds() - start;
+
+        start = GetSeconds();
+        results[1] = kernels->CountByte(data, size, '\t');
+        seconds[1] = GetSeconds() - start;
+
+        start = GetSeconds();
+        results[2] = CountControlRuns(kernels, data, size);
+        seconds[2] = GetSeconds() - start;
+
+        start = GetSeconds();
+        results[3] = CountSubstrings(kernels, data, size, "needle");
+        seconds[3] = GetSeconds() - start;
+
+        start = GetSeconds();
+        results[4] = CountNonAscii(kernels, data, size);
+        seconds[4] = GetSeconds() - start;
+
+        printf("%-8s", kernels->Name);
+        for(int scan = 0; scan < 5; scan++) {
+            if(setIndex == 0) {
+                expected[scan] = results[scan];
+                baseline[scan] = seconds[scan];
+            } else if(results[scan] != expected[scan]) {
+                printf("\nERROR: %s disagrees with scalar (%lu vs %lu)\n", kernels->Name, results[scan], expected[scan]);
+                return -1;
+            }
+            printf(" %8.2f (%4.1fx)", (size / seconds[scan]) / 1e9, baseline[scan] / seconds[scan]);
+        }
+        printf("\n");
+    }
+    InitScanKernels();
+    printf("%lu lines, %lu tabs, the editor uses %s\n", expected[0], expected[1], GlobalScan.Name);
+
+    return 0;
+}
@@ -0,0 +1,353 @@
+// Byte scanning kernels.
+//
+// The loops that look for newlines, TABs, control bytes, non-ASCII bytes and
+// search strings go through these.
+// Each kernel has a scalar version plus SSE2 and AVX2 versions that test 16 or
+// 32 bytes at a time, the best one the CPU supports is picked at startup.
+//
+// All of them return `size` when nothing was found.
+
+#if defined(__x86_64__) || defined(__i386__)
+#define SCAN_X86 1
+#include <immintrin.h>
+#else
+#define SCAN_X86 0
+#endif
+
+typedef size_t Find_Byte(char* data, size_t size, u8 byte);
+typedef size_t Find_Either_Byte(char* data, size_t size, u8 first, u8 second);
+typedef size_t Count_Byte(char* data, size_t size, u8 byte);
+typedef size_t Find_Control(char* data, size_t size); // Bytes below ' ' and DEL
+typedef size_t Find_Substring(char* data, size_t size, char* needle, size_t needleLength);
+typedef size_t Find_Non_Ascii(char* data, size_t size); // Bytes 0x80 and up
+
+struct Scan_Kernels {
+    char* Name;
+    Find_Byte* FindByte;
+    Find_Either_Byte* FindEitherByte;
+    Count_Byte* CountByte;
+    Find_Control* FindControl;
+    Find_Substring* FindSubstring;
+    Find_Non_Ascii* FindNonAscii;
+};
+
+inline b32
+IsControlByte(u8 byte) {
+    return byte < ' ' || byte == 0x7F;
+}
+
+//
+// Scalar
+//
+
+static size_t
+FindByteScalar(char* data, size_t size, u8 byte) {
+    for(size_t index = 0; index < size; index++) {
+        if((u8)data[index] == byte) return index;
+    }
+    return size;
+}
+
+static size_t
+FindEitherByteScalar(char* data, size_t size, u8 first, u8 second) {
+    for(size_t index = 0; index < size; index++) {
+        if((u8)data[index] == first || (u8)data[index] == second) return index;
+    }
+    return size;
+}
+
+static size_t
+CountByteScalar(char* data, size_t size, u8 byte) {
+    size_t count = 0;
+    for(size_t index = 0; index < size; index++) {
+        count += ((u8)data[index] == byte);
+    }
+    return count;
+}
+
+static size_t
+FindControlScalar(char* data, size_t size) {
+    for(size_t index = 0; index < size; index++) {
+        if(IsControlByte(data[index])) return index;
+    }
+    return size;
+}
+
+static size_t
+FindNonAsciiScalar(char* data, size_t size) {
+    size_t index = 0;
+    // 8 bytes at a time, the top bit of each byte is enough
+    for(; index + 8 <= size; index += 8) {
+        u64 chunk;
+        memcpy(&chunk, data + index, 8);
+        if(chunk & 0x8080808080808080ull) break;
+    }
+    for(; index < size; index++) {
+        if((u8)data[index] >= 0x80) return index;
+    }
+    return size;
+}
+
+// Candidates from the first byte, checked with a compare
+static size_t
+FindSubstringScalar(char* data, size_t size, char* needle, size_t needleLength) {
+    if(needleLength == 0) return 0;
+    if(needleLength > size) return size;
+
+    size_t last = size - needleLength + 1; // Past the last position a match can start at
+    size_t at = 0;
+    while(at < last) {
+        at += FindByteScalar(data + at, last - at, needle[0]);
+        if(at == last) break;
+        if(memcmp(data + at + 1, needle + 1, needleLength - 1) == 0) return at;
+        at++;
+    }
+    return size;
+}
+
+#if SCAN_X86
+
+//
+// SSE2
+//
+
+__attribute__((target("sse2"))) static size_t
+FindByteSSE2(char* data, size_t size, u8 byte) {
+    __m128i needle = _mm_set1_epi8(byte);
+    size_t index = 0;
+    for(; index + 16 <= size; index += 16) {
+        __m128i chunk = _mm_loadu_si128((__m128i*)(data + index));
+        u32 mask = _mm_movemask_epi8(_mm_cmpeq_epi8(chunk, needle));
+        if(mask) return index + __builtin_ctz(mask);
+    }
+    return index + FindByteScalar(data + index, size - index, byte);
+}
+
+__attribute__((target("sse2"))) static size_t
+FindEitherByteSSE2(char* data, size_t size, u8 first, u8 second) {
+    __m128i firstNeedle = _mm_set1_epi8(first);
+    __m128i secondNeedle = _mm_set1_epi8(second);
+    size_t index = 0;
+    for(; index + 16 <= size; index += 16) {
+        __m128i chunk = _mm_loadu_si128((__m128i*)(data + index));
+        __m128i found = _mm_or_si128(_mm_cmpeq_epi8(chunk, firstNeedle), _mm_cmpeq_epi8(chunk, secondNeedle));
+        u32 mask = _mm_movemask_epi8(found);
+        if(mask) return index + __builtin_ctz(mask);
+    }
+    return index + FindEitherByteScalar(data + index, size - index, first, second);
+}
+
+__attribute__((target("sse2"))) static size_t
+CountByteSSE2(char* data, size_t size, u8 byte) {
+    __m128i needle = _mm_set1_epi8(byte);
+    __m128i zero = _mm_setzero_si128();
+    size_t count = 0;
+    size_t index = 0;
+    while(index + 16 <= size) {
+        // Per lane byte counters, folded before they can overflow
+        __m128i counters = _mm_setzero_si128();
+        for(int step = 0; step < 255 && index + 16 <= size; step++, index += 16) {
+            __m128i chunk = _mm_loadu_si128((__m128i*)(data + index));
+            counters = _mm_sub_epi8(counters, _mm_cmpeq_epi8(chunk, needle));
+        }
+        __m128i sums = _mm_sad_epu8(counters, zero);
+        count += _mm_cvtsi128_si32(sums) + _mm_cvtsi128_si32(_mm_srli_si128(sums, 8));
+    }
+    return count + CountByteScalar(data + index, size - index, byte);
+}
+
+__attribute__((target("sse2"))) static size_t
+FindControlSSE2(char* data, size_t size) {
+    __m128i space = _mm_set1_epi8(' ' - 1);
+    __m128i del = _mm_set1_epi8(0x7F);
+    size_t index = 0;
+    for(; index + 16 <= size; index += 16) {
+        __m128i chunk = _mm_loadu_si128((__m128i*)(data + index));
+        __m128i low = _mm_cmpeq_epi8(_mm_min_epu8(chunk, space), chunk); // chunk <= 0x1F
+        u32 mask = _mm_movemask_epi8(_mm_or_si128(low, _mm_cmpeq_epi8(chunk, del)));
+        if(mask) return index + __builtin_ctz(mask);
+    }
+    return index + FindControlScalar(data + index, size - index);
+}
+
+// The top bit of every byte is all movemask needs
+__attribute__((target("sse2"))) static size_t
+FindNonAsciiSSE2(char* data, size_t size) {
+    size_t index = 0;
+    for(; index + 16 <= size; index += 16) {
+        u32 mask = _mm_movemask_epi8(_mm_loadu_si128((__m128i*)(data + index)));
+        if(mask) return index + __builtin_ctz(mask);
+    }
+    return index + FindNonAsciiScalar(data + index, size - index);
+}
+
+// Positions where both the first and the last byte of the needle match are
+// found 16 at a time, only those get a full compare.
+__attribute__((target("sse2"))) static size_t
+FindSubstringSSE2(char* data, size_t size, char* needle, size_t needleLength) {
+    if(needleLength < 2) return needleLength ? FindByteSSE2(data, size, needle[0]) : 0;
+    if(needleLength > size) return size;
+
+    __m128i first = _mm_set1_epi8(needle[0]);
+    __m128i last = _mm_set1_epi8(needle[needleLength - 1]);
+    size_t index = 0;
+    for(; index + needleLength - 1 + 16 <= size; index += 16) {
+        __m128i firstBlock = _mm_loadu_si128((__m128i*)(data + index));
+        __m128i lastBlock = _mm_loadu_si128((__m128i*)(data + index + needleLength - 1));
+        u32 mask = _mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(firstBlock, first), _mm_cmpeq_epi8(lastBlock, last)));
+        while(mask) {
+            u32 bit = __builtin_ctz(mask);
+            if(memcmp(data + index + bit + 1, needle + 1, needleLength - 2) == 0) return index + bit;
+            mask &= mask - 1;
+        }
+    }
+    size_t rest = FindSubstringScalar(data + index, size - index, needle, needleLength);
+    return rest == size - index ? size : index + rest;
+}
+
+//
+// AVX2
+//
+
+__attribute__((target("avx2"))) static size_t
+FindByteAVX2(char* data, size_t size, u8 byte) {
+    __m256i needle = _mm256_set1_epi8(byte);
+    size_t index = 0;
+    for(; index + 32 <= size; index += 32) {
+        __m256i chunk = _mm256_loadu_si256((__m256i*)(data + index));
+        u32 mask = _mm256_movemask_epi8(_mm256_cmpeq_epi8(chunk, needle));
+        if(mask) return index + __builtin_ctz(mask);
+    }
+    return index + FindByteSSE2(data + index, size - index, byte);
+}
+
+__attribute__((target("avx2"))) static size_t
+FindEitherByteAVX2(char* data, size_t size, u8 first, u8 second) {
+    __m256i firstNeedle = _mm256_set1_epi8(first);
+    __m256i secondNeedle = _mm256_set1_epi8(second);
+    size_t index = 0;
+    for(; index + 32 <= size; index += 32) {
+        __m256i chunk = _mm256_loadu_si256((__m256i*)(data + index));
+        __m256i found = _mm256_or_si256(_mm256_cmpeq_epi8(chunk, firstNeedle), _mm256_cmpeq_epi8(chunk, secondNeedle));
+        u32 mask = _mm256_movemask_epi8(found);
+        if(mask) return index + __builtin_ctz(mask);
+    }
+    return index + FindEitherByteSSE2(data + index, size - index, first, second);
+}
+
+__attribute__((target("avx2"))) static size_t
+CountByteAVX2(char* data, size_t size, u8 byte) {
+    __m256i needle = _mm256_set1_epi8(byte);
+    __m256i zero = _mm256_setzero_si256();
+    size_t count = 0;
+    size_t index = 0;
+    while(index + 32 <= size) {
+        __m256i counters = _mm256_setzero_si256();
+        for(int step = 0; step < 255 && index + 32 <= size; step++, index += 32) {
+            __m256i chunk = _mm256_loadu_si256((__m256i*)(data + index));
+            counters = _mm256_sub_epi8(counters, _mm256_cmpeq_epi8(chunk, needle));
+        }
+        __m256i sums = _mm256_sad_epu8(counters, zero);
+        count += _mm256_extract_epi64(sums, 0) + _mm256_extract_epi64(sums, 1) +
+                 _mm256_extract_epi64(sums, 2) + _mm256_extract_epi64(sums, 3);
+    }
+    return count + CountByteSSE2(data + index, size - index, byte);
+}
+
+__attribute__((target("avx2"))) static size_t
+FindControlAVX2(char* data, size_t size) {
+    __m256i space = _mm256_set1_epi8(' ' - 1);
+    __m256i del = _mm256_set1_epi8(0x7F);
+    size_t index = 0;
+    for(; index + 32 <= size; index += 32) {
+        __m256i chunk = _mm256_loadu_si256((__m256i*)(data + index));
+        __m256i low = _mm256_cmpeq_epi8(_mm256_min_epu8(chunk, space), chunk);
+        u32 mask = _mm256_movemask_epi8(_mm256_or_si256(low, _mm256_cmpeq_epi8(chunk, del)));
+        if(mask) return index + __builtin_ctz(mask);
+    }
+    return index + FindControlSSE2(data + index, size - index);
+}
+
+__attribute__((target("avx2"))) static size_t
+FindNonAsciiAVX2(char* data, size_t size) {
+    size_t index = 0;
+    for(; index + 32 <= size; index += 32) {
+        u32 mask = _mm256_movemask_epi8(_mm256_loadu_si256((__m256i*)(data + index)));
+        if(mask) return index + __builtin_ctz(mask);
+    }
+    return index + FindNonAsciiSSE2(data + index, size - index);
+}
+
+__attribute__((target("avx2"))) static size_t
+FindSubstringAVX2(char* data, size_t size, char* needle, size_t needleLength) {
+    if(needleLength < 2) return needleLength ? FindByteAVX2(data, size, needle[0]) : 0;
+    if(needleLength > size) return size;
+
+    __m256i first = _mm256_set1_epi8(needle[0]);
+    __m256i last = _mm256_set1_epi8(needle[needleLength - 1]);
+    size_t index = 0;
+    for(; index + needleLength - 1 + 32 <= size; index += 32) {
+        __m256i firstBlock = _mm256_loadu_si256((__m256i*)(data + index));
+        __m256i lastBlock = _mm256_loadu_si256((__m256i*)(data + index + needleLength - 1));
+        u32 mask = _mm256_movemask_epi8(_mm256_and_si256(_mm256_cmpeq_epi8(firstBlock, first), _mm256_cmpeq_epi8(lastBlock, last)));
+        while(mask) {
+            u32 bit = __builtin_ctz(mask);
+            if(memcmp(data + index + bit + 1, needle + 1, needleLength - 2) == 0) return index + bit;
+            mask &= mask - 1;
+        }
+    }
+    size_t rest = FindSubstringSSE2(data + index, size - index, needle, needleLength);
+    return rest == size - index ? size : index + rest;
+}
+
+#endif // SCAN_X86
+
+global Scan_Kernels GlobalScalarKernels = {"scalar", FindByteScalar, FindEitherByteScalar, CountByteScalar, FindControlScalar, FindSubstringScalar, FindNonAsciiScalar};
+#if SCAN_X86
+global Scan_Kernels GlobalSSE2Kernels = {"sse2", FindByteSSE2, FindEitherByteSSE2, CountByteSSE2, FindControlSSE2, FindSubstringSSE2, FindNonAsciiSSE2};
+global Scan_Kernels GlobalAVX2Kernels = {"avx2", FindByteAVX2, FindEitherByteAVX2, CountByteAVX2, FindControlAVX2, FindSubstringAVX2, FindNonAsciiAVX2};
+#endif
+
+global Scan_Kernels GlobalScan = GlobalScalarKernels;
+
+static void
+InitScanKernels() {
+#if SCAN_X86
+    __builtin_cpu_init();
+    if(__builtin_cpu_supports("avx2")) {
+        GlobalScan = GlobalAVX2Kernels;
+    } else if(__builtin_cpu_supports("sse2")) {
+        GlobalScan = GlobalSSE2Kernels;
+    }
+#endif
+}
+
+inline size_t
+FindByte(char* data, size_t size, u8 byte) {
+    return GlobalScan.FindByte(data, size, byte);
+}
+
+inline size_t
+FindEitherByte(char* data, size_t size, u8 first, u8 second) {
+    return GlobalScan.FindEitherByte(data, size, first, second);
+}
+
+inline size_t
+CountByte(char* data, size_t size, u8 byte) {
+    return GlobalScan.CountByte(data, size, byte);
+}
+
+inline size_t
+FindControl(char* data, size_t size) {
+    return GlobalScan.FindControl(data, size);
+}
+
+inline size_t
+FindSubstring(char* data, size_t size, char* needle, size_t needleLength) {
+    return GlobalScan.FindSubstring(data, size, needle, needleLength);
+}
+
+inline size_t
+FindNonAscii(char* data, size_t size) {
+    return GlobalScan.FindNonAscii(data, size);
+}
@@ -0,0 +1,355 @@
+// Screen frames.
+//
+// UpdateScreen draws every frame into a grid of cells. The grid that is on the
+// terminal right now is kept around, and only the spans of cells that differ
+// between the two are written out, each one behind a cursor position escape.
+//
+// A cell holds the UTF-8 bytes of what is shown in it. A wide character fills
+// its cell and the next one, which is left empty (Length 0), and zero-width
+// characters join the cell before them.
+//
+// When the view scrolls by less than a screen, the terminal is told to shift
+// the text rows itself (a DECSTBM scroll region and CSI S/T), and the
+// previous grid is shifted the same way, so only the rows scrolled in differ.
+
+#define FRAME_MERGE_GAP 8 // Unchanged cells worth rewriting to save a cursor move
+#define CELL_TEXT_SIZE 6
+
+enum Cell_Style {
+    CellStyle_Normal,
+    CellStyle_Inverted,
+
+    // Syntax highlighting
+    CellStyle_Comment,
+    CellStyle_Keyword,
+    CellStyle_Type,
+    CellStyle_String,
+    CellStyle_Number,
+    CellStyle_Preprocessor,
+    CellStyle_Error,
+    CellStyle_Warning,
+
+    CellStyle_Count
+};
+
+// SGR escapes, each one starts from the default attributes
+global char* CellStyleEscapes[CellStyle_Count] = {
+    "\x1b[m",      // Normal
+    "\x1b[0;7m",   // Inverted
+    "\x1b[0;36m",  // Comment
+    "\x1b[0;33m",  // Keyword
+    "\x1b[0;32m",  // Type
+    "\x1b[0;35m",  // String
+    "\x1b[0;31m",  // Number
+    "\x1b[0;34m",  // Preprocessor
+    "\x1b[0;1;31m", // Error
+    "\x1b[0;1;33m", // Warning
+};
+
+// Compared as a whole, so the unused bytes of Text stay zero
+struct Frame_Cell {
+    char Text[CELL_TEXT_SIZE];
+    u8 Length; // 0 for the right half of a wide character
+    u8 Style;
+};
+
+struct Screen_Frame {
+    size_t Rows, Columns;
+    Frame_Cell* Cells;
+};
+
+struct Screen_State {
+    Screen_Frame Current;  // The frame being built
+    Screen_Frame Previous; // What the terminal is showing
+    b32 FullRedraw;        // The terminal contents are unknown (first frame, resize)
+
+    size_t CursorRow, CursorColumn;
+    size_t BytesWritten; // By the last frame
+
+    // Rows [ScrollTop, ScrollBottom) move up by ScrollRows (down when
+    // negative) before the next frame is written
+    size_t ScrollTop, ScrollBottom;
+    ssize_t ScrollRows;
+};
+
+inline Frame_Cell
+ByteCell(u8 byte, u8 style) {
+    Frame_Cell cell = {};
+    cell.Text[0] = byte;
+    cell.Length = 1;
+    cell.Style = style;
+    return cell;
+}
+
+inline b32
+CellsEqual(Frame_Cell a, Frame_Cell b) {
+    return memcmp(&a, &b, sizeof(Frame_Cell)) == 0;
+}
+
+inline b32
+IsBlankCell(Frame_Cell cell) {
+    return cell.Length == 1 && cell.Text[0] == ' ' && cell.Style == CellStyle_Normal;
+}
+
+// Blanks the rows [from, to)
+static void
+ClearRows(Screen_Frame* frame, size_t from, size_t to) {
+    Frame_Cell blank = ByteCell(' ', CellStyle_Normal);
+    for(size_t index = from * frame->Columns; index < to * frame->Columns; index++) {
+        frame->Cells[index] = blank;
+    }
+}
+
+inline void
+ClearFrame(Screen_Frame* frame) {
+    ClearRows(frame, 0, frame->Rows);
+}
+
+// Puts the character `bytes` in cells[column] and returns the column after it.
+// A wide one takes the next cell too, or is shown as a space when that is past
+// `columnCount`; a zero-width one joins the cell before it.
+static size_t
+PutCharacter(Frame_Cell* cells, size_t column, size_t columnCount, char* bytes, size_t length, u32 width, u8 style) {
+    if(width == 0) {
+        if(column == 0) return column;
+        Frame_Cell* base = cells + column - 1;
+        if(!base->Length && column >= 2) base--; // Right half of a wide one
+        if(base->Length + length <= CELL_TEXT_SIZE) {
+            memcpy(base->Text + base->Length, bytes, length);
+            base->Length += (u8)length;
+        }
+        return column;
+    }
+    if(column >= columnCount) return column;
+
+    if(width == 2 && column + 1 >= columnCount) {
+        cells[column] = ByteCell(' ', style);
+        return column + 1;
+    }
+
+    Frame_Cell cell = {};
+    memcpy(cell.Text, bytes, length);
+    cell.Length = (u8)length;
+    cell.Style = style;
+    cells[column++] = cell;
+    if(width == 2) {
+        Frame_Cell half = {};
+        half.Style = style;
+        cells[column++] = half;
+    }
+    return column;
+}
+
+// Puts UTF-8 text in cells. Control characters and invalid bytes become '?'.
+static size_t
+PutText(Frame_Cell* cells, size_t column, size_t columnCount, char* text, size_t length, u8 style) {
+    size_t at = 0;
+    while(at < length && column < columnCount) {
+        u8 byte = text[at];
+        if(byte >= ' ' && byte < 0x7F) {
+            cells[column++] = ByteCell(byte, style);
+            at++;
+            continue;
+        }
+
+        u32 codepoint;
+        size_t size = DecodeUtf8(text + at, length - at, &codepoint);
+        if(codepoint < ' ' || (codepoint >= 0x7F && codepoint < 0xA0) || codepoint == UTF8_INVALID) {
+            cells[column++] = ByteCell('?', style);
+        } else {
+            column = PutCharacter(cells, column, columnCount, text + at, size, CharWidth(codepoint), style);
+        }
+        at += size;
+    }
+    return column;
+}
+
+static void
+ResizeScreen(Screen_State* screen, size_t rows, size_t columns) {
+    Screen_Frame* frames[2] = {&screen->Current, &screen->Previous};
+    for(int index = 0; index < 2; index++) {
+        Screen_Frame* frame = frames[index];
+        frame->Rows = rows;
+        frame->Columns = columns;
+        frame->Cells = (Frame_Cell*)realloc(frame->Cells, rows * columns * sizeof(Frame_Cell));
+        Assert(frame->Cells || rows * columns == 0);
+        ClearFrame(frame);
+    }
+    screen->FullRedraw = true;
+}
+
+// Draws `length` bytes of UTF-8 text starting at `column`, clipped to the
+// frame. Returns the column after the text.
+static size_t
+DrawText(Screen_Frame* frame, size_t row, size_t column, char* text, size_t length, u8 style) {
+    if(row >= frame->Rows) return column;
+    return PutText(frame->Cells + row * frame->Columns, column, frame->Columns, text, length, style);
+}
+
+// Copies rendered cells into a row. A wide character cut in half by either
+// edge shows up as a space.
+static void
+DrawCells(Screen_Frame* frame, size_t row, size_t column, Frame_Cell* cells, size_t available) {
+    if(row >= frame->Rows || column >= frame->Columns || !available) return;
+    size_t count = (available < frame->Columns - column) ? available : frame->Columns - column;
+
+    Frame_Cell* target = frame->Cells + row * frame->Columns + column;
+    memcpy(target, cells, count * sizeof(Frame_Cell));
+    if(!target[0].Length) target[0] = ByteCell(' ', target[0].Style);
+    if(count < available && !cells[count].Length) target[count - 1] = ByteCell(' ', target[count - 1].Style);
+}
+
+static void
+FillRow(Screen_Frame* frame, size_t row, u8 character, u8 style) {
+    if(row >= frame->Rows) return;
+
+    Frame_Cell* cells = frame->Cells + row * frame->Columns;
+    for(size_t column = 0; column < frame->Columns; column++) {
+        cells[column] = ByteCell(character, style);
+    }
+}
+
+// The rows [top, bottom) of the view moved up by `rows` (down when negative).
+// A scroll of the whole region or more is drawn from scratch, nothing on the
+// terminal can be reused.
+static void
+ScrollScreen(Screen_State* screen, size_t top, size_t bottom, ssize_t rows) {
+    Assert(!screen->ScrollRows && top < bottom && bottom <= screen->Current.Rows);
+    size_t count = rows < 0 ? -rows : rows;
+    if(count >= bottom - top) {
+        screen->FullRedraw = true;
+        return;
+    }
+    screen->ScrollTop = top;
+    screen->ScrollBottom = bottom;
+    screen->ScrollRows = rows;
+}
+
+inline void
+AppendCursorMove(XBuffer* buffer, size_t row, size_t column) {
+    char move[32];
+    int len = snprintf(move, sizeof(move), "\x1b[%lu;%luH", row + 1, column + 1);
+    AppendToBuffer(buffer, move, len);
+}
+
+inline void
+AppendStyle(XBuffer* buffer, u8 style) {
+    char* escape = CellStyleEscapes[style];
+    AppendToBuffer(buffer, escape, strlen(escape));
+}
+
+// Appends the escapes that turn the previous frame into the current one, then
+// places the cursor. The current frame becomes the previous one.
+static void
+FlushFrame(Screen_State* screen, XBuffer* buffer, size_t cursorRow, size_t cursorColumn) {
+    Screen_Frame* now = &screen->Current;
+    Screen_Frame* old = &screen->Previous;
+    size_t startUsed = buffer->Used;
+
+    if(screen->FullRedraw) {
+        AppendToBuffer(buffer, "\x1b[m\x1b[H\x1b[2J", 10);
+        ClearFrame(old);
+        screen->FullRedraw = false;
+        screen->ScrollRows = 0; // Nothing left to shift
+        screen->CursorRow = (size_t)-1; // Home moved it
+
+    }
+
+    b32 cursorHidden = false;
+    if(screen->ScrollRows) {
+        // The terminal shifts the rows, the ones scrolled in come up blank
+        size_t top = screen->ScrollTop;
+        size_t bottom = screen->ScrollBottom;
+        size_t count = screen->ScrollRows < 0 ? -screen->ScrollRows : screen->ScrollRows;
+        char scroll[64];
+        int len = snprintf(scroll, sizeof(scroll), "\x1b[?25l\x1b[%lu;%lur\x1b[%lu%c\x1b[r",
+                           top + 1, bottom, count, screen->ScrollRows > 0 ? 'S' : 'T');
+        AppendToBuffer(buffer, scroll, len);
+        cursorHidden = true;
+        screen->CursorRow = (size_t)-1; // Setting the region homes it
+
+        // Same for the grid the terminal is showing
+        size_t rowSize = old->Columns * sizeof(Frame_Cell);
+        if(screen->ScrollRows > 0) {
+            memmove(old->Cells + top * old->Columns, old->Cells + (top + count) * old->Columns, (bottom - top - count) * rowSize);
+            ClearRows(old, bottom - count, bottom);
+        } else {
+            memmove(old->Cells + (top + count) * old->Columns, old->Cells + top * old->Columns, (bottom - top - count) * rowSize);
+            ClearRows(old, top, top + count);
+        }
+    }
+    screen->ScrollRows = 0;
+
+    u8 style = CellStyle_Normal;
+    for(size_t row = 0; row < now->Rows; row++) {
+        Frame_Cell* newCells = now->Cells + row * now->Columns;
+        Frame_Cell* oldCells = old->Cells + row * old->Columns;
+
+        // Everything past the last visible cell can be erased with a single escape
+        size_t blankFrom = now->Columns;
+        while(blankFrom > 0 && IsBlankCell(newCells[blankFrom - 1])) blankFrom--;
+
+        size_t column = 0;
+        while(column < now->Columns) {
+            if(CellsEqual(newCells[column], oldCells[column])) {
+                column++;
+                continue;
+            }
+
+            // Extend the changed span, swallowing short runs of unchanged cells
+            size_t end = column + 1;
+            size_t scan = end;
+            while(scan < now->Columns && scan - end <= FRAME_MERGE_GAP) {
+                if(!CellsEqual(newCells[scan], oldCells[scan])) end = scan + 1;
+                scan++;
+            }
+
+            b32 eraseTail = false;
+            if(end > blankFrom) {
+                end = blankFrom > column ? blankFrom : column;
+                eraseTail = true;
+            }
+
+            if(!cursorHidden) {
+                AppendToBuffer(buffer, "\x1b[?25l", 6); // Hide the cursor
+                cursorHidden = true;
+            }
+            // Start with the whole of a wide character
+            if(!newCells[column].Length && column > 0) column--;
+            AppendCursorMove(buffer, row, column);
+
+            for(; column < end; column++) {
+                if(newCells[column].Style != style) {
+                    style = newCells[column].Style;
+                    AppendStyle(buffer, style);
+                }
+                // The right half of a wide character was drawn with its left half
+                if(newCells[column].Length) AppendToBuffer(buffer, newCells[column].Text, newCells[column].Length);
+            }
+
+            if(eraseTail) {
+                if(style != CellStyle_Normal) {
+                    style = CellStyle_Normal;
+                    AppendStyle(buffer, style);
+                }
+                AppendToBuffer(buffer, "\x1b[K", 3); // Erase from the cursor position to the end of the line
+                break;
+            }
+        }
+    }
+
+    if(style != CellStyle_Normal) AppendStyle(buffer, CellStyle_Normal);
+
+    if(cursorHidden || cursorRow != screen->CursorRow || cursorColumn != screen->CursorColumn) {
+        AppendCursorMove(buffer, cursorRow, cursorColumn);
+        if(cursorHidden) AppendToBuffer(buffer, "\x1b[?25h", 6); // Show the cursor again
+        screen->CursorRow = cursorRow;
+        screen->CursorColumn = cursorColumn;
+    }
+
+    Screen_Frame swap = screen->Current;
+    screen->Current = screen->Previous;
+    screen->Previous = swap;
+
+    screen->BytesWritten = buffer->Used - startUsed;
+}
@@ -0,0 +1,269 @@
+// Search.
+//
+// A search finds every match in the document once and keeps them sorted, so
+// moving to the next or previous match is a binary search. Big documents are
+// split into ranges of blocks that worker threads scan at the same time. When
+// the query only grows (the user is still typing it) the new matches are a
+// subset of the old ones, and those are just checked again.
+
+#define SEARCH_MAX_THREADS 8
+#define SEARCH_THREAD_BLOCKS 1024 // Fewer blocks than this per thread isn't worth a thread
+#define SEARCH_MAX_MATCHES (16*1024*1024)
+
+struct Search_Match {
+    size_t Line;
+    size_t Column;
+};
+
+struct Search_Results {
+    char* Query;
+    size_t QueryLength;
+    b32 Valid;     // Matches belong to Query and the text didn't change since
+    b32 Truncated; // Hit SEARCH_MAX_MATCHES
+
+    Search_Match* Matches;
+    size_t Count;
+    size_t Capacity;
+};
+
+// One range of blocks, scanned by one thread
+struct Search_Task {
+    Line_Block** Blocks;
+    size_t BlockCount;
+    size_t FirstLine;
+    char* Query;
+    size_t QueryLength;
+    size_t MatchLimit;
+
+    pthread_t Thread;
+    b32 Threaded;
+    Search_Match* Matches;
+    size_t Count;
+    size_t Capacity;
+    b32 Truncated;
+};
+
+inline b32
+AddMatch(Search_Match** matches, size_t* count, size_t* capacity, size_t line, size_t column) {
+    if(*count == *capacity) {
+        size_t newCapacity = *capacity ? *capacity * 2 : 256;
+        Search_Match* grown = (Search_Match*)realloc(*matches, newCapacity * sizeof(Search_Match));
+        if(!grown) return false;
+        *matches = grown;
+        *capacity = newCapacity;
+    }
+    (*matches)[*count].Line = line;
+    (*matches)[*count].Column = column;
+    (*count)++;
+    return true;
+}
+
+// Adds the matches in one line, false once there are too many
+static b32
+SearchLine(Search_Task* task, char* data, size_t size, size_t lineIndex) {
+    size_t at = 0;
+    while(at < size) {
+        size_t found = at + FindSubstring(data + at, size - at, task->Query, task->QueryLength);
+        if(found >= size) break;
+        if(task->Count == task->MatchLimit ||
+           !AddMatch(&task->Matches, &task->Count, &task->Capacity, lineIndex, found)) {
+            task->Truncated = true;
+            return false;
+        }
+        at = found + 1;
+    }
+    return true;
+}
+
+static void*
+SearchBlocks(void* data) {
+    Search_Task* task = (Search_Task*)data;
+    size_t lineIndex = task->FirstLine;
+    for(size_t rank = 0; rank < task->BlockCount; rank++) {
+        Line_Block* block = task->Blocks[rank];
+        if(IsSpan(block)) {
+            // Straight from the file, split the way the span would be
+            char* text = OpenSpan(block);
+            char* at = text;
+            char* end = text + block->SpanSize;
+            b32 more = true;
+            while(at < end && more) {
+                char* line;
+                size_t size = NextSpanLine(&at, end, &line);
+                more = SearchLine(task, line, size, lineIndex++);
+            }
+            CloseSpan(block, text);
+            if(!more) return 0;
+            continue;
+        }
+
+        for(u32 index = 0; index < block->Count; index++, lineIndex++) {
+            Line_Data* line = block->Lines + index;
+            if(!SearchLine(task, line->Data, line->Size, lineIndex)) return 0;
+        }
+    }
+    return 0;
+}
+
+static int
+SearchThreadCount(size_t blockCount) {
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    size_t threads = blockCount / SEARCH_THREAD_BLOCKS;
+    if(threads > (size_t)cpus) threads = cpus;
+    if(threads > SEARCH_MAX_THREADS) threads = SEARCH_MAX_THREADS;
+    return threads ? (int)threads : 1;
+}
+
+// Scans the whole store for the query
+static void
+SearchStore(Line_Store* store, Search_Results* results) {
+    Store_Snapshot snapshot;
+    TakeSnapshot(store, &snapshot);
+
+    Search_Task tasks[SEARCH_MAX_THREADS] = {};
+    int taskCount = SearchThreadCount(snapshot.BlockCount);
+    size_t blocksPerTask = (snapshot.BlockCount + taskCount - 1) / taskCount;
+    size_t firstBlock = 0;
+    size_t firstLine = 0;
+    for(int taskIndex = 0; taskIndex < taskCount; taskIndex++) {
+        Search_Task* task = tasks + taskIndex;
+        task->Blocks = snapshot.Blocks + firstBlock;
+        task->BlockCount = (snapshot.BlockCount - firstBlock < blocksPerTask) ? snapshot.BlockCount - firstBlock : blocksPerTask;
+        task->FirstLine = firstLine;
+        task->Query = results->Query;
+        task->QueryLength = results->QueryLength;
+        task->MatchLimit = SEARCH_MAX_MATCHES;
+
+        for(size_t rank = 0; rank < task->BlockCount; rank++) {
+            firstLine += BlockLineCount(task->Blocks[rank]);
+        }
+        firstBlock += task->BlockCount;
+    }
+
+    // The first range is scanned right here
+    for(int taskIndex = 1; taskIndex < taskCount; taskIndex++) {
+        Search_Task* task = tasks + taskIndex;
+        task->Threaded = (pthread_create(&task->Thread, 0, SearchBlocks, task) == 0);
+        if(!task->Threaded) SearchBlocks(task);
+    }
+    SearchBlocks(tasks);
+    for(int taskIndex = 1; taskIndex < taskCount; taskIndex++) {
+        if(tasks[taskIndex].Threaded) pthread_join(tasks[taskIndex].Thread, 0);
+    }
+
+    // The ranges are in document order, so the matches come out sorted
+    results->Count = 0;
+    results->Truncated = false;
+    for(int taskIndex = 0; taskIndex < taskCount; taskIndex++) {
+        Search_Task* task = tasks + taskIndex;
+        for(size_t index = 0; index < task->Count && !results->Truncated; index++) {
+            if(results->Count == SEARCH_MAX_MATCHES ||
+               !AddMatch(&results->Matches, &results->Count, &results->Capacity, task->Matches[index].Line, task->Matches[index].Column)) {
+                results->Truncated = true;
+            }
+        }
+        if(task->Truncated) results->Truncated = true;
+        free(task->Matches);
+    }
+
+    ReleaseSnapshot(store, &snapshot);
+}
+
+// Keeps the matches that still match after the query got longer. The
+// matches are sorted, so the blocks are walked once alongside them.
+static void
+RefineSearch(Line_Store* store, Search_Results* results) {
+    Store_Snapshot snapshot;
+    TakeSnapshot(store, &snapshot);
+
+    size_t kept = 0;
+    size_t index = 0;
+    size_t firstLine = 0;
+    for(size_t rank = 0; rank < snapshot.BlockCount && index < results->Count; rank++) {
+        Line_Block* block = snapshot.Blocks[rank];
+        size_t lineCount = BlockLineCount(block);
+
+        // Lines of a span are split off as the matches get to them
+        char* spanText = 0;
+        char* spanAt = 0;
+        char* spanEnd = 0;
+        size_t spanLine = firstLine; // The line at spanAt
+        char* data = 0;
+        size_t size = 0;
+
+        for(; index < results->Count && results->Matches[index].Line < firstLine + lineCount; index++) {
+            Search_Match match = results->Matches[index];
+            if(IsSpan(block)) {
+                if(!spanText) {
+                    spanText = OpenSpan(block);
+                    spanAt = spanText;
+                    spanEnd = spanText + block->SpanSize;
+                }
+                while(spanLine <= match.Line) {
+                    size = NextSpanLine(&spanAt, spanEnd, &data);
+                    spanLine++;
+                }
+            } else {
+                data = block->Lines[match.Line - firstLine].Data;
+                size = block->Lines[match.Line - firstLine].Size;
+            }
+            if(match.Column + results->QueryLength <= size &&
+               memcmp(data + match.Column, results->Query, results->QueryLength) == 0) {
+                results->Matches[kept++] = match;
+            }
+        }
+        if(spanText) CloseSpan(block, spanText);
+        firstLine += lineCount;
+    }
+    results->Count = kept;
+
+    ReleaseSnapshot(store, &snapshot);
+}
+
+// Brings the results up to date with `query`
+static void
+UpdateSearch(Line_Store* store, Search_Results* results, char* query, size_t length) {
+    if(results->Valid && length == results->QueryLength && memcmp(query, results->Query, length) == 0) return;
+
+    b32 refine = results->Valid && !results->Truncated && results->QueryLength &&
+                 length > results->QueryLength && memcmp(query, results->Query, results->QueryLength) == 0;
+
+    free(results->Query);
+    results->Query = (char*)malloc(length + 1);
+    Assert(results->Query);
+    memcpy(results->Query, query, length);
+    results->Query[length] = 0;
+    results->QueryLength = length;
+    results->Valid = true;
+
+    if(!length) {
+        results->Count = 0;
+        results->Truncated = false;
+    } else if(refine) {
+        TRACE_SCOPE("refine search");
+        RefineSearch(store, results);
+    } else {
+        TRACE_SCOPE("search");
+        SearchStore(store, results);
+    }
+}
+
+// Forgets the matches, the text may have changed since
+inline void
+InvalidateSearch(Search_Results* results) {
+    results->Valid = false;
+}
+
+// Index of the first match at or after (line, column), Count when there is none
+static size_t
+FindMatchIndex(Search_Results* results, size_t line, size_t column) {
+    size_t low = 0;
+    size_t high = results->Count;
+    while(low < high) {
+        size_t middle = low + (high - low) / 2;
+        Search_Match match = results->Matches[middle];
+        if(match.Line < line || (match.Line == line && match.Column < column)) low = middle + 1;
+        else high = middle;
+    }
+    return low;
+}
@@ -0,0 +1,351 @@
+// UTF-8.
+//
+// Lines are bytes, the cursor is a byte index, and this is where bytes turn
+// into screen columns. Code points are decoded here and their width (0 for
+// combining marks and other zero-width characters, 2 for East Asian wide ones)
+// comes from a table built once at startup: two bits per code point of the
+// BMP, the few ranges above it are searched.
+//
+// Most text is plain ASCII. Lines remember whether they are (found with the
+// vectorized scan) and how wide they are, so those never get decoded.
+
+#define UTF8_INVALID 0xFFFFFFFF // What a byte that doesn't start a valid sequence decodes to
+
+struct Codepoint_Range {
+    u32 First, Last;
+};
+
+// East Asian Wide and Fullwidth, and emoji
+global Codepoint_Range WideRanges[] = {
+    {0x1100, 0x115F}, {0x231A, 0x231B}, {0x2329, 0x232A}, {0x23E9, 0x23EC}, {0x23F0, 0x23F0},
+    {0x23F3, 0x23F3}, {0x25FD, 0x25FE}, {0x2614, 0x2615}, {0x2648, 0x2653}, {0x267F, 0x267F},
+    {0x2693, 0x2693}, {0x26A1, 0x26A1}, {0x26AA, 0x26AB}, {0x26BD, 0x26BE}, {0x26C4, 0x26C5},
+    {0x26CE, 0x26CE}, {0x26D4, 0x26D4}, {0x26EA, 0x26EA}, {0x26F2, 0x26F3}, {0x26F5, 0x26F5},
+    {0x26FA, 0x26FA}, {0x26FD, 0x26FD}, {0x2705, 0x2705}, {0x270A, 0x270B}, {0x2728, 0x2728},
+    {0x274C, 0x274C}, {0x274E, 0x274E}, {0x2753, 0x2755}, {0x2757, 0x2757}, {0x2795, 0x2797},
+    {0x27B0, 0x27B0}, {0x27BF, 0x27BF}, {0x2B1B, 0x2B1C}, {0x2B50, 0x2B50}, {0x2B55, 0x2B55},
+    {0x2E80, 0x303E}, {0x3041, 0x33FF}, {0x3400, 0x4DBF}, {0x4E00, 0x9FFF}, {0xA000, 0xA4CF},
+    {0xA960, 0xA97F}, {0xAC00, 0xD7A3}, {0xF900, 0xFAFF}, {0xFE10, 0xFE19}, {0xFE30, 0xFE6F},
+    {0xFF00, 0xFF60}, {0xFFE0, 0xFFE6},
+    {0x16FE0, 0x16FE4}, {0x17000, 0x18CD5}, {0x1B000, 0x1B2FF}, {0x1F004, 0x1F004},
+    {0x1F0CF, 0x1F0CF}, {0x1F18E, 0x1F18E}, {0x1F191, 0x1F19A}, {0x1F200, 0x1F251},
+    {0x1F260, 0x1F265}, {0x1F300, 0x1F320}, {0x1F32D, 0x1F335}, {0x1F337, 0x1F37C},
+    {0x1F37E, 0x1F393}, {0x1F3A0, 0x1F3CA}, {0x1F3CF, 0x1F3D3}, {0x1F3E0, 0x1F3F0},
+    {0x1F3F4, 0x1F3F4}, {0x1F3F8, 0x1F43E}, {0x1F440, 0x1F440}, {0x1F442, 0x1F4FC},
+    {0x1F4FF, 0x1F53D}, {0x1F54B, 0x1F54E}, {0x1F550, 0x1F567}, {0x1F57A, 0x1F57A},
+    {0x1F595, 0x1F596}, {0x1F5A4, 0x1F5A4}, {0x1F5FB, 0x1F64F}, {0x1F680, 0x1F6C5},
+    {0x1F6CC, 0x1F6CC}, {0x1F6D0, 0x1F6D2}, {0x1F6D5, 0x1F6D7}, {0x1F6EB, 0x1F6EC},
+    {0x1F6F4, 0x1F6FC}, {0x1F7E0, 0x1F7EB}, {0x1F90C, 0x1F93A}, {0x1F93C, 0x1F945},
+    {0x1F947, 0x1F9FF}, {0x1FA70, 0x1FAFF}, {0x20000, 0x2FFFD}, {0x30000, 0x3FFFD},
+};
+
+// Combining marks, format characters and the other code points that take no column
+global Codepoint_Range ZeroWidthRanges[] = {
+    {0x0300, 0x036F}, {0x0483, 0x0489}, {0x0591, 0x05BD}, {0x05BF, 0x05BF}, {0x05C1, 0x05C2},
+    {0x05C4, 0x05C5}, {0x05C7, 0x05C7}, {0x0610, 0x061A}, {0x064B, 0x065F}, {0x0670, 0x0670},
+    {0x06D6, 0x06DC}, {0x06DF, 0x06E4}, {0x06E7, 0x06E8}, {0x06EA, 0x06ED}, {0x0711, 0x0711},
+    {0x0730, 0x074A}, {0x07A6, 0x07B0}, {0x07EB, 0x07F3}, {0x0816, 0x0819}, {0x081B, 0x0823},
+    {0x0825, 0x0827}, {0x0829, 0x082D}, {0x0859, 0x085B}, {0x08D3, 0x08E1}, {0x08E3, 0x0902},
+    {0x093A, 0x093A}, {0x093C, 0x093C}, {0x0941, 0x0948}, {0x094D, 0x094D}, {0x0951, 0x0957},
+    {0x0962, 0x0963}, {0x0981, 0x0981}, {0x09BC, 0x09BC}, {0x09C1, 0x09C4}, {0x09CD, 0x09CD},
+    {0x09E2, 0x09E3}, {0x0A01, 0x0A02}, {0x0A3C, 0x0A3C}, {0x0A41, 0x0A51}, {0x0A70, 0x0A71},
+    {0x0A75, 0x0A75}, {0x0A81, 0x0A82}, {0x0ABC, 0x0ABC}, {0x0AC1, 0x0AC8}, {0x0ACD, 0x0ACD},
+    {0x0AE2, 0x0AE3}, {0x0B01, 0x0B01}, {0x0B3C, 0x0B3C}, {0x0B3F, 0x0B3F}, {0x0B41, 0x0B44},
+    {0x0B4D, 0x0B4D}, {0x0B56, 0x0B56}, {0x0B62, 0x0B63}, {0x0B82, 0x0B82}, {0x0BC0, 0x0BC0},
+    {0x0BCD, 0x0BCD}, {0x0C00, 0x0C00}, {0x0C3E, 0x0C40}, {0x0C46, 0x0C56}, {0x0C62, 0x0C63},
+    {0x0CBC, 0x0CBC}, {0x0CCC, 0x0CCD}, {0x0CE2, 0x0CE3}, {0x0D00, 0x0D01}, {0x0D41, 0x0D44},
+    {0x0D4D, 0x0D4D}, {0x0D62, 0x0D63}, {0x0DCA, 0x0DCA}, {0x0DD2, 0x0DD6}, {0x0E31, 0x0E31},
+    {0x0E34, 0x0E3A}, {0x0E47, 0x0E4E}, {0x0EB1, 0x0EB1}, {0x0EB4, 0x0EBC}, {0x0EC8, 0x0ECD},
+    {0x0F18, 0x0F19}, {0x0F35, 0x0F35}, {0x0F37, 0x0F37}, {0x0F39, 0x0F39}, {0x0F71, 0x0F7E},
+    {0x0F80, 0x0F84}, {0x0F86, 0x0F87}, {0x0F8D, 0x0FBC}, {0x0FC6, 0x0FC6}, {0x102D, 0x1030},
+    {0x1032, 0x1037}, {0x1039, 0x103A}, {0x103D, 0x103E}, {0x1058, 0x1059}, {0x105E, 0x1060},
+    {0x1071, 0x1074}, {0x1082, 0x1082}, {0x1085, 0x1086}, {0x108D, 0x108D}, {0x109D, 0x109D},
+    {0x1160, 0x11FF}, {0x135D, 0x135F}, {0x1712, 0x1714}, {0x1732, 0x1734}, {0x1752, 0x1753},
+    {0x1772, 0x1773}, {0x17B4, 0x17B5}, {0x17B7, 0x17BD}, {0x17C6, 0x17C6}, {0x17C9, 0x17D3},
+    {0x17DD, 0x17DD}, {0x180B, 0x180E}, {0x18A9, 0x18A9}, {0x1920, 0x1922}, {0x1927, 0x1928},
+    {0x1932, 0x1932}, {0x1939, 0x193B}, {0x1A17, 0x1A18}, {0x1A1B, 0x1A1B}, {0x1A56, 0x1A56},
+    {0x1A58, 0x1A60}, {0x1A62, 0x1A62}, {0x1A65, 0x1A6C}, {0x1A73, 0x1A7F}, {0x1AB0, 0x1AFF},
+    {0x1B00, 0x1B03}, {0x1B34, 0x1B34}, {0x1B36, 0x1B3A}, {0x1B3C, 0x1B3C}, {0x1B42, 0x1B42},
+    {0x1B6B, 0x1B73}, {0x1DC0, 0x1DFF}, {0x200B, 0x200F}, {0x202A, 0x202E}, {0x2060, 0x2064},
+    {0x20D0, 0x20F0}, {0x2CEF, 0x2CF1}, {0x2DE0, 0x2DFF}, {0x302A, 0x302D}, {0x3099, 0x309A},
+    {0xA66F, 0xA672}, {0xA674, 0xA67D}, {0xA69E, 0xA69F}, {0xA6F0, 0xA6F1}, {0xA802, 0xA802},
+    {0xA806, 0xA806}, {0xA80B, 0xA80B}, {0xA825, 0xA826}, {0xFB1E, 0xFB1E}, {0xFE00, 0xFE0F},
+    {0xFE20, 0xFE2F}, {0xFEFF, 0xFEFF},
+    {0x1D167, 0x1D169}, {0x1D173, 0x1D182}, {0x1D185, 0x1D18B}, {0x1D1AA, 0x1D1AD},
+    {0xE0001, 0xE0001}, {0xE0020, 0xE007F}, {0xE0100, 0xE01EF},
+};
+
+// Two bits per BMP code point: the width, 0 to 2
+global u8 GlobalCharWidths[0x10000 / 4];
+
+static void
+SetCharWidths(Codepoint_Range* ranges, size_t count, u32 width) {
+    for(size_t index = 0; index < count; index++) {
+        for(u32 codepoint = ranges[index].First; codepoint <= ranges[index].Last && codepoint < 0x10000; codepoint++) {
+            u8* entry = GlobalCharWidths + codepoint / 4;
+            u32 shift = (codepoint % 4) * 2;
+            *entry = (u8)((*entry & ~(3 << shift)) | (width << shift));
+        }
+    }
+}
+
+static void
+InitCharWidths() {
+    memset(GlobalCharWidths, 0x55, sizeof(GlobalCharWidths)); // Width 1 everywhere
+    SetCharWidths(WideRanges, sizeof(WideRanges) / sizeof(WideRanges[0]), 2);
+    SetCharWidths(ZeroWidthRanges, sizeof(ZeroWidthRanges) / sizeof(ZeroWidthRanges[0]), 0);
+}
+
+static b32
+IsInRanges(Codepoint_Range* ranges, size_t count, u32 codepoint) {
+    size_t low = 0;
+    size_t high = count;
+    while(low < high) {
+        size_t middle = low + (high - low) / 2;
+        if(ranges[middle].Last < codepoint) low = middle + 1;
+        else high = middle;
+    }
+    return low < count && ranges[low].First <= codepoint;
+}
+
+// Columns a decoded code point takes on screen. Control characters and bytes
+// that aren't valid UTF-8 are shown as '?', one column.
+static u32
+CharWidth(u32 codepoint) {
+    if(codepoint < 0x300 || codepoint == UTF8_INVALID) return 1;
+    if(codepoint < 0x10000) return (GlobalCharWidths[codepoint / 4] >> ((codepoint % 4) * 2)) & 3;
+    if(IsInRanges(ZeroWidthRanges, sizeof(ZeroWidthRanges) / sizeof(ZeroWidthRanges[0]), codepoint)) return 0;
+    if(IsInRanges(WideRanges, sizeof(WideRanges) / sizeof(WideRanges[0]), codepoint)) return 2;
+    return 1;
+}
+
+inline b32
+IsContinuationByte(u8 byte) {
+    return (byte & 0xC0) == 0x80;
+}
+
+// Decodes the code point at the start of `data` and returns how many bytes it
+// takes. A byte that doesn't start a valid sequence (stray continuation,
+// overlong form, surrogate, cut short) takes 1 byte and is UTF8_INVALID.
+static size_t
+DecodeUtf8(char* data, size_t size, u32* codepoint) {
+    u8* bytes = (u8*)data;
+    u8 lead = bytes[0];
+    *codepoint = UTF8_INVALID;
+    if(lead < 0x80) {
+        *codepoint = lead;
+        return 1;
+    }
+
+    size_t length;
+    u32 value;
+    u8 low = 0x80, high = 0xBF; // Range of the second byte
+    if(lead >= 0xC2 && lead <= 0xDF) {
+        length = 2;
+        value = lead & 0x1F;
+    } else if(lead >= 0xE0 && lead <= 0xEF) {
+        length = 3;
+        value = lead & 0x0F;
+        if(lead == 0xE0) low = 0xA0;  // Overlong
+        if(lead == 0xED) high = 0x9F; // Surrogates
+    } else if(lead >= 0xF0 && lead <= 0xF4) {
+        length = 4;
+        value = lead & 0x07;
+        if(lead == 0xF0) low = 0x90;  // Overlong
+        if(lead == 0xF4) high = 0x8F; // Past U+10FFFF
+    } else {
+        return 1;
+    }
+
+    if(size < length || bytes[1] < low || bytes[1] > high) return 1;
+    for(size_t index = 1; index < length; index++) {
+        if(!IsContinuationByte(bytes[index])) return 1;
+        value = (value << 6) | (bytes[index] & 0x3F);
+    }
+    *codepoint = value;
+    return length;
+}
+
+// Display columns of the first `cx` bytes of `data`, TABs expanded. ASCII
+// runs are found with the vectorized scan and only TABs are looked at in them.
+static size_t
+CountColumns(char* data, size_t cx, b32 ascii) {
+    size_t rx = 0;
+    size_t at = 0;
+    while(at < cx) {
+        size_t runEnd = ascii ? cx : at + FindNonAscii(data + at, cx - at);
+        while(at < runEnd) {
+            size_t tab = at + FindByte(data + at, runEnd - at, '\t');
+            rx += tab - at;
+            if(tab == runEnd) break;
+            rx += TAB_WIDTH - (rx % TAB_WIDTH);
+            at = tab + 1;
+        }
+        at = runEnd;
+        if(at == cx) break;
+
+        u32 codepoint;
+        at += DecodeUtf8(data + at, cx - at, &codepoint);
+        rx += CharWidth(codepoint);
+    }
+    return rx;
+}
+
+// Works out the width of the line, and whether it is all ASCII, once per edit.
+// Like the lexer state this isn't part of the text, it's written in place.
+inline void
+MeasureLine(Line_Data* line) {
+    if(line->Flags & LineFlag_Measured) return;
+
+    b32 ascii = (FindNonAscii(line->Data, line->Size) == line->Size);
+    size_t width = CountColumns(line->Data, line->Size, ascii);
+    line->Width = width < 0xFFFFFFFF ? (u32)width : 0xFFFFFFFF;
+    line->Flags |= LineFlag_Measured;
+    if(ascii) line->Flags |= LineFlag_Ascii;
+    else line->Flags &= ~LineFlag_Ascii;
+}
+
+inline b32
+IsAsciiLine(Line_Data* line) {
+    MeasureLine(line);
+    return line->Flags & LineFlag_Ascii;
+}
+
+inline size_t
+LineWidth(Line_Data* line) {
+    MeasureLine(line);
+    return line->Width;
+}
+
+inline size_t
+RowsOfColumns(size_t columns, size_t width) {
+    return columns > width ? (columns + width - 1) / width : 1;
+}
+
+// Screen rows the text takes wrapped at `width` columns, at least one. A row
+// ends after `width` columns, or before a wide character the edge would cut
+// in two, the same places WrapRenderedLine breaks the rendered cells.
+static size_t
+CountWrapRows(char* data, size_t size, size_t width) {
+    if(FindNonAscii(data, size) == size) return RowsOfColumns(CountColumns(data, size, true), width);
+
+    size_t rows = 1;
+    size_t rowEnd = width; // Column the current row stops at
+    size_t rx = 0;
+    size_t at = 0;
+    while(at < size) {
+        u32 codepoint = (u8)data[at];
+        size_t length = 1;
+        size_t columns = 1;
+        b32 wide = false; // A TAB is spaces, they can go on the next row
+        if(codepoint == '\t') {
+            columns = TAB_WIDTH - (rx % TAB_WIDTH);
+        } else if(codepoint >= 0x80) {
+            length = DecodeUtf8(data + at, size - at, &codepoint);
+            columns = CharWidth(codepoint);
+            wide = (columns == 2);
+        }
+        at += length;
+        if(!columns) continue;
+
+        while(rx >= rowEnd) {
+            rows++;
+            rowEnd += width;
+        }
+        if(wide && rx + 1 == rowEnd && rx + width > rowEnd) {
+            rows++;
+            rowEnd = rx + width;
+        }
+        rx += columns;
+    }
+    while(rx > rowEnd) {
+        rows++;
+        rowEnd += width;
+    }
+    return rows;
+}
+
+// Screen rows of the line wrapped at `width` columns, worked out once per edit
+// and width and kept in the line like its width
+static size_t
+LineWrapRows(Line_Data* line, size_t width) {
+    if((line->Flags & LineFlag_Wrapped) && line->WrapWidth == width) return line->WrapRows;
+
+    size_t rows = IsAsciiLine(line) ? RowsOfColumns(LineWidth(line), width) : CountWrapRows(line->Data, line->Size, width);
+    line->WrapRows = rows < 0xFFFFFFFF ? (u32)rows : 0xFFFFFFFF;
+    line->WrapWidth = (u32)width;
+    line->Flags |= LineFlag_Wrapped;
+    return line->WrapRows;
+}
+
+// Screen column of the byte `cx` of the line
+static size_t
+LineCxToRx(Line_Data* line, size_t cx) {
+    if(cx > line->Size) cx = line->Size;
+    if(cx == line->Size) return LineWidth(line);
+    return CountColumns(line->Data, cx, IsAsciiLine(line));
+}
+
+// Offset of the byte on screen column `rx` in text that starts on `column`,
+// or of the character covering it. Past the end of the text it's the size.
+static size_t
+ColumnToByte(char* data, size_t size, b32 ascii, size_t column, size_t rx) {
+    size_t at = 0;
+    while(at < size) {
+        u32 codepoint = (u8)data[at];
+        size_t length = 1;
+        size_t width = 1;
+        if(codepoint == '\t') {
+            width = TAB_WIDTH - (column % TAB_WIDTH);
+        } else if(!ascii && codepoint >= 0x80) {
+            length = DecodeUtf8(data + at, size - at, &codepoint);
+            width = CharWidth(codepoint);
+        }
+        if(column + width > rx && width) return at;
+        column += width;
+        at += length;
+    }
+    return size;
+}
+
+// Byte of the line that is on screen column `rx`, or the start of the
+// character covering it. Past the end of the line it's the end.
+inline size_t
+LineRxToCx(Line_Data* line, size_t rx) {
+    return ColumnToByte(line->Data, line->Size, IsAsciiLine(line), 0, rx);
+}
+
+// Where the character after the one at `at` starts. Zero-width characters
+// (combining marks) go with the one before them.
+static size_t
+NextCharBoundary(char* data, size_t size, size_t at) {
+    if(at >= size) return size;
+    u32 codepoint;
+    at += DecodeUtf8(data + at, size - at, &codepoint);
+    while(at < size && (u8)data[at] >= 0x80) {
+        size_t length = DecodeUtf8(data + at, size - at, &codepoint);
+        if(CharWidth(codepoint) != 0) break;
+        at += length;
+    }
+    return at;
+}
+
+// Where the character before `at` starts
+static size_t
+PrevCharBoundary(char* data, size_t size, size_t at) {
+    while(at > 0) {
+        size_t start = at - 1;
+        // At most 3 continuation bytes belong to a lead byte
+        while(start > 0 && at - start < 4 && IsContinuationByte(data[start])) start--;
+        u32 codepoint;
+        if(start + DecodeUtf8(data + start, size - start, &codepoint) != at) {
+            // Not one sequence, step back a single byte
+            start = at - 1;
+            codepoint = UTF8_INVALID;
+        }
+
+        at = start;
+        if(codepoint == UTF8_INVALID || CharWidth(codepoint) != 0) break;
+    }
+    return at;
+}